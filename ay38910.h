@@ -0,0 +1,268 @@
+#pragma once
+/*#
+    # ay38910.h
+
+    AY-3-8910 sound chip, rewritten for zx2040: the original chips
+    emulator is ticked at the CPU clock, that is way too slow for the
+    RP2040. Here the Z80 side only records register writes into a
+    queue, and the chip is synthesized by the second core, one sample
+    at a time, in fixed point.
+
+    Do this:
+    ~~~C
+    #define CHIPS_IMPL
+    ~~~
+    before you include this file in *one* C or C++ file to create the
+    implementation.
+
+    ## Register writes queue
+
+    The queue is single producer (the emulator core, from zx_exec()) and
+    single consumer (the audio core), lock free: the producer only writes
+    'head', the consumer only writes 'tail'. Each write is tagged with
+    the audio sample number at which it happened, so that the consumer
+    can apply it exactly when playing that sample, even if it is playing
+    the previous buffer while the Z80 runs ahead. When the queue is full
+    writes are dropped (and counted): the AY registers are still mirrored
+    in zx_t, so the next write of the same register fixes the sound.
+
+    ## Synthesis
+
+    ay38910_sample() advances the tone, noise and envelope generators by
+    one sample and returns the mixed output of the three channels. Its
+    cost does not depend on the register values (no loop depends on the
+    periods), so the work per sample is bounded and can be
+    measured, see audio_irq() in zx.c.
+
+    ## MIT license
+
+    Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+    This code is released under the MIT license.
+    See the LICENSE file for more info.
+#*/
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AY38910_CLOCK_ZX (1773447)  // Spectrum 128 and Melodik AY clock.
+#define AY38910_MAX_LEVEL (3*21)    // Max ay38910_sample() output.
+
+#define AY38910_QUEUE_LEN 128       // Must be power of 2.
+#define AY38910_QUEUE_RESET 0xff    // 'reg' value that resets the chip.
+
+// Register writes queue entry.
+typedef struct {
+    uint32_t sample;    // Audio sample number of the write.
+    uint8_t reg;        // Register, or AY38910_QUEUE_RESET.
+    uint8_t val;
+} ay38910_write_t;
+
+typedef struct {
+    volatile uint32_t head;     // Next entry to write. Producer only.
+    volatile uint32_t tail;     // Next entry to read. Consumer only.
+    uint32_t dropped;           // Writes lost because the queue was full.
+    ay38910_write_t entry[AY38910_QUEUE_LEN];
+} ay38910_queue_t;
+
+// Chip state, only used by the consumer.
+typedef struct {
+    uint8_t regs[16];
+    uint32_t step;              // Tone generator ticks per sample, 16.16.
+    uint32_t env_step;          // Envelope generator ticks per sample, 20.12.
+    uint32_t tone_count[3];     // 16.16
+    uint32_t tone_out;          // Bit N is the square wave of channel N.
+    uint32_t noise_count;       // 16.16
+    uint32_t noise_lfsr;        // 17 bit shift register.
+    uint32_t noise_out;         // 0 or 7: one bit for each channel.
+    uint32_t env_count;         // 20.12
+    uint32_t env_pos;           // Envelope step in the cycle, 0-15.
+    uint32_t env_inv;           // 0 or 15: XORed to env_pos.
+    bool env_hold;
+    bool active;                // Set by the first register write.
+} ay38910_t;
+
+// producer: queue a register write (or reset) for the audio sample 'sample'
+bool ay38910_queue_push(ay38910_queue_t* q, uint32_t sample, uint8_t reg, uint8_t val);
+// consumer: apply all the queued writes up to the audio sample 'sample' (included)
+void ay38910_queue_apply(ay38910_queue_t* q, ay38910_t* ay, uint32_t sample);
+// set the chip clock and the rate ay38910_sample() is called at
+void ay38910_set_rate(ay38910_t* ay, uint32_t clock, uint32_t sample_rate);
+// reset the chip registers and generators
+void ay38910_reset(ay38910_t* ay);
+// write a chip register
+void ay38910_write(ay38910_t* ay, uint8_t reg, uint8_t val);
+// advance the chip by one sample, returns 0 - AY38910_MAX_LEVEL
+uint32_t ay38910_sample(ay38910_t* ay);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+/*-- IMPLEMENTATION ----------------------------------------------------------*/
+#ifdef CHIPS_IMPL
+#include <string.h>
+
+// Registers.
+#define _AY_PERIOD_A_FINE (0)
+#define _AY_NOISE_PERIOD (6)
+#define _AY_ENABLE (7)
+#define _AY_AMP_A (8)
+#define _AY_ENV_PERIOD_FINE (11)
+#define _AY_ENV_PERIOD_COARSE (12)
+#define _AY_ENV_SHAPE (13)
+
+// Output of a channel at each volume level. The DAC is logarithmic,
+// about 3 dB per step, scaled so that the three channels together
+// are about as loud as the beeper (see the audio core in zx.c).
+static const uint8_t _ay_volume[16] = {
+    0, 0, 0, 0, 1, 1, 1, 2, 3, 4, 6, 7, 10, 13, 17, 21
+};
+
+// Register bits actually implemented, reads of the other bits return 0.
+static const uint8_t _ay_reg_mask[16] = {
+    0xff, 0x0f, 0xff, 0x0f, 0xff, 0x0f, 0x1f, 0xff,
+    0x1f, 0x1f, 0x1f, 0xff, 0xff, 0x0f, 0xff, 0xff
+};
+
+bool ay38910_queue_push(ay38910_queue_t* q, uint32_t sample, uint8_t reg, uint8_t val) {
+    uint32_t head = q->head;
+    if (head - q->tail == AY38910_QUEUE_LEN) {
+        q->dropped++;
+        return false;
+    }
+    ay38910_write_t* w = &q->entry[head & (AY38910_QUEUE_LEN-1)];
+    w->sample = sample;
+    w->reg = reg;
+    w->val = val;
+    // The entry must be visible to the other core before the new head.
+    __sync_synchronize();
+    q->head = head+1;
+    return true;
+}
+
+void ay38910_queue_apply(ay38910_queue_t* q, ay38910_t* ay, uint32_t sample) {
+    uint32_t tail = q->tail;
+    while (tail != q->head) {
+        __sync_synchronize(); // Read the entry after the head.
+        const ay38910_write_t* w = &q->entry[tail & (AY38910_QUEUE_LEN-1)];
+        // Sample numbers wrap around: compare the difference.
+        if ((int32_t)(w->sample - sample) > 0) break;
+        if (w->reg == AY38910_QUEUE_RESET) {
+            ay38910_reset(ay);
+        } else {
+            ay38910_write(ay, w->reg, w->val);
+        }
+        tail++;
+    }
+    q->tail = tail;
+}
+
+void ay38910_set_rate(ay38910_t* ay, uint32_t clock, uint32_t sample_rate) {
+    // Tone counters tick at clock/8, the noise at clock/16, the
+    // envelope at clock/256.
+    ay->step = (uint32_t)(((uint64_t)clock<<13)/sample_rate);
+    ay->env_step = (uint32_t)(((uint64_t)clock<<4)/sample_rate);
+}
+
+void ay38910_reset(ay38910_t* ay) {
+    const uint32_t step = ay->step, env_step = ay->env_step;
+    memset(ay, 0, sizeof(*ay));
+    ay->step = step;
+    ay->env_step = env_step;
+    ay->noise_lfsr = 1;
+    ay->regs[_AY_ENABLE] = 0xff;
+}
+
+void ay38910_write(ay38910_t* ay, uint8_t reg, uint8_t val) {
+    reg &= 15;
+    ay->regs[reg] = val & _ay_reg_mask[reg];
+    ay->active = true;
+    if (reg == _AY_ENV_SHAPE) {
+        // Writing the shape restarts the envelope.
+        ay->env_count = 0;
+        ay->env_pos = 0;
+        ay->env_inv = (val & (1<<2)) ? 0 : 15; // Attack or decay.
+        ay->env_hold = false;
+    }
+}
+
+// Advance the envelope by one step, handling the end of the cycle
+// according to the shape bits: continue, attack, alternate, hold.
+static void _ay_env_step(ay38910_t* ay) {
+    if (ay->env_hold || ++ay->env_pos < 16) return;
+    const uint8_t shape = ay->regs[_AY_ENV_SHAPE];
+    ay->env_pos = 15;
+    if (!(shape & (1<<3))) {
+        // Shapes 0-7: a single cycle, then silence.
+        ay->env_inv = 15;
+        ay->env_hold = true;
+    } else if (shape & (1<<0)) {
+        // Hold: stay at the last level, or the opposite one if alternate.
+        if (shape & (1<<1)) ay->env_inv ^= 15;
+        ay->env_hold = true;
+    } else {
+        if (shape & (1<<1)) ay->env_inv ^= 15;
+        ay->env_pos = 0;
+    }
+}
+
+uint32_t ay38910_sample(ay38910_t* ay) {
+    const uint8_t* r = ay->regs;
+
+    // Tone generators: the square wave flips every 'period' ticks.
+    // A period of zero works like 1. Periods shorter than a sample
+    // are ultrasonic anyway, so at most one flip per sample.
+    for (int c = 0; c < 3; c++) {
+        uint32_t period = r[_AY_PERIOD_A_FINE+c*2] | (r[_AY_PERIOD_A_FINE+c*2+1]<<8);
+        if (period == 0) period = 1;
+        period <<= 16;
+        ay->tone_count[c] += ay->step;
+        if (ay->tone_count[c] >= period) {
+            ay->tone_count[c] -= period;
+            if (ay->tone_count[c] >= period) ay->tone_count[c] = 0;
+            ay->tone_out ^= 1<<c;
+        }
+    }
+
+    // Noise generator, at half the tone clock.
+    uint32_t period = r[_AY_NOISE_PERIOD];
+    if (period == 0) period = 1;
+    period <<= 16;
+    ay->noise_count += ay->step>>1;
+    if (ay->noise_count >= period) {
+        ay->noise_count -= period;
+        if (ay->noise_count >= period) ay->noise_count = 0;
+        uint32_t bit = (ay->noise_lfsr ^ (ay->noise_lfsr>>3)) & 1;
+        ay->noise_lfsr = (ay->noise_lfsr>>1) | (bit<<16);
+        ay->noise_out = (ay->noise_lfsr & 1) ? 7 : 0;
+    }
+
+    // Envelope generator.
+    period = r[_AY_ENV_PERIOD_FINE] | (r[_AY_ENV_PERIOD_COARSE]<<8);
+    if (period == 0) period = 1;
+    period <<= 12;
+    ay->env_count += ay->env_step;
+    if (ay->env_count >= period) {
+        ay->env_count -= period;
+        if (ay->env_count >= period) ay->env_count = 0;
+        _ay_env_step(ay);
+    }
+    const uint32_t env_vol = ay->env_pos ^ ay->env_inv;
+
+    // Mixer: the enable register bits are active low, a disabled
+    // source counts as always high. Bits 0-2 tone, 3-5 noise.
+    const uint32_t enable = r[_AY_ENABLE];
+    const uint32_t on = (ay->tone_out | enable) & (ay->noise_out | (enable>>3));
+    uint32_t out = 0;
+    for (int c = 0; c < 3; c++) {
+        if (!(on & (1<<c))) continue;
+        const uint8_t amp = r[_AY_AMP_A+c];
+        out += _ay_volume[(amp & 0x10) ? env_vol : (amp & 15)];
+    }
+    return out;
+}
+
+#endif // CHIPS_IMPL
@@ -86,6 +86,14 @@
  * Pico serial output to see the update time, and switch to bit banging if
  * needed. */
 // #define st77_spi_bb
+
+/* PIO SPI:
+ *
+ * As fast as bit banging (or faster, up to spi_pio_rate), but the transfer
+ * is performed by a PIO state machine fed by DMA, so it costs no CPU time.
+ * Uses one state machine of pio_channel (pio0 by default). */
+// #define st77_spi_pio
+// #define spi_pio_rate 62500000
 #endif
 
 // For parallel 8 lines display, fill the configuration here:
@@ -120,6 +128,19 @@
                             // In practical terms, if colors look "inverted"
                             // (yellow is cyan and the contrary) set to 1.
 
+// The Spectrum has just 16 colors, so sending pixels with 12 bits (RGB444)
+// instead of 16 bits (RGB565) loses nothing visible, and transfers 25%
+// less data: uncomment to start in 12 bit mode. Can be toggled in the
+// menu too ("rgb444"). Needs an even st77_width.
+// #define st77_rgb444
+
+// If your display module exposes the TE (tearing effect) pin, connect it
+// to a GPIO and set it here: the updates are timed with the display
+// refresh, so that fast moving games don't show a tearing line. Works
+// best when the display refreshes along the rows, that is, in portrait
+// mode on the usual panels: see st77xx.h for the details.
+// #define st77_te 9
+
 /* =========================== SCREEN RENDERING CONFIG =======================
  * Here you can set how the Spectrum video memory is rendered on your display.
  * You can select the scaling level and if to visualize or not the border.
@@ -133,10 +154,19 @@
  * disable borders and use an upscaling of 125, so that the 256x192 bitmap
  * area gets scaled exactly to 320x240.
  *
- * Scaling factors supported: 50%, 75%, 84%, 100%, 112%, 125%, 150%, 200%.
+ * The scaling is a percentage, up to 200%. 50%, 75%, 87%, 100%, 112%,
+ * 125%, 150% and 200% (the values of the menu) are the fastest. With 0
+ * the image is scaled to fit the display. The image is always centered,
+ * and when borders are enabled the area around it shows the border color.
+ *
+ * When the scaling is less than 100%, some Spectrum pixels are dropped,
+ * so thin lines and text may vanish. With smooth downscaling, display
+ * pixels covering both ink and paper show the average of the two colors.
+ * It is a bit slower, and can be toggled in the menu.
  */
-#define DEFAULT_DISPLAY_SCALING 100  // Not all values possible, see above.
+#define DEFAULT_DISPLAY_SCALING 100  // Percentage, or 0 to fit, see above.
 #define DEFAULT_DISPLAY_BORDERS 1    // 0 = no borders. 1 = borders.
+#define DEFAULT_DISPLAY_SMOOTH 1     // 0 = drop pixels. 1 = smooth.
 
 // Partial updates make the emulator MUCH faster. The sound timing may be
 // a bit less stable, but if your display is slow to update, it's recommended
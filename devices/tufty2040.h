@@ -20,8 +20,9 @@
 
 /* ============================= DISPLAY CONFIGURATION ====================== */
 
-#define DEFAULT_DISPLAY_SCALING 125 // Not all values possible. See README.
+#define DEFAULT_DISPLAY_SCALING 125 // Percentage, 0 = fit. See README.
 #define DEFAULT_DISPLAY_BORDERS 0   // 0 = no borders. 1 = borders.
+#define DEFAULT_DISPLAY_SMOOTH 1    // Smooth downscaling. See README.
 #define DEFAULT_DISPLAY_PARTIAL_UPDATE 0 // The display is fast enough so
                                          // stable timing is likely better.
 
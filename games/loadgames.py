@@ -9,8 +9,11 @@ import os, subprocess, struct
 base_address = 0x1007f000
 offset = 0
 
-# List of .z80 files sorted alphabetically
-z80_files = sorted([f for f in os.listdir('z80') if f.endswith('.z80')])
+# List of .z80, .sna, .tap and .tzx files sorted alphabetically, with the format
+# tag stored in the blob, so that the emulator can use the right loader.
+formats = {'.z80': b'Z', '.sna': b'S', '.tap': b'T', '.tzx': b'T'}
+z80_files = sorted([f for f in os.listdir('z80')
+                    if os.path.splitext(f)[1].lower() in formats])
 
 # Concatenate files with headers
 with open('games.bin', 'wb') as bin_file:
@@ -18,12 +21,15 @@ with open('games.bin', 'wb') as bin_file:
     # start of the games section, and to detect if there user
     # failed to update the games at all (and in such case, it
     # will display a message).
-    bin_file.write(b'ZX2040GAMESBLOB!')
+    # The last char is the blob version: '2' means that each
+    # game header includes the format tag.
+    bin_file.write(b'ZX2040GAMESBLOB2')
 
     for z80_file in z80_files:
         # Get the filename without the extension
         name_part = z80_file.split('.')[0]
         name_len = len(name_part)
+        format_tag = formats[os.path.splitext(z80_file)[1].lower()]
         
         # Open the source .z80 file
         with open("z80/"+z80_file, 'rb') as file:
@@ -31,8 +37,8 @@ with open('games.bin', 'wb') as bin_file:
             data_size = len(data)
             
             # Write the header: uint8_t for name length, name as bytes,
-			# uint32_t for data size
-            header = struct.pack(f'<B{name_len}sI', name_len, name_part.encode(), data_size)
+			# format tag, uint32_t for data size
+            header = struct.pack(f'<B{name_len}scI', name_len, name_part.encode(), format_tag, data_size)
             bin_file.write(header)
             # Write the data
             bin_file.write(data)
@@ -111,7 +111,13 @@ typedef struct {
     // currently active lines
     uint16_t active_lines;
     // map key ASCII code to modifier/column/line bits
+#ifdef KBD_COMPACT_KEY_MASKS
+    // packed as |V|MMMM|CCCC|LLLL| (valid flag, modifier mask, column and
+    // line index), expanded to the full mask by _kbd_key_mask()
+    uint16_t key_masks[KBD_MAX_KEYS];
+#else
     uint32_t key_masks[KBD_MAX_KEYS];
+#endif
     // column/line bits for modifier keys
     uint32_t mod_masks[KBD_MAX_MOD_KEYS];
     // currently pressed keys (bitmask==0 is empty slot)
@@ -220,7 +226,25 @@ void kbd_register_key(kbd_t* kbd, int key, int column, int line, int mod_mask) {
     CHIPS_ASSERT((key >= 0) && (key < KBD_MAX_KEYS));
     CHIPS_ASSERT((column >= 0) && (column < KBD_MAX_COLUMNS));
     CHIPS_ASSERT((line >= 0) && (line < KBD_MAX_LINES));
+#ifdef KBD_COMPACT_KEY_MASKS
+    CHIPS_ASSERT((mod_mask >= 0) && (mod_mask < (1<<KBD_MAX_MOD_KEYS)));
+    kbd->key_masks[key] = (1<<15) | (mod_mask<<8) | (column<<4) | line;
+#else
     kbd->key_masks[key] = (mod_mask << (KBD_MAX_COLUMNS+KBD_MAX_LINES)) | (1<<(column+KBD_MAX_LINES)) | (1<<line);
+#endif
+}
+
+// get the 32-bit modifier/column/line mask of a registered key
+static uint32_t _kbd_key_mask(kbd_t* kbd, int key) {
+#ifdef KBD_COMPACT_KEY_MASKS
+    uint32_t packed = kbd->key_masks[key];
+    if (!(packed & (1<<15))) return 0; // not registered
+    return (((packed>>8) & 0xF) << (KBD_MAX_COLUMNS+KBD_MAX_LINES)) |
+           (1<<(((packed>>4) & 0xF)+KBD_MAX_LINES)) |
+           (1<<(packed & 0xF));
+#else
+    return kbd->key_masks[key];
+#endif
 }
 
 // extract column bits from a 32-bit key mask
@@ -356,7 +380,7 @@ void kbd_key_down(kbd_t* kbd, int key) {
         key_state_t* k = &kbd->key_buffer[i];
         if (0 == k->mask) {
             k->key = key;
-            k->mask = kbd->key_masks[key];
+            k->mask = _kbd_key_mask(kbd,key);
             k->pressed_time = kbd->cur_time;
             k->released = false;
             _kbd_update_scanout_masks(kbd);
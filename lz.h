@@ -0,0 +1,153 @@
+/* Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+ * This code is released under the MIT license.
+ * See the LICENSE file for more info.
+ *
+ * Minimal LZ77 compressor / decompressor, used for save states.
+ * Designed to be fast on the RP2040 rather than to compress very well.
+ *
+ * The compressed stream is a sequence of tokens. Each token starts with
+ * a control byte 'c':
+ *
+ * c < 0x80:  literal run, the next c+1 bytes are copied verbatim.
+ * c >= 0x80: match of (c&0x7f)+3 bytes, followed by two bytes of
+ *            little endian distance-1, copied from the already
+ *            decompressed output.
+ *
+ * The compressor can be called multiple times on consecutive parts of
+ * the same input buffer, so that the output can be consumed in chunks
+ * (for instance to write flash sectors one after the other) while
+ * matches can still refer to all the previous input. */
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS 10
+#define LZ_HASH_SIZE (1<<LZ_HASH_BITS)
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (0x7f+LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS 0x80
+#define LZ_MAX_DISTANCE 0x10000
+
+// Worst case output size for 'len' bytes of input, when compressed in a
+// single call. A literal run costs one control byte, so a match breaking
+// a run must save at least one byte: after literals the compressor only
+// takes matches of LZ_MIN_MATCH+1 bytes or more. Then only the control
+// bytes of long runs and of the last one add to the input size.
+#define LZ_MAX_COMPRESSED(len) ((len)+(len)/LZ_MAX_LITERALS+1)
+
+// Bytes lz_emit_literals() writes for a run of 'len' literals.
+#define LZ_LITERALS_SIZE(len) \
+    ((len)+((len)+LZ_MAX_LITERALS-1)/LZ_MAX_LITERALS)
+
+// Compressor state. The input buffer must be smaller than 64k, since
+// positions are stored as 16 bit offsets.
+typedef struct {
+    uint16_t htab[LZ_HASH_SIZE];
+} lz_t;
+
+// Reset the compressor state. Must be called before compressing a new
+// input buffer.
+static inline void lz_init(lz_t *lz) {
+    memset(lz->htab,0,sizeof(lz->htab));
+}
+
+static inline uint32_t lz_hash(const uint8_t *p) {
+    uint32_t v = p[0] | (p[1]<<8) | (p[2]<<16);
+    return (v*2654435761U) >> (32-LZ_HASH_BITS);
+}
+
+// Emit a literal run. Return the number of bytes written to 'dst'.
+static inline uint32_t lz_emit_literals(const uint8_t *lit, uint32_t len,
+                                        uint8_t *dst)
+{
+    uint8_t *d = dst;
+    while (len) {
+        uint32_t run = len > LZ_MAX_LITERALS ? LZ_MAX_LITERALS : len;
+        *d++ = run-1;
+        memcpy(d,lit,run);
+        d += run;
+        lit += run;
+        len -= run;
+    }
+    return d-dst;
+}
+
+// Compress base[start..end-1] into 'dst', matches may refer to any byte
+// of 'base' before the current position. Returns the number of bytes
+// written, or 0 if 'dstlen' is not enough: LZ_MAX_COMPRESSED(end-start)
+// is always enough.
+static inline uint32_t lz_compress(lz_t *lz, const uint8_t *base,
+                                   uint32_t start, uint32_t end,
+                                   uint8_t *dst, uint32_t dstlen)
+{
+    uint32_t i = start, lit = start, out = 0;
+
+    while (i+LZ_MIN_MATCH <= end) {
+        uint32_t h = lz_hash(base+i);
+        uint32_t cand = lz->htab[h];
+        lz->htab[h] = i;
+
+        if (cand >= i || i-cand > LZ_MAX_DISTANCE ||
+            memcmp(base+cand,base+i,LZ_MIN_MATCH) != 0)
+        {
+            i++;
+            continue;
+        }
+
+        // Match found: extend it.
+        uint32_t maxlen = end-i;
+        if (maxlen > LZ_MAX_MATCH) maxlen = LZ_MAX_MATCH;
+        uint32_t len = LZ_MIN_MATCH;
+        while (len < maxlen && base[cand+len] == base[i+len]) len++;
+        uint32_t litlen = i-lit;
+        if (litlen && len == LZ_MIN_MATCH) {
+            i++; // Not worth breaking the run, see LZ_MAX_COMPRESSED().
+            continue;
+        }
+
+        // Flush pending literals, then the match.
+        if (out+LZ_LITERALS_SIZE(litlen)+3 > dstlen) return 0;
+        out += lz_emit_literals(base+lit,litlen,dst+out);
+        uint32_t dist = i-cand-1;
+        dst[out++] = 0x80 | (len-LZ_MIN_MATCH);
+        dst[out++] = dist & 0xff;
+        dst[out++] = dist >> 8;
+        i += len;
+        lit = i;
+    }
+
+    uint32_t litlen = end-lit;
+    if (out+LZ_LITERALS_SIZE(litlen) > dstlen) return 0;
+    out += lz_emit_literals(base+lit,litlen,dst+out);
+    return out;
+}
+
+// Decompress 'srclen' bytes from 'src' into 'dst'. Returns the number
+// of bytes produced, or 0 on corrupted input or if the output would
+// exceed 'dstlen'.
+static inline uint32_t lz_decompress(const uint8_t *src, uint32_t srclen,
+                                     uint8_t *dst, uint32_t dstlen)
+{
+    uint32_t i = 0, out = 0;
+    while (i < srclen) {
+        uint32_t c = src[i++];
+        if (c < 0x80) {
+            uint32_t run = c+1;
+            if (i+run > srclen || out+run > dstlen) return 0;
+            memcpy(dst+out,src+i,run);
+            i += run;
+            out += run;
+        } else {
+            if (i+2 > srclen) return 0;
+            uint32_t len = (c&0x7f)+LZ_MIN_MATCH;
+            uint32_t dist = (src[i] | (src[i+1]<<8))+1;
+            i += 2;
+            if (dist > out || out+len > dstlen) return 0;
+            // Byte by byte: source and destination may overlap.
+            uint8_t *d = dst+out, *s = d-dist;
+            for (uint32_t j = 0; j < len; j++) d[j] = s[j];
+            out += len;
+        }
+    }
+    return out;
+}
@@ -118,7 +118,10 @@ extern "C" {
 #define MEM_PAGE_MASK (MEM_PAGE_SIZE-1)
 
 #define MEM_NUM_PAGES (MEM_ADDR_RANGE / MEM_PAGE_SIZE)
+/* systems with a fixed memory map can define this as 1 to save memory */
+#ifndef MEM_NUM_LAYERS
 #define MEM_NUM_LAYERS (4U)
+#endif
 
 /* a memory page item maps a chunk of emulator memory to host memory */
 typedef struct {
@@ -132,8 +135,24 @@ typedef struct {
     mem_page_t page_table[MEM_NUM_PAGES];
     /* memory-mapped layers, layer 0 is highest priority */
     mem_page_t layers[MEM_NUM_LAYERS][MEM_NUM_PAGES];
+#ifdef MEM_WATCH
+    /* non-zero for pages whose accesses are routed to mem_watch_access() */
+    uint8_t watch_pages[MEM_NUM_PAGES];
+#endif
 } mem_t;
 
+#ifdef MEM_WATCH
+/* Slow path for watched pages, called for every read and write to a
+   page flagged with mem_watch_page(), before the actual access. It is
+   provided by the user of mem.h, pages not watched keep the fast path.
+   When MEM_WATCH is not defined, no check at all is performed. */
+void mem_watch_access(uint16_t addr, uint8_t data, bool write);
+/* route (or stop routing) the accesses of a page to mem_watch_access() */
+static inline void mem_watch_page(mem_t* mem, uint16_t page, bool watched) {
+    mem->watch_pages[page & (MEM_NUM_PAGES-1)] = watched;
+}
+#endif
+
 /* initialize a new mem instance */
 void mem_init(mem_t* mem);
 /* map a range of RAM */
@@ -153,6 +172,13 @@ void mem_write_range(mem_t* mem, uint16_t addr, const uint8_t* src, uint32_t num
 
 /* read a byte at 16-bit address */
 static inline uint8_t mem_rd(mem_t* mem, uint16_t addr) {
+#ifdef MEM_WATCH
+    if (mem->watch_pages[addr>>MEM_PAGE_SHIFT]) {
+        uint8_t data = mem->page_table[addr>>MEM_PAGE_SHIFT].read_ptr[addr & MEM_PAGE_MASK];
+        mem_watch_access(addr, data, false);
+        return data;
+    }
+#endif
     return mem->page_table[addr>>MEM_PAGE_SHIFT].read_ptr[addr & MEM_PAGE_MASK];
 }
 /* write a byte to 16-bit address */
@@ -165,6 +191,10 @@ static inline void mem_wr(mem_t* mem, uint16_t addr, uint8_t data) {
     // performances as certain big SPI displays take too much time for
     // a full refresh. At the same time, at each zx_exec() call, the
     // Spectrum program is hardly able to update all the screen.
+#ifdef MEM_WATCH
+    if (mem->watch_pages[addr>>MEM_PAGE_SHIFT])
+        mem_watch_access(addr, data, true);
+#endif
     if (addr >= 0x4000 && addr <= 0x57ff) {
         if (data !=
         mem->page_table[addr>>MEM_PAGE_SHIFT].write_ptr[addr & MEM_PAGE_MASK])
@@ -217,7 +247,13 @@ void mem_snapshot_onload(mem_t* snapshot, void* base);
 // a dummy page for currently unmapped memory
 static uint8_t _mem_unmapped_page[MEM_PAGE_SIZE];
 // a write-only 'junk table' for writes to ROM areas
+#ifdef MEM_SHARED_JUNK_PAGE
+// If the whole address space is always mapped, nobody will ever read from
+// the unmapped page, so writes to ROM can just trash it: 1k saved.
+#define _mem_junk_page _mem_unmapped_page
+#else
 static uint8_t _mem_junk_page[MEM_PAGE_SIZE];
+#endif
 
 void mem_init(mem_t* m) {
     CHIPS_ASSERT(m);
@@ -384,8 +420,12 @@ static void mem_ptr_to_offset(uint8_t** ptr_ptr, uint8_t* base) {
         *ptr_ptr = (uint8_t*)(intptr_t)MEM_SPECIAL_OFFSET_JUNK_PAGE;
     }
     else {
-        CHIPS_ASSERT(base <= *ptr_ptr);
-        *ptr_ptr = (uint8_t*) (*ptr_ptr - base);
+        // Pointers below 'base' are possible, for instance when ROMs are
+        // mapped in place and not copied inside the system state. The
+        // resulting negative offset is only valid within the same build,
+        // but it can't clash with the special offsets above, since pages
+        // are 1k in size and can't overlap the system state.
+        *ptr_ptr = (uint8_t*)(intptr_t)(*ptr_ptr - base);
     }
 }
 
@@ -0,0 +1,136 @@
+/* Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+ * This code is released under the MIT license.
+ * See the LICENSE file for more info.
+ *
+ * Display update planner: given the rows of the display that must be
+ * sent, return the windows (runs of consecutive rows) to send them with.
+ *
+ * Every window costs a setup (the CASET, RASET and RAMWR commands, with
+ * their pauses), then its rows are streamed one after the other. Sending
+ * each changed row with its own window wastes a lot of time when many
+ * rows change, while sending the rows between two runs costs their
+ * pixels. The planner takes the cost of both, in bytes transferred, and
+ * merges two runs when sending the rows between them is cheaper than
+ * setting a new window. If streaming the whole display in a single window
+ * costs no more than the resulting plan, that is what it returns. The
+ * plan can then be timed against the panel refresh, see rowplan_chase().
+ *
+ * Since every gap is merged or not on its own, the plan is the cheapest
+ * possible for the cost model. The planner has no dependencies, so that
+ * it can be tested on the host. */
+
+#include <stdint.h>
+
+// Cost model, in bytes of pixel data transferred in the same time.
+typedef struct {
+    uint32_t window;    // Setting a window.
+    uint32_t row;       // Sending one row.
+} rowplan_cost_t;
+
+// Rows first to last, included.
+typedef struct {
+    uint16_t first, last;
+} rowplan_run_t;
+
+// Max number of runs rowplan() returns for 'count' rows: they alternate
+// with at least one row not sent.
+#define ROWPLAN_MAX_RUNS(count) (((count)+1)/2)
+
+// Total cost of the plan 'runs' of 'n' runs.
+static inline uint32_t rowplan_cost(const rowplan_run_t *runs, int n,
+                                    const rowplan_cost_t *cost)
+{
+    uint32_t total = 0;
+    for (int j = 0; j < n; j++)
+        total += cost->window + (runs[j].last-runs[j].first+1)*cost->row;
+    return total;
+}
+
+// Plan the update of 'count' rows, where rows[y] is non zero if the row
+// 'y' must be sent. Fills 'runs', of at least ROWPLAN_MAX_RUNS(count)
+// entries, and returns the number of runs, 0 if there is nothing to send.
+static inline int rowplan(const uint8_t *rows, uint32_t count,
+                          const rowplan_cost_t *cost, rowplan_run_t *runs)
+{
+    int n = 0;
+    for (uint32_t y = 0; y < count; y++) {
+        if (!rows[y]) continue;
+        uint32_t first = y;
+        while (y+1 < count && rows[y+1]) y++;
+
+        // Send the gap with the previous run if cheaper than a window.
+        if (n && (first-runs[n-1].last-1)*cost->row < cost->window) {
+            runs[n-1].last = y;
+        } else {
+            runs[n].first = first;
+            runs[n].last = y;
+            n++;
+        }
+    }
+
+    // Stream the whole display if it costs no more.
+    rowplan_run_t full = {0, count-1};
+    if (n > 1 && rowplan_cost(&full,1,cost) <= rowplan_cost(runs,n,cost)) {
+        runs[0] = full;
+        n = 1;
+    }
+    return n;
+}
+
+/* Tearing. The panel refreshes its lines one after the other, reading the
+ * display memory, once every refresh period: if the rows it is reading
+ * are being written, it shows part of the old frame and part of the new
+ * one, split by a line that moves at every frame. rowplan_chase() times
+ * the plan so that each row is written after the refresh passed it, and
+ * before the refresh of the next period reaches it. */
+
+// Refresh of the panel: the line refreshed 'us' microseconds after the
+// start of the period is us*lines/period.
+typedef struct {
+    uint32_t period;    // Refresh period, in microseconds.
+    uint32_t lines;     // Panel lines refreshed in a period.
+    int32_t first;      // Panel line of row 0,
+    int32_t dir;        // and the next rows go this way, +1 or -1.
+} rowplan_scan_t;
+
+// Start times, in microseconds from the start of a refresh period.
+typedef struct {
+    int32_t min, max;
+} rowplan_slot_t;
+
+// Set 'slot' to the start times of the plan 'runs' of 'n' runs that avoid
+// tearing, sending one byte of the cost model in 'byte_ns' nanoseconds.
+// Returns 1 on success, 0 if the plan is too slow to fit between two
+// refreshes: then slot->min and slot->max are the start that keeps as
+// many rows as possible, from the first one, tear free.
+static inline int rowplan_chase(const rowplan_run_t *runs, int n,
+                                const rowplan_cost_t *cost,
+                                const rowplan_scan_t *scan, uint32_t byte_ns,
+                                rowplan_slot_t *slot)
+{
+    int32_t min = INT32_MIN, max = INT32_MAX;
+    uint32_t sent_ns = 0; // Time to send what precedes the current row.
+    for (int j = 0; j < n; j++) {
+        sent_ns += cost->window*byte_ns;
+        for (uint32_t y = runs[j].first; y <= runs[j].last; y++) {
+            int32_t period = scan->period, lines = scan->lines;
+            int32_t line = scan->first + scan->dir*(int32_t)y;
+            // Refreshed between at and at+1: both bounds are rounded to
+            // be on the safe side.
+            int32_t at = line*period/lines;
+            int32_t late = (line*period+lines-1)/lines;
+            int32_t start = sent_ns/1000; // Written from start to end.
+            sent_ns += cost->row*byte_ns;
+            int32_t end = (sent_ns+999)/1000;
+            if (late-start > min) min = late-start;
+            if (at+period-end < max) max = at+period-end;
+        }
+    }
+    if (min > max) {
+        slot->min = slot->max = min;
+        return 0;
+    }
+    slot->min = min;
+    slot->max = max;
+    return 1;
+}
@@ -1,7 +1,7 @@
 #include "hardware/gpio.h"
 #include "hardware/pwm.h"
 #include "hardware/clocks.h"
-#ifndef st77_spi_bb
+#if !defined(st77_spi_bb) && !defined(st77_spi_pio)
 #include "hardware/spi.h"
 #endif
 
@@ -11,23 +11,151 @@
 // removing or adding NOPs in the function parallel_write_blocking().
 //
 // We use bigbanging by default since:
-// 1. Anyway most apps will want a blocking update. If you don't want
-//    a blocking update, than PIO+DMA may make more sense.
-// 2. Big banging seems more stable under different overclocking conditions.
+// 1. Big banging seems more stable under different overclocking conditions.
+// 2. Blocking writes are not slower. Only the asynchronous writes (see
+//    st77xx_write_async()) gain from the DMA, that transfers a line while
+//    the CPU prepares the next one.
 #define st77_parallel_bb
 
 // If defined, use bitbanging for the SPI interface too.
 // SPI bitbanging reaches faster speeds than the SPI hardware implementation.
 // At 400Mhz overclock, max SPI speed was 24Mhz, vs ~60Mhz of bitbanging.
+// However the hardware SPI is fed by DMA, so its asynchronous writes
+// don't use the CPU.
 // #define st77_spi_bb
 
-#ifndef st77_parallel_bb
+// If defined (usually in device_config.h), the SPI is implemented by a PIO
+// state machine fed by DMA: like bitbanging it is not limited by the SPI
+// hardware, and like the hardware SPI it does not use the CPU. The clock
+// is spi_pio_rate, or the nearest lower rate the PIO can do, whatever the
+// system clock is: see st77xx_set_clock().
+// #define st77_spi_pio
+#ifndef spi_pio_rate
+#define spi_pio_rate 62500000 // Max write clock of the ST7789.
+#endif
+#if defined(st77_spi_bb) && defined(st77_spi_pio)
+#error "st77_spi_bb and st77_spi_pio are mutually exclusive"
+#endif
+
+// If defined (usually in device_config.h), the display starts in 12 bit
+// RGB444 mode instead of 16 bit RGB565: two pixels every three bytes,
+// so 25% less data to transfer. See st77xx_set_pixel_bits().
+// #define st77_rgb444
+
+// GPIO connected to the TE (tearing effect) output of the display, if any,
+// usually in device_config.h: the display pulses it at the start of each
+// refresh, see st77xx_te_irq_init(). -1 if not connected.
+#ifndef st77_te
+#define st77_te -1
+#endif
+
+// How the display refreshes its rows, for the TE synchronization: 1 from
+// the first to the last, -1 the other way, 0 along the columns, like in
+// landscape mode on the usual portrait panels. And the panel lines it
+// refreshes, the rows being at st77_offset_y.
+#ifndef st77_te_scan
+#define st77_te_scan (st77_landscape ? 0 : (st77_mirror_y ? -1 : 1))
+#endif
+#ifndef st77_te_lines
+#define st77_te_lines 320 // ST7789. 160 for the ST7735.
+#endif
+
+// The buses not bit banged transfer data with DMA, some using PIO.
+#if (defined(st77_use_spi) && defined(st77_spi_pio)) || \
+    (defined(st77_use_parallel) && !defined(st77_parallel_bb))
+#define st77_use_pio
+#endif
+#if (defined(st77_use_spi) && !defined(st77_spi_bb)) || \
+    defined(st77_use_pio)
+#define st77_use_dma
+#endif
+
+#ifdef st77_use_dma
 #include "hardware/dma.h"
+#endif
+#ifdef st77_use_pio
 #include "hardware/pio.h"
+#ifndef pio_channel
+#define pio_channel pio0
+#endif
+#endif
+
+#ifdef st77_use_dma
+static unsigned int st77_dma;
+static bool st77_dma_pending; // Started by st77xx_write_async().
+static const void *st77_dma_data; // And the data it is reading.
+#endif
+#ifdef st77_use_pio
+static unsigned int st77_sm;
+static uint32_t st77_pio_clock; // Max PIO clock (system clock / divider).
+#endif
+
+#ifdef st77_use_pio
+// Set the PIO clock divider for the system clock 'sys_hz': the smallest
+// integer divider that does not exceed st77_pio_clock. Integer, since a
+// fractional divider would make some clock cycles shorter.
+void st77xx_set_clock(uint32_t sys_hz) {
+    uint32_t div = (sys_hz+(st77_pio_clock-1)) / st77_pio_clock;
+    pio_sm_set_clkdiv_int_frac(pio_channel,st77_sm,div,0);
+}
+
+// Start the DMA channel feeding the state machine TX FIFO.
+static void st77xx_init_pio_dma(void) {
+    st77_dma = dma_claim_unused_channel(true);
+    dma_channel_config dmc = dma_channel_get_default_config(st77_dma);
+    channel_config_set_transfer_data_size(&dmc,DMA_SIZE_8);
+    channel_config_set_bswap(&dmc,false);
+    channel_config_set_dreq(&dmc,pio_get_dreq(pio_channel,st77_sm,true));
+    dma_channel_configure(st77_dma,&dmc,&pio_channel->txf[st77_sm],NULL,0,false);
+}
+
+// Wait for the state machine to send all the data and stall on the
+// empty FIFO.
+static void st77xx_wait_pio_idle(void) {
+    uint32_t stall = 1u << (PIO_FDEBUG_TXSTALL_LSB + st77_sm);
+    pio_channel->fdebug = stall; // Clear the sticky flag.
+    while (!(pio_channel->fdebug & stall)) tight_loop_contents();
+}
+#else
+// The bit banged and hardware SPI buses don't depend on dividers.
+void st77xx_set_clock(uint32_t sys_hz) {}
 #endif
 
 void st77xx_fill(uint16_t c);
 
+/* Pixel format. Pixel values, as returned by st77xx_rgb(), are RGB565 with
+ * the bytes swapped, as the display wants them, in 16 bit mode, and RGB444
+ * in the low 12 bits in 12 bit mode: then before the transfer, pairs of
+ * pixels are packed in three bytes with st77xx_pack(). */
+static uint32_t st77_pixel_bits = 16;
+
+/* Bytes to transfer for 'count' pixels. In 12 bit mode an odd pixel still
+ * takes three bytes, the second pixel being a copy of the first. */
+static inline uint32_t st77xx_bytes(uint32_t count) {
+    return st77_pixel_bits == 12 ? (count+1)/2*3 : count*2;
+}
+
+/* Prepare 'count' pixels for the transfer in place, 'pixels' being word
+ * aligned, with room for count+1 pixels. Does nothing in 16 bit mode. In
+ * 12 bit mode packs each pair in three bytes: the packed data is shorter,
+ * so every pair is read before being overwritten. Returns the bytes to
+ * transfer, st77xx_bytes(count). */
+uint32_t st77xx_pack(uint16_t *pixels, uint32_t count) {
+    if (st77_pixel_bits != 12) return count*2;
+    if (count & 1) pixels[count] = pixels[count-1];
+    const uint32_t *src = (const uint32_t*)pixels;
+    uint8_t *dst = (uint8_t*)pixels;
+    for (uint32_t j = 0; j < (count+1)/2; j++) {
+        uint32_t pair = src[j];
+        pair = ((pair & 0xfff) << 12) | (pair >> 16);
+        dst[0] = pair >> 16;
+        dst[1] = pair >> 8;
+        dst[2] = pair;
+        dst += 3;
+    }
+    return st77xx_bytes(count);
+}
+
 #ifdef st77_use_spi
 // Bus setup: SPI version. Very straightforward.
 void st77xx_init_spi(void) {
@@ -42,11 +170,66 @@ void st77xx_init_spi(void) {
         gpio_init(st77_cs);
         gpio_set_dir(st77_cs,GPIO_OUT);
     }
-#ifndef st77_spi_bb
+#if defined(st77_spi_pio)
+    // Side-set is the clock, OUT the data: two PIO clock cycles
+    // per bit, with a 50% duty cycle. Data and clock change together
+    // on the leading edge if spi_phase is 1, on the trailing edge
+    // otherwise. Polarity 1 inverts the clock pin.
+    #define ST77_PIO_SCK(level) ((level)<<12) // Side-set bit.
+    static const uint16_t pio_program_data[] = {
+    #if spi_phase == 1
+        0x6021 | ST77_PIO_SCK(0), //  0: out    x, 1        side 0
+        0xa001 | ST77_PIO_SCK(1), //  1: mov    pins, x     side 1
+    #else
+        0x6001 | ST77_PIO_SCK(0), //  0: out    pins, 1     side 0
+        0xa042 | ST77_PIO_SCK(1), //  1: nop                side 1
+    #endif
+    };
+
+    static const struct pio_program pp = {
+        .instructions = pio_program_data,
+        .length = 2,
+        .origin = -1,
+    };
+
+    st77_sm = pio_claim_unused_sm(pio_channel,true);
+    unsigned int offset = pio_add_program(pio_channel,&pp);
+
+    pio_gpio_init(pio_channel, st77_sck);
+    pio_gpio_init(pio_channel, st77_mosi);
+    gpio_set_outover(st77_sck,
+        spi_polarity ? GPIO_OVERRIDE_INVERT : GPIO_OVERRIDE_NORMAL);
+    pio_sm_set_consecutive_pindirs(pio_channel, st77_sm, st77_sck, 1, true);
+    pio_sm_set_consecutive_pindirs(pio_channel, st77_sm, st77_mosi, 1, true);
+
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset, offset+1);
+    sm_config_set_sideset(&c, 1, false, false);
+    sm_config_set_sideset_pins(&c,st77_sck);
+    sm_config_set_out_pins(&c,st77_mosi,1);
+    sm_config_set_fifo_join(&c,PIO_FIFO_JOIN_TX);
+    // MSB first, autopull every byte: the DMA writes bytes, that the bus
+    // replicates in all the four lanes of the FIFO word.
+    sm_config_set_out_shift(&c,false,true,8);
+    pio_sm_init(pio_channel,st77_sm,offset,&c);
+
+    st77_pio_clock = spi_pio_rate*2;
+    st77xx_set_clock(clock_get_hz(clk_sys));
+    pio_sm_set_enabled(pio_channel,st77_sm,true);
+    st77xx_init_pio_dma();
+#elif !defined(st77_spi_bb)
     spi_init(spi_channel,spi_rate);
     spi_set_format(spi_channel, 8, spi_polarity, spi_phase, SPI_MSB_FIRST);
     gpio_set_function(st77_sck,GPIO_FUNC_SPI);
     gpio_set_function(st77_mosi,GPIO_FUNC_SPI);
+
+    // DMA channel for the asynchronous writes. The SPI paces it.
+    st77_dma = dma_claim_unused_channel(true);
+    dma_channel_config dmc = dma_channel_get_default_config(st77_dma);
+    channel_config_set_transfer_data_size(&dmc,DMA_SIZE_8);
+    channel_config_set_dreq(&dmc,spi_get_dreq(spi_channel,true));
+    dma_channel_configure(st77_dma,&dmc,&spi_get_hw(spi_channel)->dr,
+                          NULL,0,false);
 #else
     gpio_init(st77_sck);
     gpio_init(st77_mosi);
@@ -93,8 +276,6 @@ void st77xx_init_parallel(void) {
 
 #else // Parallel with PIO
 
-static unsigned int st77_sm, st77_dma;
-
 // Bus setup: Parallel 8 lines using PIO and DMA. A bit more convoluted.
 void st77xx_init_parallel(void) {
     unsigned int offset;
@@ -162,26 +343,15 @@ void st77xx_init_parallel(void) {
     // Use shift_right = false, autopool = true with threshold of 8 bits.
     sm_config_set_out_shift(&c,false,true,8);
 
-    // Set the PIO clock divider according to the current system clock
-    uint32_t wanted_mhz = 32000000;
-    uint32_t cpu_mhz = clock_get_hz(clk_sys);
-    // We add wanted_mhz-1 to be sure to get a clock lower or equal,
-    // but lever higher than the wanted one.
-    uint32_t div = (cpu_mhz+(wanted_mhz-1)) / wanted_mhz;
-    printf("ST77 parallel ST clock divider set to %d\n", div);
-    sm_config_set_clkdiv(&c, div);
-
-    // Start the state machine.
+    // Start the state machine. The PIO clock divider is set according
+    // to the current system clock, and set again when it changes.
     pio_sm_init(pio_channel,st77_sm,offset,&c);
+    st77_pio_clock = 32000000;
+    st77xx_set_clock(clock_get_hz(clk_sys));
     pio_sm_set_enabled(pio_channel,st77_sm,true);
 
     // Configure the DMA channel.
-    st77_dma = dma_claim_unused_channel(true);
-    dma_channel_config dmc = dma_channel_get_default_config(st77_dma);
-    channel_config_set_transfer_data_size(&dmc,DMA_SIZE_8);
-    channel_config_set_bswap(&dmc,false);
-    channel_config_set_dreq(&dmc,pio_get_dreq(pio_channel,st77_sm,true));
-    dma_channel_configure(st77_dma,&dmc,&pio_channel->txf[st77_sm],NULL,0,false);
+    st77xx_init_pio_dma();
 }
 #endif
 #endif
@@ -295,17 +465,55 @@ void spi_write_bb_blocking(void *data, uint32_t datalen) {
         }
     }
 }
+#elif defined(st77_spi_pio)
+void spi_write_pio_blocking(void *data, uint32_t datalen) {
+    dma_channel_set_trans_count(st77_dma,datalen,false);
+    dma_channel_set_read_addr(st77_dma,data,true);
+    dma_channel_wait_for_finish_blocking(st77_dma);
+    st77xx_wait_pio_idle();
+}
 #endif
 #endif
 
+/* Wait for the data of the last st77xx_write_async() call, if any, to be
+ * completely out on the bus, then deselect the display. Every other write
+ * calls it first, so that commands and data are never mixed. */
+void st77xx_wait(void) {
+#ifdef st77_use_dma
+    if (!st77_dma_pending) return;
+    dma_channel_wait_for_finish_blocking(st77_dma);
+#if defined(st77_spi_pio)
+    st77xx_wait_pio_idle();
+#elif defined(st77_use_spi)
+    // Like spi_write_blocking(): wait for the last byte to be shifted
+    // out, and drain the RX FIFO, that filled up meanwhile.
+    while (spi_is_busy(spi_channel)) tight_loop_contents();
+    while (spi_is_readable(spi_channel)) (void)spi_get_hw(spi_channel)->dr;
+    spi_get_hw(spi_channel)->icr = SPI_SSPICR_RORIC_BITS;
+#else
+    // Like parallel_write_blocking(): wait for the state machine to
+    // consume the FIFO, then leave the WR clock time for the last byte.
+    while(!pio_sm_is_tx_fifo_empty(pio_channel,st77_sm));
+    __asm volatile ("nop\n"); __asm volatile ("nop\n");
+    __asm volatile ("nop\n"); __asm volatile ("nop\n");
+    __asm volatile ("nop\n"); __asm volatile ("nop\n");
+#endif
+    if (st77_cs != -1) gpio_put(st77_cs,1);
+    st77_dma_pending = false;
+#endif
+}
+
 /* Send command and/or data. */
 void st77xx_write(uint8_t cmd, void *data, uint32_t datalen) {
+    st77xx_wait();
     if (st77_cs != -1) gpio_put(st77_cs,0);
     if (cmd != 0) {
         gpio_put(st77_dc,0);
 #ifdef st77_use_spi
-#ifdef st77_spi_bb
+#if defined(st77_spi_bb)
         spi_write_bb_blocking(&cmd,1);
+#elif defined(st77_spi_pio)
+        spi_write_pio_blocking(&cmd,1);
 #else
         spi_write_blocking(spi_channel,&cmd,1);
 #endif
@@ -316,8 +524,10 @@ void st77xx_write(uint8_t cmd, void *data, uint32_t datalen) {
     if (data != NULL) {
         gpio_put(st77_dc,1);
 #ifdef st77_use_spi
-#ifdef st77_spi_bb
+#if defined(st77_spi_bb)
         spi_write_bb_blocking(data,datalen);
+#elif defined(st77_spi_pio)
+        spi_write_pio_blocking(data,datalen);
 #else
         spi_write_blocking(spi_channel,data,datalen);
 #endif
@@ -328,6 +538,28 @@ void st77xx_write(uint8_t cmd, void *data, uint32_t datalen) {
     if (st77_cs != -1) gpio_put(st77_cs,1);
 }
 
+/* Like st77xx_write(), but return as soon as the DMA transfer of the data
+ * is started: the CPU can prepare the next data meanwhile, as long as it
+ * does not touch 'data' before st77xx_wait() (or the next write) returns.
+ * The bit banged buses have no DMA, so the write is blocking there. */
+void st77xx_write_async(uint8_t cmd, void *data, uint32_t datalen) {
+#ifdef st77_use_dma
+    if (cmd != 0) {
+        st77xx_write(cmd,NULL,0);
+    } else {
+        st77xx_wait();
+    }
+    if (st77_cs != -1) gpio_put(st77_cs,0);
+    gpio_put(st77_dc,1);
+    dma_channel_set_trans_count(st77_dma,datalen,false);
+    dma_channel_set_read_addr(st77_dma,data,true);
+    st77_dma_data = data;
+    st77_dma_pending = true;
+#else
+    st77xx_write(cmd,data,datalen);
+#endif
+}
+
 /* Command without arguments. */
 void st77xx_cmd(uint8_t cmd) {
     st77xx_write(cmd,NULL,0);
@@ -364,6 +596,48 @@ void st77xx_set_brightness(unsigned int level) {
     }
 }
 
+/* Set the pixel format: 16 bit RGB565 or 12 bit RGB444. The 12 bit mode
+ * is only available if the rows are a whole number of bytes, that is, the
+ * display width is even: otherwise the display goes in 16 bit mode.
+ * Returns the bits per pixel set. Pixels of the old format sent after
+ * this call are garbage: convert the colors again with st77xx_rgb(). */
+uint32_t st77xx_set_pixel_bits(uint32_t bits) {
+    if (bits != 12 || (st77_width & 1)) bits = 16;
+    uint8_t colormode = 0x50 | (bits == 12 ? 0x03 : 0x05); // 65k colors |
+    st77xx_cmd1(0x3a,colormode & 0x77);                    // RGB444/565
+    st77_pixel_bits = bits;
+    return bits;
+}
+
+/* Tearing effect. The display starts refreshing its lines from the
+ * panel memory right after the TE pulse, so the time since the last pulse
+ * tells where the refresh is. The refresh period is measured too, since
+ * it depends on the display settings and varies from display to display.
+ * Both are written by the interrupt handler. */
+static volatile uint32_t st77_te_time;   // time_us_32() of the last pulse.
+static volatile uint32_t st77_te_period; // Refresh period, 0 if unknown.
+
+static void st77xx_te_irq(uint gpio, uint32_t events) {
+    uint32_t now = time_us_32();
+    uint32_t period = now - st77_te_time;
+
+    // Panels refresh at 40 to 120 Hz: anything else is a missed pulse,
+    // or the first one.
+    if (period >= 8000 && period <= 25000) {
+        st77_te_period = st77_te_period ?
+            (st77_te_period*7+period)/8 : period;
+    }
+    st77_te_time = now;
+}
+
+/* Start timestamping the TE pulses. The interrupt is taken by the core
+ * calling this function. Does nothing if st77_te is not set. */
+void st77xx_te_irq_init(void) {
+    if (st77_te == -1) return;
+    gpio_set_irq_enabled_with_callback(st77_te,GPIO_IRQ_EDGE_RISE,true,
+                                       st77xx_te_irq);
+}
+
 /* Display initialization. */
 void st77xx_init(void) {
     #ifdef st77_use_spi
@@ -384,8 +658,11 @@ void st77xx_init(void) {
     sleep_ms(50);
 
     // Set color mode
-    uint8_t colormode = 0x50 | 0x05; // 65k colors | RGB565
-    st77xx_cmd1(0x3a,colormode & 0x77);
+#ifdef st77_rgb444
+    st77xx_set_pixel_bits(12);
+#else
+    st77xx_set_pixel_bits(16);
+#endif
     sleep_ms(50);
 
     // Set memory access mode
@@ -398,6 +675,13 @@ void st77xx_init(void) {
     st77xx_cmd(st77_inversion ? 0x21 : 0x20); // Inversion
     sleep_ms(10);
 
+    // Tearing effect line on, pulsing at the vertical blanking only.
+    if (st77_te != -1) {
+        gpio_init(st77_te);
+        gpio_set_dir(st77_te,GPIO_IN);
+        st77xx_cmd1(0x35,0x00);
+    }
+
 #if 0
     // Set proch and frame rate
     st77xx_write(0xb2, "\x0c\x0c\x00\x33\x33", 5); // Porch setting.
@@ -443,25 +727,97 @@ void st77xx_setwin(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2) {
     st77xx_cmd(0x2c); // Enter receive buffer data mode.
 }
 
+/* Line buffers for the asynchronous transfer of the display rows: the
+ * caller gets a buffer with st77xx_line_get(), fills it with st77_width
+ * pixels, packs it with st77xx_line_pack(), and passes it to
+ * st77xx_line_submit(), that returns while the row is still being
+ * transferred, so that the next row can be converted in the next buffer
+ * meanwhile. Only one transfer at a time is in progress, so the buffer
+ * returned is free, unless the caller got one without submitting it: then
+ * it may be the one still being transferred, and st77xx_line_get() waits
+ * for it. Each buffer has at least 16 more pixels, that the caller can
+ * write past the end of the row, and is word aligned. */
+#define ST77_LINE_BUFFERS 2 // At least 2.
+static uint16_t st77_lines[ST77_LINE_BUFFERS][(st77_width+17)&~1]
+    __attribute__((aligned(4))); // Allow 32 bit stores.
+static unsigned int st77_line_next;
+
+uint16_t *st77xx_line_get(void) {
+    uint16_t *line = st77_lines[st77_line_next];
+    st77_line_next = (st77_line_next+1) % ST77_LINE_BUFFERS;
+#ifdef st77_use_dma
+    if (st77_dma_pending && st77_dma_data == line) st77xx_wait();
+#endif
+    return line;
+}
+
+/* Pack the pixels of 'line' for the transfer, see st77xx_pack(). Call it
+ * once the line is filled: packing it again would garble it. */
+void st77xx_line_pack(uint16_t *line) {
+    st77xx_pack(line, st77_width);
+}
+
+/* Start the transfer of 'line' to the row 'y' of the display. The same
+ * line can be submitted for more rows. Use st77xx_wait() to know when
+ * all the rows submitted are on the display. */
+void st77xx_line_submit(uint16_t y, uint16_t *line) {
+    st77xx_setwin(0, y, st77_width-1, y);
+    st77xx_write_async(0, line, st77xx_bytes(st77_width));
+}
+
+/* To send consecutive rows, it is faster to set the window once: after
+ * st77xx_line_window() each st77xx_line_stream() call sends the next row
+ * of the window, from 'first' to 'last', like st77xx_line_submit(). */
+void st77xx_line_window(uint16_t first, uint16_t last) {
+    st77xx_setwin(0, first, st77_width-1, last);
+}
+
+void st77xx_line_stream(uint16_t *line) {
+    st77xx_write_async(0, line, st77xx_bytes(st77_width));
+}
+
+/* Cost of setting a window, in bytes of pixel data the bus transfers in
+ * the same time: the 11 bytes of the commands, and the pauses between
+ * them to wait for the bus and switch CS and DC. The faster the bus, the
+ * more bytes a pause is worth. Rough figures, used to plan the display
+ * updates (see rowplan.h), that devices can override. */
+#ifndef st77_window_cost
+#if defined(st77_use_parallel)
+#define st77_window_cost 128
+#elif defined(st77_spi_bb)
+#define st77_window_cost 32
+#else
+#define st77_window_cost 48
+#endif
+#endif
+
 uint16_t st77xx_rgb565(uint8_t r, uint8_t g, uint8_t b) {
     uint16_t rgb = (r & 0xf8) << 8 | (g & 0xfc) << 3 | b >> 3;
     return (rgb >> 8) | ((rgb & 0xff) << 8);
 }
 
+/* Pixel value of the color in the current pixel format. */
+uint16_t st77xx_rgb(uint8_t r, uint8_t g, uint8_t b) {
+    if (st77_pixel_bits == 12) return (r >> 4) << 8 | (g >> 4) << 4 | b >> 4;
+    return st77xx_rgb565(r,g,b);
+}
+
 void st77xx_pixel(uint16_t x, uint16_t y, uint16_t c) {
+    uint16_t buf[2] __attribute__((aligned(4))) = {c};
     st77xx_setwin(x,y,x,y);
-    st77xx_data(&c,2);
+    st77xx_data(buf,st77xx_pack(buf,1));
 }
 
 void st77xx_pixel_rgb(uint16_t x, uint16_t y, uint32_t rgb) {
     if (x >= st77_width || y >= st77_height) return;
-    uint16_t rgb565 = st77xx_rgb565(rgb&0xff,(rgb>>8)&0xff,(rgb>>16)&0xff);
-    st77xx_pixel(x,y,rgb565);
+    uint16_t c = st77xx_rgb(rgb&0xff,(rgb>>8)&0xff,(rgb>>16)&0xff);
+    st77xx_pixel(x,y,c);
 }
 
+/* Fill the box with the pixel value 'c' (see st77xx_rgb()). */
 void st77xx_fill_box(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t c) {
     unsigned int buflen = 256;
-    uint16_t buf[buflen];
+    uint16_t buf[buflen+1] __attribute__((aligned(4)));
     uint32_t left = w*h;
 
     // Crop to visible display area.
@@ -476,26 +832,30 @@ void st77xx_fill_box(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t c)
         y2 = st77_height-1;
     }
 
-    // Prefill buffer.
+    // Prefill buffer. In 12 bit mode, an odd pixel at the end wraps to
+    // the start of the window, that has the same color anyway.
     if (left < buflen) buflen = left;
     for (int j = 0; j < buflen; j++) buf[j] = c;
+    uint32_t buflen_bytes = st77xx_pack(buf,buflen);
 
     // Transfer buffer-length data at time until we can.
     st77xx_setwin(x,y,x+w-1,y+h-1);
     while(left >= buflen) {
-        st77xx_data(buf,buflen*2);
+        st77xx_data(buf,buflen_bytes);
         left -= buflen;
     }
 
     // Handle the reminder with a single write.
-    if (left > 0) st77xx_data(buf,left*2);
+    if (left > 0) st77xx_data(buf,st77xx_bytes(left));
 }
 
 void st77xx_fill(uint16_t c) {
     st77xx_fill_box(0,0,st77_width,st77_height,c);
 }
 
+/* Send the whole frame buffer 'fb', with the rows packed with
+ * st77xx_line_pack() in 12 bit mode. */
 void st77xx_update(uint16_t *fb) {
     st77xx_setwin(0,0,st77_width-1,st77_height-1);
-    st77xx_data(fb,st77_width*st77_height*2);
+    st77xx_data(fb,st77xx_bytes(st77_width)*st77_height);
 }
@@ -0,0 +1,77 @@
+/* Host test of lz.h: round trip of buffers of different entropy,
+ * compressed in chunks like savestate_compress() in zx.c does, checking
+ * that no chunk exceeds LZ_MAX_COMPRESSED(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "lz.h"
+
+#define BUFLEN 0xFFFF           // Max lz_compress() input.
+#define RAMLEN 0xC000           // Like the 48K RAM.
+#define CHUNK 4096              // Like SAVESTATE_CHUNK.
+
+static uint8_t input[BUFLEN], output[BUFLEN];
+static uint8_t compressed[2*BUFLEN]; // Way more than any bound.
+
+// Compress 'len' bytes of 'input' in chunks, decompress them, and compare.
+static int roundtrip(const char *name, uint32_t len, uint32_t chunk) {
+    static lz_t lz;
+    uint32_t clen = 0;
+    lz_init(&lz);
+    for (uint32_t j = 0; j < len; j += chunk) {
+        uint32_t end = j+chunk < len ? j+chunk : len;
+        uint32_t bound = LZ_MAX_COMPRESSED(end-j);
+        uint32_t n = lz_compress(&lz,input,j,end,compressed+clen,bound);
+        if (n == 0 && end > j) {
+            printf("FAIL %s: chunk at %u exceeds %u bytes\n",
+                   name, (unsigned)j, (unsigned)bound);
+            return 1;
+        }
+        clen += n;
+    }
+    memset(output,0xaa,sizeof(output));
+    uint32_t dlen = lz_decompress(compressed,clen,output,sizeof(output));
+    if (dlen != len || memcmp(input,output,len) != 0) {
+        printf("FAIL %s: decompressed %u bytes of %u, or different\n",
+               name, (unsigned)dlen, (unsigned)len);
+        return 1;
+    }
+    return 0;
+}
+
+// Fill the input with random bytes taking 'values' distinct values.
+static void fill_random(uint32_t values) {
+    for (uint32_t j = 0; j < BUFLEN; j++) input[j] = (rand()%values)*7;
+}
+
+int main(void) {
+    int failed = 0;
+    srand(1234);
+    for (int run = 0; run < 20; run++) {
+        fill_random(256);
+        failed |= roundtrip("random", RAMLEN, CHUNK);
+        fill_random(16);
+        failed |= roundtrip("16 values", RAMLEN, CHUNK);
+        fill_random(4);
+        failed |= roundtrip("4 values", RAMLEN, CHUNK);
+        fill_random(2);
+        failed |= roundtrip("2 values", RAMLEN, CHUNK);
+    }
+
+    // Long runs, repeated patterns, and random data between them.
+    memset(input,0,BUFLEN);
+    failed |= roundtrip("zeros", RAMLEN, CHUNK);
+    for (uint32_t j = 0; j < BUFLEN; j++)
+        input[j] = (j/1000)%2 ? rand() : "pattern"[j%7];
+    failed |= roundtrip("mixed", RAMLEN, CHUNK);
+
+    // Odd sizes, a single call, and the empty input.
+    fill_random(16);
+    failed |= roundtrip("odd chunks", 12345, 1000);
+    failed |= roundtrip("single call", BUFLEN, BUFLEN);
+    failed |= roundtrip("one byte", 1, CHUNK);
+    failed |= roundtrip("empty", 0, CHUNK);
+
+    printf(failed ? "lz_test: FAILED\n" : "lz_test: all passed\n");
+    return failed;
+}
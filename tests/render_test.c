@@ -0,0 +1,314 @@
+/* Host test of the display rendering: update_display() and everything it
+ * needs are taken from zx.c, and the pixel format and line buffers code
+ * from st77xx.h (the Makefile extracts them in render_code.inc),
+ * while the display is simulated at the level of windows and data
+ * transfers. Every frame drawn is compared with a reference renderer,
+ * that computes each display pixel on its own, for many scalings, with
+ * and without border, smooth downscaling and 12 bit pixels, full and
+ * partial updates, and border color changes.
+ *
+ * The transfers complete only at the next display operation, like the
+ * DMA ones, so that a line buffer reused while in flight shows up as a
+ * wrong row. Build with -DTEST_WIDTH=... -DTEST_HEIGHT=... */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "rowplan.h"
+
+#define st77_width TEST_WIDTH
+#define st77_height TEST_HEIGHT
+#define st77_offset_y 0
+#define st77_window_cost 48
+#define st77_te -1
+#define st77_te_scan 0
+#define st77_te_lines 320
+#define st77_use_dma
+
+// From zx.h.
+#define ZX_DISPLAY_WIDTH 320
+#define ZX_DISPLAY_HEIGHT 256
+#define ZX_BORDER_LOG_LINES 256
+
+static uint32_t zxpalette_rgb[16];
+static uint32_t zxpalette[16];
+static volatile uint32_t st77_te_period, st77_te_time;
+static uint32_t time_us_32(void) { return 0; }
+static void busy_wait_us_32(uint32_t us) { (void)us; }
+
+/* ============================ Simulated display =========================== */
+
+static uint16_t Display[TEST_HEIGHT][TEST_WIDTH];
+static struct {
+    uint32_t x1, y1, x2, y2;    // Current window,
+    uint32_t x, y;              // and next pixel written.
+} Win;
+static bool st77_dma_pending;
+static const void *st77_dma_data;
+static uint32_t st77_dma_len;
+static uint32_t st77_pixel_bits; // Defined with the st77xx.h code.
+
+static void display_put(uint16_t c) {
+    if (Win.y > Win.y2) {
+        printf("FAIL: data past the end of the window\n");
+        exit(1);
+    }
+    Display[Win.y][Win.x] = c;
+    if (++Win.x > Win.x2) {
+        Win.x = Win.x1;
+        Win.y++;
+    }
+}
+
+// Complete the transfer in progress, reading the data only now.
+void st77xx_wait(void) {
+    if (!st77_dma_pending) return;
+    const uint8_t *d = st77_dma_data;
+    if (st77_pixel_bits == 12) {
+        for (uint32_t j = 0; j+3 <= st77_dma_len; j += 3) {
+            display_put(d[j] << 4 | d[j+1] >> 4);
+            display_put((d[j+1] & 15) << 8 | d[j+2]);
+        }
+    } else {
+        for (uint32_t j = 0; j+2 <= st77_dma_len; j += 2)
+            display_put(d[j] | d[j+1] << 8);
+    }
+    st77_dma_pending = false;
+}
+
+void st77xx_setwin(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2) {
+    st77xx_wait();
+    if (x1 > x2 || y1 > y2 || x2 >= st77_width || y2 >= st77_height) {
+        printf("FAIL: window %u,%u %u,%u\n", x1, y1, x2, y2);
+        exit(1);
+    }
+    Win.x = Win.x1 = x1;
+    Win.y = Win.y1 = y1;
+    Win.x2 = x2;
+    Win.y2 = y2;
+}
+
+void st77xx_write_async(uint8_t cmd, void *data, uint32_t datalen) {
+    (void)cmd;
+    st77xx_wait();
+    st77_dma_data = data;
+    st77_dma_len = datalen;
+    st77_dma_pending = true;
+}
+
+void st77xx_fill_box(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                     uint16_t c)
+{
+    st77xx_setwin(x, y, x+w-1, y+h-1);
+    for (uint32_t j = 0; j < (uint32_t)w*h; j++) display_put(c);
+}
+
+#include "render_code.inc"
+
+/* =========================== Reference renderer =========================== */
+
+static uint16_t Ref[TEST_HEIGHT][TEST_WIDTH];
+
+// Scaled image size, like render_setup().
+static void image_size(uint32_t scaling, int show_border, uint32_t *w,
+                       uint32_t *h)
+{
+    uint32_t zw = 256, zh = 192;
+    if (scaling == 0) {
+        uint32_t fw = show_border ? 320 : 256, fh = show_border ? 256 : 192;
+        if (st77_width*fh <= st77_height*fw) {
+            *w = zw*st77_width/fw;
+            *h = zh*st77_width/fw;
+        } else {
+            *w = zw*st77_height/fh;
+            *h = zh*st77_height/fh;
+        }
+    } else {
+        uint32_t e = (scaling*8+50)/100;
+        if (abs((int)(e*1250)-(int)(scaling*100)) <= 100) {
+            *w = zw*e/8;
+            *h = zh*e/8;
+        } else {
+            *w = (zw*scaling+50)/100;
+            *h = (zh*scaling+50)/100;
+        }
+    }
+    if (*w > 2*zw) {
+        *w = 2*zw;
+        *h = 2*zh;
+    } else if (*w < zw/4) {
+        *w = zw/4;
+        *h = zh/4;
+    }
+}
+
+static int32_t floor_div(int32_t a, int32_t b) {
+    return a >= 0 ? a/b : -((-a+b-1)/b);
+}
+
+// The image is centered: when larger than the display, it is cropped on
+// both sides. The left border must have an even width.
+static void reference(const struct render_frame *f) {
+    uint32_t w, h;
+    image_size(f->scaling, f->show_border, &w, &h);
+    uint32_t top = h <= st77_height ? (st77_height-h)/2 : 0;
+    uint32_t cropy = h <= st77_height ? 0 : (h-st77_height)/2;
+    uint32_t left = w <= st77_width ? ((st77_width-w)/2) & ~1 : 0;
+    uint32_t cropx = w <= st77_width ? 0 : (w-st77_width)/2;
+    // The first column shown is the start of the byte cropping begins in.
+    uint32_t first_byte = cropx*256/w/8;
+    uint32_t rel0 = (first_byte*8*w+255)/256;
+    int smooth = f->smooth && w < 256;
+
+    for (uint32_t y = 0; y < st77_height; y++) {
+        int32_t rel = (int32_t)y-(int32_t)top+(int32_t)cropy;
+        int32_t line = 32 + floor_div(rel*192, h);
+        if (line < 0) line = 0;
+        if (line > 255) line = 255;
+        uint16_t bc = f->show_border ? zxpalette[f->border[line]] : 0;
+        for (uint32_t x = 0; x < st77_width; x++) {
+            uint32_t ry = y-top+cropy;
+            if (y < top || ry >= h || x < left) {
+                Ref[y][x] = bc;
+                continue;
+            }
+            uint32_t rx = x-left+rel0, sx = rx*256/w;
+            if (sx >= 256) {
+                Ref[y][x] = bc;
+                continue;
+            }
+            uint32_t yy = ry*192/h;
+            const uint8_t *row = f->screen +
+                (((yy & 0xC0)<<5) | ((yy & 0x07)<<8) | ((yy & 0x38)<<2));
+            uint8_t attr = f->screen[0x1800+(yy>>3)*32+(sx>>3)];
+            uint32_t ink = attr&7, paper = (attr>>3)&7;
+            if ((attr & 0x80) && f->blink) {
+                uint32_t t = ink;
+                ink = paper;
+                paper = t;
+            }
+            if (!smooth) {
+                uint32_t bit = (row[sx>>3] >> (7-(sx&7))) & 1;
+                Ref[y][x] = zxpalette[bit ? ink : paper];
+                continue;
+            }
+            // All the pixels covered, in the same byte.
+            uint32_t lx = (rx+1)*256/w;
+            if (lx > 0) lx--;
+            if (lx < sx) lx = sx;
+            if ((lx>>3) != (sx>>3)) lx = sx|7;
+            int any_ink = 0, any_paper = 0;
+            for (uint32_t p = sx; p <= lx; p++) {
+                if ((row[p>>3] >> (7-(p&7))) & 1) any_ink = 1;
+                else any_paper = 1;
+            }
+            Ref[y][x] = !any_ink ? zxpalette[paper] :
+                        !any_paper ? zxpalette[ink] : BlendTable[ink][paper];
+        }
+    }
+}
+
+/* ================================== Test ================================== */
+
+static int compare(const char *what, const struct render_frame *f) {
+    st77xx_wait();
+    for (uint32_t y = 0; y < st77_height; y++) {
+        if (memcmp(Ref[y],Display[y],sizeof(Display[y])) == 0) continue;
+        uint32_t x = 0;
+        while (Ref[y][x] == Display[y][x]) x++;
+        printf("FAIL %dx%d %s: scaling %d border %d smooth %d bits %u, "
+               "pixel %u,%u is %04x instead of %04x\n",
+               st77_width, st77_height, what, f->scaling, f->show_border,
+               f->smooth, (unsigned)st77_pixel_bits, (unsigned)x,
+               (unsigned)y, Display[y][x], Ref[y][x]);
+        return 1;
+    }
+    return 0;
+}
+
+static uint32_t bitmap_offset(uint32_t yy) {
+    return ((yy & 0xC0)<<5) | ((yy & 0x07)<<8) | ((yy & 0x38)<<2);
+}
+
+int main(void) {
+    static const uint8_t scalings[] = {
+        25, 30, 37, 40, 45, 50, 60, 75, 87, 90, 100, 112, 125, 133, 150,
+        180, 200, 0
+    };
+    static struct render_frame f;
+    uint32_t frames = 0;
+
+    for (int j = 0; j < 16; j++)
+        zxpalette_rgb[j] = (j*0x51a3b7+0x112233) & 0xffffff;
+    srand(3);
+
+    for (int bits = 16; bits >= 12; bits -= 4) {
+        // Like st77xx_set_pixel_bits(): 12 bits need an even width.
+        if (bits == 12 && (st77_width & 1)) continue;
+        st77_pixel_bits = bits;
+        palette_init();
+        Geometry.valid = 0;
+
+        for (uint32_t s = 0; s < sizeof(scalings); s++)
+        for (int border = 0; border < 2; border++)
+        for (int smooth = 0; smooth < 2; smooth++)
+        for (int run = 0; run < 3; run++) {
+            // A new configuration: the main loop clears the display and
+            // forces a full update.
+            memset(&f,0,sizeof(f));
+            for (int j = 0; j < 6912; j++) f.screen[j] = rand();
+            int c = rand()&7;
+            for (int j = 0; j < 256; j++) {
+                if (rand()%16 == 0) c = rand()&7;
+                f.border[j] = c;
+            }
+            f.show_border = border;
+            f.scaling = scalings[s];
+            f.smooth = smooth;
+            f.blink = run & 1;
+            f.partial_update = run != 2;
+            f.update_border = 1;
+            memset(f.dirty,0xff,sizeof(f.dirty));
+            memset(Display,0,sizeof(Display));
+            update_display(&f);
+            reference(&f);
+            if (compare("full update",&f)) return 1;
+            frames++;
+
+            // Then a few rows change, with the border the same, all of
+            // one color, or changing on some lines.
+            for (int k = 0; k < 4; k++) {
+                memset(f.dirty,0,sizeof(f.dirty));
+                f.update_border = 0;
+                for (int r = 0; r < 1+rand()%6; r++) {
+                    uint32_t yy = rand()%192;
+                    for (int j = 0; j < 32; j++)
+                        f.screen[bitmap_offset(yy)+j] = rand();
+                    f.dirty[yy>>3] |= 1<<(yy&7);
+                }
+                if (k == 1) {
+                    memset(f.border,rand()&7,sizeof(f.border));
+                } else if (k == 2) {
+                    for (int j = 0; j < 256; j++)
+                        if (rand()%8 == 0) f.border[j] = rand()&7;
+                } else if (k == 3) {
+                    // Attribute changes dirty the 8 rows of the cell.
+                    uint32_t cell = rand()%24;
+                    for (int j = 0; j < 32; j++)
+                        f.screen[0x1800+cell*32+j] = rand();
+                    f.dirty[cell] = 0xff;
+                }
+                update_display(&f);
+                reference(&f);
+                if (compare(k == 0 ? "dirty rows" : "border change",&f))
+                    return 1;
+                frames++;
+            }
+        }
+    }
+    printf("render_test %dx%d: %u frames, all passed\n",
+           st77_width, st77_height, (unsigned)frames);
+    return 0;
+}
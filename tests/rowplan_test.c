@@ -0,0 +1,262 @@
+/* Host test of rowplan.h: the plans must send every row requested, be
+ * the cheapest for the cost model (checked against all the ways of
+ * merging the runs on small inputs), and rowplan_chase() must return
+ * start times that write every row between two refreshes of its line. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rowplan.h"
+
+#define MAX_ROWS 320
+
+static int failed;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("FAIL line %d: ", __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failed = 1; \
+        return; \
+    } \
+} while(0)
+
+// Check that the plan is well formed and sends all the rows requested.
+static void check_plan(const uint8_t *rows, uint32_t count,
+                       const rowplan_run_t *runs, int n)
+{
+    CHECK(n >= 0 && n <= (int)ROWPLAN_MAX_RUNS(count), "%d runs", n);
+    int any = 0;
+    for (uint32_t y = 0; y < count; y++) any |= rows[y];
+    CHECK((n == 0) == !any, "%d runs for %s rows", n, any ? "some" : "no");
+    for (int j = 0; j < n; j++) {
+        CHECK(runs[j].first <= runs[j].last, "run %d reversed", j);
+        CHECK(runs[j].last < count, "run %d past the end", j);
+        CHECK(j == 0 || runs[j].first > runs[j-1].last+1,
+              "runs %d and %d touch", j-1, j);
+    }
+    for (uint32_t y = 0; y < count; y++) {
+        if (!rows[y]) continue;
+        int sent = 0;
+        for (int j = 0; j < n; j++)
+            sent |= y >= runs[j].first && y <= runs[j].last;
+        CHECK(sent, "row %u not sent", (unsigned)y);
+    }
+}
+
+// Cheapest plan by brute force: try every subset of the gaps to merge,
+// and the full display.
+static uint32_t best_cost(const uint8_t *rows, uint32_t count,
+                          const rowplan_cost_t *cost)
+{
+    rowplan_run_t base[MAX_ROWS], plan[MAX_ROWS];
+    int nb = 0;
+    for (uint32_t y = 0; y < count; y++) {
+        if (!rows[y]) continue;
+        base[nb].first = y;
+        while (y+1 < count && rows[y+1]) y++;
+        base[nb++].last = y;
+    }
+    if (nb == 0) return 0;
+    rowplan_run_t full = {0, count-1};
+    uint32_t best = rowplan_cost(&full,1,cost);
+    for (uint32_t mask = 0; mask < (1u << (nb-1)); mask++) {
+        int n = 0;
+        plan[n++] = base[0];
+        for (int j = 1; j < nb; j++) {
+            if (mask & (1u << (j-1))) plan[n-1].last = base[j].last;
+            else plan[n++] = base[j];
+        }
+        uint32_t c = rowplan_cost(plan,n,cost);
+        if (c < best) best = c;
+    }
+    return best;
+}
+
+static void test_empty(void) {
+    uint8_t rows[MAX_ROWS] = {0};
+    rowplan_run_t runs[ROWPLAN_MAX_RUNS(MAX_ROWS)];
+    rowplan_cost_t cost = {48, 480};
+    CHECK(rowplan(rows,240,&cost,runs) == 0, "rows to send in no rows");
+    CHECK(rowplan(rows,0,&cost,runs) == 0, "rows to send in 0 rows");
+
+    // rowplan_chase() with an empty plan: any start is fine.
+    rowplan_scan_t scan = {16667, 320, 0, 1};
+    rowplan_slot_t slot;
+    CHECK(rowplan_chase(runs,0,&cost,&scan,100,&slot) == 1,
+          "empty plan too slow");
+    CHECK(slot.min <= slot.max, "empty slot %d-%d", slot.min, slot.max);
+}
+
+static void test_merge(void) {
+    uint8_t rows[MAX_ROWS] = {0};
+    rowplan_run_t runs[ROWPLAN_MAX_RUNS(MAX_ROWS)];
+    rowplan_cost_t cost = {100, 40}; // A window costs 2.5 rows.
+
+    // Gaps of 2 rows (80 bytes) are merged, gaps of 3 (120) are not.
+    rows[10] = rows[13] = rows[17] = 1;
+    int n = rowplan(rows,240,&cost,runs);
+    check_plan(rows,240,runs,n);
+    CHECK(n == 2 && runs[0].first == 10 && runs[0].last == 13 &&
+          runs[1].first == 17 && runs[1].last == 17,
+          "gaps not merged by cost: %d runs", n);
+
+    // A gap costing exactly a window is not merged.
+    cost.window = 80;
+    n = rowplan(rows,240,&cost,runs);
+    CHECK(n == 3, "gap as costly as a window merged: %d runs", n);
+}
+
+static void test_full(void) {
+    uint8_t rows[MAX_ROWS] = {0};
+    rowplan_run_t runs[ROWPLAN_MAX_RUNS(MAX_ROWS)];
+    rowplan_cost_t cost = {100, 40};
+
+    // Every gap costs as much as a window, so none is merged, and the
+    // whole display costs the same as the 120 runs: one window wins.
+    for (int y = 0; y < 239; y += 2) rows[y] = 1;
+    cost.window = 40;
+    int n = rowplan(rows,239,&cost,runs);
+    check_plan(rows,239,runs,n);
+    CHECK(n == 1 && runs[0].first == 0 && runs[0].last == 238,
+          "full display not used: %d runs", n);
+
+    // With one more row not sent at the end, the runs are cheaper.
+    n = rowplan(rows,240,&cost,runs);
+    check_plan(rows,240,runs,n);
+    CHECK(n == 120, "full display used: %d runs", n);
+
+    // A few rows in the middle: two windows are cheaper than the display.
+    memset(rows,0,sizeof(rows));
+    rows[100] = rows[200] = 1;
+    n = rowplan(rows,240,&cost,runs);
+    CHECK(n == 2, "full display for two rows: %d runs", n);
+
+    // Rows 0 and the last one, with a cheap window: two runs. With a
+    // window costing more than the rows between, the whole display.
+    memset(rows,0,sizeof(rows));
+    rows[0] = rows[239] = 1;
+    n = rowplan(rows,240,&cost,runs);
+    CHECK(n == 2, "%d runs for the first and last row", n);
+    cost.window = 238*40+1;
+    n = rowplan(rows,240,&cost,runs);
+    CHECK(n == 1 && runs[0].first == 0 && runs[0].last == 239,
+          "%d runs for the first and last row, costly window", n);
+}
+
+static void test_random(void) {
+    uint8_t rows[MAX_ROWS];
+    rowplan_run_t runs[ROWPLAN_MAX_RUNS(MAX_ROWS)];
+    for (int t = 0; t < 20000; t++) {
+        uint32_t count = 1 + rand()%40;
+        int density = 1 + rand()%6;
+        for (uint32_t y = 0; y < count; y++) rows[y] = rand()%density == 0;
+        rowplan_cost_t cost = {rand()%200, 1+rand()%60};
+        int n = rowplan(rows,count,&cost,runs);
+        check_plan(rows,count,runs,n);
+        if (failed) return;
+        CHECK(rowplan_cost(runs,n,&cost) == best_cost(rows,count,&cost),
+              "plan cost %u, best %u", (unsigned)rowplan_cost(runs,n,&cost),
+              (unsigned)best_cost(rows,count,&cost));
+    }
+}
+
+// Every row must be written after its line was refreshed, and before
+// the next refresh reaches it, starting at any time in the slot.
+static void check_slot(const rowplan_run_t *runs, int n,
+                       const rowplan_cost_t *cost, const rowplan_scan_t *scan,
+                       uint32_t byte_ns, int64_t start_us)
+{
+    int64_t sent_ns = start_us*1000;
+    for (int j = 0; j < n; j++) {
+        sent_ns += (int64_t)cost->window*byte_ns;
+        for (uint32_t y = runs[j].first; y <= runs[j].last; y++) {
+            int64_t line = scan->first + scan->dir*(int64_t)y;
+            // Refreshed at line*period/lines us: compare in ns*lines.
+            int64_t at = line*scan->period*1000;
+            int64_t next = at + (int64_t)scan->period*1000*scan->lines;
+            int64_t begin = sent_ns*scan->lines;
+            sent_ns += (int64_t)cost->row*byte_ns;
+            int64_t end = sent_ns*scan->lines;
+            CHECK(begin >= at && end <= next,
+                  "row %u written at %lld-%lld ns, refreshed at %lld "
+                  "and %lld ns", (unsigned)y,
+                  (long long)(begin/scan->lines),
+                  (long long)(end/scan->lines),
+                  (long long)(at/scan->lines),
+                  (long long)(next/scan->lines));
+        }
+    }
+}
+
+// Latest minus earliest start time that writes every row tear free, in
+// ns*lines: negative if there is none.
+static int64_t exact_slack(const rowplan_run_t *runs, int n,
+                           const rowplan_cost_t *cost,
+                           const rowplan_scan_t *scan, uint32_t byte_ns)
+{
+    int64_t min = INT64_MIN, max = INT64_MAX, sent_ns = 0;
+    for (int j = 0; j < n; j++) {
+        sent_ns += (int64_t)cost->window*byte_ns;
+        for (uint32_t y = runs[j].first; y <= runs[j].last; y++) {
+            int64_t line = scan->first + scan->dir*(int64_t)y;
+            int64_t at = line*scan->period*1000;
+            int64_t next = at + (int64_t)scan->period*1000*scan->lines;
+            int64_t begin = sent_ns*scan->lines;
+            sent_ns += (int64_t)cost->row*byte_ns;
+            int64_t end = sent_ns*scan->lines;
+            if (at-begin > min) min = at-begin;
+            if (next-end < max) max = next-end;
+        }
+    }
+    return max-min;
+}
+
+static void test_chase(void) {
+    uint8_t rows[MAX_ROWS];
+    rowplan_run_t runs[ROWPLAN_MAX_RUNS(MAX_ROWS)];
+    int fit = 0, late = 0;
+    for (int t = 0; t < 20000; t++) {
+        uint32_t count = 240;
+        for (uint32_t y = 0; y < count; y++) rows[y] = rand()%3 == 0;
+        rowplan_cost_t cost = {48, 480};
+        int n = rowplan(rows,count,&cost,runs);
+        rowplan_scan_t scan = {16667, 320, 40, 1};
+        if (rand() & 1) {
+            scan.first = 279;
+            scan.dir = -1;
+        }
+        uint32_t byte_ns = 20 + rand()%150;
+        rowplan_slot_t slot;
+        if (!rowplan_chase(runs,n,&cost,&scan,byte_ns,&slot)) {
+            late++;
+            CHECK(slot.min == slot.max, "late slot %d-%d",
+                  slot.min, slot.max);
+            // Too slow: no start time fits, but for the microsecond
+            // rowplan_chase() may lose rounding each bound.
+            CHECK(exact_slack(runs,n,&cost,&scan,byte_ns) <
+                  2000*(int64_t)scan.lines, "fast plan reported late");
+            continue;
+        }
+        fit++;
+        CHECK(slot.min <= slot.max, "slot %d-%d", slot.min, slot.max);
+        check_slot(runs,n,&cost,&scan,byte_ns,slot.min);
+        check_slot(runs,n,&cost,&scan,byte_ns,slot.max);
+        check_slot(runs,n,&cost,&scan,byte_ns,(slot.min+slot.max)/2);
+        if (failed) return;
+    }
+    CHECK(fit && late, "only %d plans fit and %d late: tune the test",
+          fit, late);
+}
+
+int main(void) {
+    srand(1);
+    test_empty();
+    test_merge();
+    test_full();
+    test_random();
+    test_chase();
+    printf(failed ? "rowplan_test: FAILED\n" : "rowplan_test: all passed\n");
+    return failed;
+}
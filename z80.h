@@ -49,7 +49,10 @@
     ~~~C
     uint64_t z80_tick(z80_t* cpu, uint64_t pins)
     ~~~
-        Step the z80_t instance for one clock cycle.
+        Step the z80_t instance for one clock cycle. In the Pico port a
+        call may execute more than one clock cycle (see the glued steps
+        in z80_tick()), so the T-states actually executed are counted
+        in cpu->tstates, instruction by instruction.
 
     ~~~C
     uint64_t z80_prefetch(z80_t* cpu, uint16_t new_pc)
@@ -363,6 +366,7 @@ typedef struct {
     uint16_t af2, bc2, de2, hl2; // shadow register bank
     uint8_t im;
     bool iff1, iff2;
+    uint32_t tstates;   // T-states executed so far, wraps around
 } z80_t;
 
 // initialize a new Z80 instance and return initial pin mask
@@ -412,8 +416,11 @@ uint64_t z80_init(z80_t* cpu) {
 }
 
 uint64_t z80_reset(z80_t* cpu) {
-    // reset state as described in 'The Undocumented Z80 Documented'
+    // reset state as described in 'The Undocumented Z80 Documented',
+    // the T-states counter keeps running
+    const uint32_t tstates = cpu->tstates;
     memset(cpu, 0, sizeof(z80_t));
+    cpu->tstates = tstates;
     cpu->af = cpu->bc = cpu->de = cpu->hl = 0xFFFF;
     cpu->wz = cpu->sp = cpu->ix = cpu->iy = 0xFFFF;
     cpu->af2 = cpu->bc2 = cpu->de2 = cpu->hl2 = 0xFFFF;
@@ -1673,6 +1680,51 @@ static const uint16_t _z80_ed_optable[256] = {
      957,  // FF: ED NOP (M:1 T:4 steps:1)
  };
 
+// T-states of each instruction, from the comments of the tables above,
+// added when the opcode is decoded: the steps of z80_tick() are no longer
+// one per clock cycle, since some are glued together. For conditional
+// instructions this is the longest path, _skip() removes the steps not
+// taken. DD/FD prefixed instructions use the same table, plus the prefix
+// and the d-offset load cycles.
+static const uint8_t _z80_tstates[512] = {
+     4, 10,  7,  6,  4,  4,  7,  4,  4, 11,  7,  6,  4,  4,  7,  4,  // 00
+    13, 10,  7,  6,  4,  4,  7,  4, 12, 11,  7,  6,  4,  4,  7,  4,  // 10
+    12, 10, 16,  6,  4,  4,  7,  4, 12, 11, 16,  6,  4,  4,  7,  4,  // 20
+    12, 10, 13,  6, 11, 11, 10,  4, 12, 11, 13,  6,  4,  4,  7,  4,  // 30
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 40
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 50
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 60
+     7,  7,  7,  7,  7,  7,  4,  7,  4,  4,  4,  4,  4,  4,  7,  4,  // 70
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 80
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 90
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // A0
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // B0
+    11, 10, 10, 10, 17, 11,  7, 11, 11, 10, 10,  4, 17, 17,  7, 11,  // C0
+    11, 10, 10, 11, 17, 11,  7, 11, 11,  4, 10, 11, 17,  4,  7, 11,  // D0
+    11, 10, 10, 19, 17, 11,  7, 11, 11,  4, 10,  4, 17,  4,  7, 11,  // E0
+    11, 10, 10,  4, 17, 11,  7, 11, 11,  6, 10,  4, 17,  4,  7, 11,  // F0
+    // ED prefixed, the ED prefix itself not included
+     4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  // 00
+     4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  // 10
+     4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  // 20
+     4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  // 30
+     8,  8, 11, 16,  4, 10,  4,  5,  8,  8, 11, 16,  4, 10,  4,  5,  // 40
+     8,  8, 11, 16,  4, 10,  4,  5,  8,  8, 11, 16,  4, 10,  4,  5,  // 50
+     8,  8, 11, 16,  4, 10,  4, 14,  8,  8, 11, 16,  4, 10,  4, 14,  // 60
+     8,  8, 11, 16,  4, 10,  4,  4,  8,  8, 11, 16,  4, 10,  4,  4,  // 70
+     4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  // 80
+     4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  // 90
+    12, 12, 12, 12,  4,  4,  4,  4, 12, 12, 12, 12,  4,  4,  4,  4,  // A0
+    17, 17, 17, 17,  4,  4,  4,  4, 17, 17, 17, 17,  4,  4,  4,  4,  // B0
+     4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  // C0
+     4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  // D0
+     4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  // E0
+     4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  // F0
+};
+
+// T-states of the interrupt modes 0, 1, 2 acknowledge.
+static const uint8_t _z80_int_tstates[3] = { 6, 13, 19 };
+
 static const uint16_t _z80_special_optable[_Z80_OPSTATE_NUM_SPECIAL_OPS] = {
     1443,  // 00: cb (M:1 T:4 steps:1)
     1444,  // 01: cbhl (M:3 T:11 steps:8)
@@ -1702,6 +1754,7 @@ static inline uint64_t _z80_fetch(z80_t* cpu, uint64_t pins) {
     else if (cpu->int_bits & Z80_NMI) {
         // non-maskable interrupt starts with a regular M1 machine cycle
         cpu->step = _z80_special_optable[_Z80_OPSTATE_SLOT_NMI];
+        cpu->tstates += 11;
         cpu->int_bits = 0;
         if (pins & Z80_HALT) {
             pins &= ~Z80_HALT;
@@ -1717,6 +1770,7 @@ static inline uint64_t _z80_fetch(z80_t* cpu, uint64_t pins) {
             // pins M1|IOQR to request a special byte which is handled differently
             // depending on interrupt mode
             cpu->step = _z80_special_optable[_Z80_OPSTATE_SLOT_INT_IM0 + cpu->im];
+            cpu->tstates += _z80_int_tstates[cpu->im];
             cpu->int_bits = 0;
             if (pins & Z80_HALT) {
                 pins &= ~Z80_HALT;
@@ -1745,6 +1799,7 @@ static inline uint64_t _z80_fetch_cb(z80_t* cpu, uint64_t pins) {
         // loads the d-offset first and then the opcode in a
         // regular memory read machine cycle
         cpu->step = _z80_special_optable[_Z80_OPSTATE_SLOT_DDFDCB];
+        cpu->tstates += 15; // The CB opcode was already counted.
     }
     else {
         // this is a regular CB-prefixed instruction, continue
@@ -1793,7 +1848,7 @@ uint64_t z80_prefetch(z80_t* cpu, uint16_t new_pc) {
 #define _gd()               _z80_get_db(pins)
 
 // high level helper macros
-#define _skip(n)        cpu->step+=(n);
+#define _skip(n)        cpu->step+=(n);cpu->tstates-=(n);
 #define _fetch_dd()     pins=_z80_fetch_dd(cpu,pins);
 #define _fetch_fd()     pins=_z80_fetch_fd(cpu,pins);
 #define _fetch_ed()     pins=_z80_fetch_ed(cpu,pins);
@@ -1848,6 +1903,7 @@ switch_again:
         case 1: pins = _z80_refresh(cpu, pins); cpu->step = 2;
         case 2: {
             cpu->step = _z80_optable[cpu->opcode];
+            cpu->tstates += _z80_tstates[cpu->opcode];
             // preload effective address for (HL) ops
             cpu->addr = cpu->hl;
         } goto step_next;
@@ -1859,13 +1915,14 @@ switch_again:
         // M1/T4: branch to instruction 'payload'
         case 5: {
             cpu->step = _z80_ddfd_optable[cpu->opcode];
+            cpu->tstates += _z80_tstates[cpu->opcode];
             cpu->addr = cpu->hlx[cpu->hlx_idx].hl;
         } goto step_next;
         //=== optional d-loading cycle for (IX+d), (IY+d)
         //--- mread
         case 6: goto step_next;
         case 7: _wait();_mread(cpu->pc++); goto step_next;
-        case 8: cpu->addr += (int8_t)_gd(); cpu->wz = cpu->addr; goto step_next;
+        case 8: cpu->addr += (int8_t)_gd(); cpu->wz = cpu->addr; cpu->tstates += 8; goto step_next;
         //--- filler ticks
         case 9: goto step_next;
         case 10: goto step_next;
@@ -1880,7 +1937,7 @@ switch_again:
         //--- mread for d offset
         case 14: goto step_next;
         case 15: _wait();_mread(cpu->pc++); goto step_next;
-        case 16: cpu->addr += (int8_t)_gd(); cpu->wz = cpu->addr; goto step_next;
+        case 16: cpu->addr += (int8_t)_gd(); cpu->wz = cpu->addr; cpu->tstates += 5; goto step_next;
         //--- mread for n
         case 17: goto step_next;
         case 18: _wait();_mread(cpu->pc++); goto step_next;
@@ -1899,9 +1956,11 @@ switch_again:
                 // this is a (HL) instruction
                 cpu->addr = cpu->hl;
                 cpu->step = _z80_special_optable[_Z80_OPSTATE_SLOT_CBHL];
+                cpu->tstates += 11;
             }
             else {
                 cpu->step = _z80_special_optable[_Z80_OPSTATE_SLOT_CB];
+                cpu->tstates += 4;
             }
         } goto step_next_and_iterate;
         //=== special opcode fetch machine cycle for ED-prefixed instructions
@@ -1910,7 +1969,7 @@ switch_again:
         // M1/T3: refresh cycle
         case 26: pins = _z80_refresh(cpu, pins); goto step_next_and_iterate;
         // M1/T4: branch to instruction 'payload'
-        case 27: cpu->step = _z80_ed_optable[cpu->opcode]; goto step_next_and_iterate;
+        case 27: cpu->step = _z80_ed_optable[cpu->opcode]; cpu->tstates += _z80_tstates[256+cpu->opcode]; goto step_next_and_iterate;
         //=== from here on code-generated
         
         //  00: NOP (M:1 T:4)
@@ -1,7 +1,10 @@
 #pragma once
 // #version:6#
 // machine generated, do not edit!
-unsigned char dump_amstrad_zx128k_0_bin[16384] = {
+#ifndef ZX_ROM_128K_ATTR
+#define ZX_ROM_128K_ATTR // Optional placement of the 128K ROMs.
+#endif
+unsigned char ZX_ROM_128K_ATTR dump_amstrad_zx128k_0_bin[16384] = {
 0xf3, 0x1, 0x2b, 0x69, 0xb, 0x78, 0xb1, 0x20, 0xfb, 0xc3, 0xc7, 0x0, 0x0, 0x0, 0x0, 0x0, 
 0xef, 0x10, 0x0, 0xc9, 0x0, 0x0, 0x0, 0x0, 0xef, 0x18, 0x0, 0xc9, 0x0, 0x0, 0x0, 0x0, 
 0xef, 0x20, 0x0, 0xc9, 0x0, 0x0, 0x0, 0x0, 0xe3, 0xf5, 0x7e, 0x23, 0x23, 0x22, 0x5a, 0x5b, 
@@ -1028,7 +1031,7 @@ unsigned char dump_amstrad_zx128k_0_bin[16384] = {
 0x4d, 0x42, 0x0, 0x53, 0x42, 0x0, 0x41, 0x43, 0x0, 0x52, 0x47, 0x0, 0x4b, 0x4d, 0x0, 0x1, 
 
 };
-unsigned char dump_amstrad_zx128k_1_bin[16384] = {
+unsigned char ZX_ROM_128K_ATTR dump_amstrad_zx128k_1_bin[16384] = {
 0xf3, 0xaf, 0x11, 0xff, 0xff, 0xc3, 0xcb, 0x11, 0x2a, 0x5d, 0x5c, 0x22, 0x5f, 0x5c, 0x18, 0x43, 
 0xc3, 0xf2, 0x15, 0xff, 0xff, 0xff, 0xff, 0xff, 0x2a, 0x5d, 0x5c, 0x7e, 0xcd, 0x7d, 0x0, 0xd0, 
 0xcd, 0x74, 0x0, 0x18, 0xf7, 0xff, 0xff, 0xff, 0xc3, 0x5b, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff, 
@@ -8,6 +8,10 @@
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
 #include "hardware/vreg.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "hardware/irq.h"
 
 #include "device_config.h" // Hardware-specific defines for ST77 and keys.
 #include "st77xx.h"
@@ -17,19 +21,85 @@ inline void vram_set_dirty_bitmap(uint16_t addr);
 inline void vram_set_dirty_attr(uint16_t addr);
 inline void vram_force_dirty(void);
 
+// Compact emulator state: the 48K Spectrum has a fixed memory map, so
+// there is no need for the additional chips memory layers, the ROM can be
+// mapped in place instead of being copied inside zx_t, and the keyboard
+// masks can be stored packed. Comment this define to get the original
+// layout. See print_memory_report() for the actual numbers.
+#define ZX_COMPACT_STATE
+#ifdef ZX_COMPACT_STATE
+#define MEM_NUM_LAYERS (1U)
+#define MEM_SHARED_JUNK_PAGE
+#define KBD_COMPACT_KEY_MASKS
+#endif
+
+// Memory profiler: per 1k page read/write counters and address range
+// watchpoints, dumped on the serial every frame. See the "Memory profiler"
+// section. When not defined, mem.h has no additional checks at all.
+// #define ZX_MEM_PROFILE
+#ifdef ZX_MEM_PROFILE
+#define MEM_WATCH
+#endif
+
+// The 128K ROMs are only needed by 128K games: keep them in flash,
+// instead of copying them in RAM with the program. See set_zx_model().
+#define ZX_ROM_128K_ATTR __in_flash("zx_128k_roms")
+
 #define CHIPS_IMPL
 #include "chips_common.h"
 #include "mem.h"
 #include "z80.h"
 #include "kbd.h"
 #include "clk.h"
+#include "ay38910.h"
 #include "zx.h"
 #include "zx-roms.h"
+#include "lz.h"
+#include "rowplan.h"
 
 #define ZX_DEFAULT_SCANLINE_PERIOD 150
 
-/* Modified for even RGB565 conversion. */
-static uint32_t zxpalette[16] = {
+// Memory used for the rewind deltas ring buffer, in kilobytes. Rewind
+// also needs a 48k + state reference image. See the "Rewind" section.
+#define ZX_REWIND_BUFFER_KB 24
+
+// Keep core1 off the SRAM bank core0 uses the most. Core0 emulates the
+// Spectrum on zx_t, in the striped main SRAM, with its stack in SCRATCH_Y
+// as the Pico SDK places it. Core1 renders the display from main SRAM
+// too, but its stack, the audio interrupt handler and state, and the AY
+// state are in SCRATCH_X, so the audio runs without waiting for core0.
+// The audio bitmap and the AY writes queue, shared by the two cores, stay
+// in main SRAM. Comment the define and compare the "[timing]" lines to
+// measure the difference.
+#define ZX_BANK_PLACEMENT
+#ifdef ZX_BANK_PLACEMENT
+#define CORE1_HOT(group) __scratch_x(group)
+#else
+#define CORE1_HOT(group)
+#endif
+
+// Audio bitmap written by zx_exec_frame() and played by core1. It stays
+// in main SRAM: the audio interrupt reads one byte of it per sample.
+static uint32_t zx_audiobuf[AUDIOBUF_LEN];
+
+// AY chip state, used only by core1. The writes queue instead stays in
+// main SRAM: it is 1k, SCRATCH_X is small, and core1 only reads it when
+// it is not empty.
+static ay38910_t CORE1_HOT("zx_ay") core1_ay;
+static ay38910_queue_t zx_ay_queue;
+
+// PWM level of the beeper when high. The AY output, up to
+// AY38910_MAX_LEVEL, is added to it.
+#define AUDIO_BEEPER_LEVEL 64
+
+// Core1 stack. Must hold printf() calls in debug mode, and the audio
+// interrupt.
+#define CORE1_STACK_SIZE 2048
+static uint32_t CORE1_HOT("zx_core1_stack") core1_stack[CORE1_STACK_SIZE/4];
+
+/* Modified for even RGB565 conversion. Converted in the display pixel
+ * format into zxpalette[] by palette_init(). */
+static const uint32_t zxpalette_rgb[16] = {
     0x000000,     // std black
     0xD80000,     // std blue
     0x0000D8,     // std red
@@ -47,15 +117,24 @@ static uint32_t zxpalette[16] = {
     0x00FFFF,     // bright yellow
     0xFFFFFF,     // bright white
 };
+static uint32_t zxpalette[16];
 
 void load_game(int game_id);
+void rewind_init(void);
+void rewind_free(void);
+void rewind_reset(void);
 
 /* =============================== Games list =============================== */
 
+#define GAME_FORMAT_Z80 'Z'  // .z80 snapshot, compressed or not.
+#define GAME_FORMAT_SNA 'S'  // 48K .sna snapshot.
+#define GAME_FORMAT_TAPE 'T' // .tap or .tzx tape image.
+
 struct game_entry {
-    char name[8];           // Z80 snapshot filename, first chars.
+    char name[8];           // Snapshot filename, first chars.
     void *addr;             // Address in the flash memory.
     uint32_t size;          // Length in bytes.
+    uint8_t format;         // One of GAME_FORMAT_*.
 };
 
 // These are populate during initialization, by scanning the
@@ -101,19 +180,17 @@ uint32_t GamesTableSize;
 
 /* ========================== Global state and defines ====================== */
 
-// Don't trust this USEC figure here, since the z80.h file implementation
-// is modified to glue together the instruction fetch steps, so we do
-// more work per tick.
-#define FRAME_USEC (25000)
+#define SAVESTATE_SLOTS 4 // Number of quick save slots.
+#define FFWD_DISPLAY_FRAMES 16 // Display refresh period in fast forward.
 
 struct emustate {
     zx_t zx;    // The emulator state.
     int debug;  // Debugging mode
 
-    // We switch betweent wo clocks: one is selected just for zx_exec(), that
-    // is the most speed critical code path. For all the other code execution
-    // we stay to a lower overclocking mode that is low enough to allow the
-    // flash memory to be accessed without issues.
+    // We switch betweent wo clocks: one is selected just for
+    // zx_exec_frame(), that is the most speed critical code path. For all
+    // the other code execution we stay to a lower overclocking mode that is
+    // low enough to allow the flash memory to be accessed without issues.
     uint32_t base_clock;
     uint32_t emu_clock;
 
@@ -133,23 +210,133 @@ struct emustate {
     int loaded_game;            // Game index of the game currently loaded.
     uint32_t show_border;       // If 0, Spectrum border is not drawn.
     uint32_t scaling;           // Spectrum -> display scaling factor.
+    uint32_t smooth;            // Smooth downscaling, see render_setup().
+    uint32_t rgb444;            // 12 bit display pixels, see st77xx.h.
     uint32_t brightness;        // Display brightness.
     uint32_t partial_update;    // Display partial update true/false.
+    uint32_t beam;              // Show the screen as captured by the beam.
+    uint32_t save_slot;         // Slot used by quick save / quick load.
+    uint32_t turbo;             // Emulated frames per display refresh, set
+                                // by the program via the turbo port.
+    uint32_t ffwd;              // Fast forward, see the section.
+    int rewinding;              // Rewind chord held, see "Rewind".
 
     // Audio related
     uint32_t volume;            // Audio volume. Controls PWM value.
-    volatile uint32_t audio_sample_wait; // Wait time (in busy loop cycles)
-                                         // between samples when playing back.
 
     // All our UI graphic primitives are automatically cropped
     // to the area selected by ui_set_crop_area().
     uint16_t ui_crop_x1, ui_crop_x2, ui_crop_y1, ui_crop_y2;
 
-    uint8_t dirty_vram[24]; // Track rows that changed since last update.
-    uint8_t last_update_border_color; // Track last border color to update the
-                                      // screen border only if it changed.
+    uint8_t dirty_vram[24]; // Track rows that changed since the last frame
+                            // sent to the display.
+    uint8_t force_border_update; // Redraw the whole border with the next
+                                 // frame sent to the display.
+
+    // Frame timings, aggregated and printed every TIMING_FRAMES frames.
+    struct {
+        uint32_t frames;
+        uint64_t exec_sum, exec_min, exec_max;
+        uint64_t update_sum;
+        uint64_t ticks_sum;             // Z80 T-states executed.
+        uint32_t audio_us, audio_irqs;  // Audio.irq_* at the last print.
+        uint32_t rendered, render_us;   // Render.* at the last print.
+        uint32_t rows, rows_us;         // RowTiming.* at the last print.
+        uint32_t te_frames, te_late;    // TESync.* at the last print.
+        uint32_t te_wait_us;
+        absolute_time_t last_print;
+        float ns_per_tick_48k;          // Last 48K figure, as reference
+                                        // for the 128K banked accesses.
+    } timing;
 } EMU;
 
+/* ============================ Memory profiler ============================= */
+
+// When ZX_MEM_PROFILE is defined, the pages selected by MEMPROF_PAGES and
+// the ones touched by the watchpoints below are routed by mem.h to the
+// mem_watch_access() slow path. All the other pages keep the fast path,
+// so to profile a specific area without slowing down the game too much,
+// restrict MEMPROF_PAGES. Every frame a line in the following format
+// is emitted on the serial (counters are 16 bit hex, one per page):
+//
+//  [memprof] <frame> R <reads page 0> ... <reads page 63> W <writes...>
+//  [memwatch] <frame> <name> hits:<n> addr:<addr> data:<data> pc:<pc>
+//
+// Writing a host-side heatmap from these lines is trivial.
+#ifdef ZX_MEM_PROFILE
+#define MEMPROF_PAGES 0xFFFFFFFFFFFF0000ULL // Counted pages: all the RAM.
+
+#define MEMPROF_R 1 // Watch reads.
+#define MEMPROF_W 2 // Watch writes.
+struct memprof_watch {
+    uint16_t start, end;        // Watched address range, inclusive.
+    uint8_t flags;              // MEMPROF_R|MEMPROF_W.
+    const char *name;           // Name shown in the report.
+    uint32_t hits;              // Accesses since last report.
+    uint16_t last_addr;         // Address of the last hit.
+    uint16_t last_pc;           // Z80 PC after the last hit.
+    uint8_t last_data;          // Value read/written by the last hit.
+};
+
+struct memprof_watch MemWatchList[] = {
+    {0x5c00, 0x5cbf, MEMPROF_W, "sysvars"},
+    {0, 0, 0, NULL} // Terminator.
+};
+
+struct {
+    uint16_t reads[MEM_NUM_PAGES];
+    uint16_t writes[MEM_NUM_PAGES];
+} MemProf;
+
+// Called by mem.h for every access to a watched page. Counters
+// saturate, to avoid a busy page wrapping to a low value.
+void mem_watch_access(uint16_t addr, uint8_t data, bool write) {
+    uint32_t page = addr >> MEM_PAGE_SHIFT;
+    uint16_t *counter = write ? &MemProf.writes[page] : &MemProf.reads[page];
+    if (*counter != UINT16_MAX) (*counter)++;
+
+    for (struct memprof_watch *w = MemWatchList; w->name; w++) {
+        if (addr < w->start || addr > w->end) continue;
+        if (!(w->flags & (write ? MEMPROF_W : MEMPROF_R))) continue;
+        w->hits++;
+        w->last_addr = addr;
+        w->last_pc = EMU.zx.cpu.pc;
+        w->last_data = data;
+    }
+}
+
+// Route the counted and watched pages to the slow path.
+void memprof_init(void) {
+    for (uint32_t page = 0; page < MEM_NUM_PAGES; page++) {
+        bool watched = (MEMPROF_PAGES >> page) & 1;
+        for (struct memprof_watch *w = MemWatchList; w->name; w++) {
+            if ((w->start >> MEM_PAGE_SHIFT) <= page &&
+                (w->end >> MEM_PAGE_SHIFT) >= page) watched = true;
+        }
+        mem_watch_page(&EMU.zx.mem, page, watched);
+    }
+}
+
+// Dump and reset the counters. Called once per frame.
+void memprof_report(void) {
+    printf("[memprof] %u R", (unsigned)EMU.tick);
+    for (uint32_t page = 0; page < MEM_NUM_PAGES; page++)
+        printf(" %x", MemProf.reads[page]);
+    printf(" W");
+    for (uint32_t page = 0; page < MEM_NUM_PAGES; page++)
+        printf(" %x", MemProf.writes[page]);
+    printf("\n");
+    for (struct memprof_watch *w = MemWatchList; w->name; w++) {
+        if (w->hits == 0) continue;
+        printf("[memwatch] %u %s hits:%u addr:%04x data:%02x pc:%04x\n",
+            (unsigned)EMU.tick, w->name, (unsigned)w->hits,
+            w->last_addr, w->last_data, w->last_pc);
+        w->hits = 0;
+    }
+    memset(&MemProf,0,sizeof(MemProf));
+}
+#endif
+
 /* ========================== Emulator user interface ======================= */
 
 // Numerical parameters that it is possible to change using the
@@ -161,14 +348,16 @@ struct emustate {
 #define UI_EVENT_BORDER 3       // Display border option toggled.
 #define UI_EVENT_SCALING 4      // Display scaling modified.
 #define UI_EVENT_VOLUME 5       // Volume modified.
-#define UI_EVENT_SYNC 6         // Audio sync wait time modified.
 #define UI_EVENT_BRIGHTNESS 7   // Display brightness modified.
 #define UI_EVENT_PARTIAL 8      // Display partial update toggled.
+#define UI_EVENT_BEAM 9         // Beam synchronized rendering toggled.
+#define UI_EVENT_SMOOTH 10      // Smooth downscaling toggled.
+#define UI_EVENT_RGB444 11      // Display pixel format toggled.
 #define UI_EVENT_NAVIGATION 254 // Just moving around in the menu.
 #define UI_EVENT_DISMISS 255    // Menu dismissed.
 
-const uint32_t SettingsZoomValues[] = {50,75,84,100,112,125,150,200};
-const char *SettingsZoomValuesNames[] = {"50%","75%","84%","100%","112%","125%","150%","200%",NULL};
+const uint32_t SettingsZoomValues[] = {50,75,87,100,112,125,150,200,0};
+const char *SettingsZoomValuesNames[] = {"50%","75%","87%","100%","112%","125%","150%","200%","fit",NULL};
 struct UISettingsItem {
     uint32_t event;     // Event reported if setting is changed.
     const char *name;   // Name of the setting.
@@ -190,16 +379,24 @@ struct UISettingsItem {
         "scaling", &EMU.scaling, 0, 0, 0,
         SettingsZoomValues, SettingsZoomValuesNames,
     },
+    {UI_EVENT_SMOOTH,
+        "smooth", &EMU.smooth, 1, 0, 1, NULL, NULL},
     {UI_EVENT_VOLUME,
         "volume", &EMU.volume, 1, 0, 20, NULL, NULL},
     {UI_EVENT_BRIGHTNESS,
         "bright", &EMU.brightness, 1, 0, ST77_MAX_BRIGHTNESS, NULL, NULL},
     {UI_EVENT_PARTIAL,
         "part-up", &EMU.partial_update, 1, 0, 1, NULL, NULL},
-    {UI_EVENT_SYNC,
-        "sync",(uint32_t*)&EMU.audio_sample_wait, 5, 0, 1000, NULL, NULL},
+    {UI_EVENT_RGB444,
+        "rgb444", &EMU.rgb444, 1, 0, 1, NULL, NULL},
+    {UI_EVENT_BEAM,
+        "beam", &EMU.beam, 1, 0, 1, NULL, NULL},
+    {UI_EVENT_NONE,
+        "ffwd", &EMU.ffwd, 1, 0, 1, NULL, NULL},
+    {UI_EVENT_NONE,
+        "scan-p", (uint32_t*)&EMU.zx.scanline_period, 1, 10, 500, NULL, NULL},
     {UI_EVENT_NONE,
-        "scan-p", (uint32_t*)&EMU.zx.scanline_period, 1, 10, 500, NULL, NULL}
+        "slot", &EMU.save_slot, 1, 0, SAVESTATE_SLOTS-1, NULL, NULL}
 };
 
 #define SettingsListLen (sizeof(SettingsList)/sizeof(SettingsList[0]))
@@ -287,7 +484,7 @@ void ui_reset_crop_area(void) {
 void ui_fill_box(uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint8_t color, uint8_t bcolor) {
     uint16_t x2 = x+width-1;
     uint16_t y2 = y+height-1;
-    uint8_t *vmem = EMU.zx.ram[EMU.zx.display_ram_bank];
+    uint8_t *vmem = zx_display_ram(&EMU.zx);
 
     for (int py = y; py <= y2; py++) {
         for (int px = x; px <= x2; px++) {
@@ -414,7 +611,7 @@ uint32_t ui_handle_key_press(void) {
 // menu visible.
 void ui_set_area_attributes(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2)
 {
-    uint8_t *vmem = EMU.zx.ram[EMU.zx.display_ram_bank];
+    uint8_t *vmem = zx_display_ram(&EMU.zx);
     for (uint16_t y = y1; y <= y2 && y < 192; y += 8) {
         for (uint16_t x = x1; x <= x2 && x < 256; x += 8) {
             vmem[0x1800+(((y>>3)<<5)|(x>>3))] = 7;
@@ -497,243 +694,695 @@ inline void vram_reset_dirty(void) {
 }
 
 // Set the bitmap of modified scanlines to all ones: this way
-// the update_display() function will be forced to do a full
-// refresh, border included.
+// the next frame sent to the display will be fully refreshed,
+// border included.
 inline void vram_force_dirty(void) {
     memset(EMU.dirty_vram,0xff,sizeof(EMU.dirty_vram));
-    EMU.last_update_border_color = 0xff; // Impossible color: update forced.
+    EMU.force_border_update = 1;
 }
 
-// ZX Spectrum palette to RGB565 conversion. We do it at startup to avoid
-// burning CPU cycles later.
-uint16_t palette_to_565(uint32_t color) {
-    return st77xx_rgb565(color & 0xff, (color>>8) & 0xff, (color>>16) & 0xff);
+// Border color of each line the beam traced, see zx_set_border_log(): the
+// display draws the border line by line, so that the stripes of the
+// loaders and the border effects of demos and games show up.
+static uint8_t BorderLog[ZX_BORDER_LOG_LINES];
+
+// Beam synchronized rendering. Normally the display gets the video RAM
+// after zx_exec_frame() returns at the end of the bitmap area, so it shows
+// whatever the game wrote meanwhile, even after the beam passed: sprites
+// erased and redrawn "behind the beam" may flicker or tear, and games
+// need SCANLINE-PERIOD tweaks. In beam mode zx.h copies each bitmap line
+// into a shadow screen exactly when the emulated beam completes it, and
+// the display shows the shadow screen: the same picture a real ULA would
+// have produced. The copy also marks dirty only what really changed.
+//
+// The menu and the other UI elements are drawn in the video RAM after
+// zx_exec_frame(), so while the menu is active the video RAM is shown.
+void set_beam_mode(int on) {
+    if (on && !EMU.zx.beam_screen) {
+        uint8_t *screen = malloc(6912);
+        if (!screen) {
+            printf("Beam mode: not enough memory\n");
+            EMU.beam = 0;
+            return;
+        }
+        zx_set_beam_screen(&EMU.zx,screen);
+    } else if (!on && EMU.zx.beam_screen) {
+        uint8_t *screen = EMU.zx.beam_screen;
+        zx_set_beam_screen(&EMU.zx,NULL);
+        free(screen);
+    }
+    EMU.beam = on;
+    vram_force_dirty();
 }
 
-// Transfer the Spectrum CRT representation into the ST77xx display.
-// We allocate just a scanline of buffer and transfer it one at a time.
-//
-// Note that the zx.h file included here was modified in order to use
-// 4bpp framebuffer to save memory, so each byte in the CRT memory is
-// actually two pixels.
-//
-// SCALING:
-// This function supports scaling: it means that it is able to transfer
-// an overscaled Spectrum image to the ST77xx dispaly. This is useful in order
-// to accomodate different display sizes.
-//
-// Valid scaling arguments:
+// True if fast forwarding, see the "Fast forward" section. Not while the
+// menu is shown, even if enabled from it.
+static inline int ffwd_active(void) {
+    return EMU.ffwd && !EMU.menu_active;
+}
+
+// Return the screen memory the display should show. Fast forward
+// shows the video RAM too, where its overlay is drawn, and so does
+// rewind, that restores the RAM without running the beam.
+const uint8_t *display_vmem(void) {
+    if (EMU.zx.beam_screen && !EMU.menu_active && !ffwd_active() &&
+        !EMU.rewinding)
+        return EMU.zx.beam_screen;
+    return zx_display_ram(&EMU.zx);
+}
+
+// ZX Spectrum palette to display pixel format (RGB565 or RGB444, see
+// st77xx_rgb()) conversion. We do it at startup to avoid burning CPU
+// cycles later.
+uint16_t palette_to_display(uint32_t color) {
+    return st77xx_rgb(color & 0xff, (color>>8) & 0xff, (color>>16) & 0xff);
+}
+
+// Average of each two colors of the palette, in the display pixel
+// format, for the smooth downscaling (see render_setup()).
+static uint16_t BlendTable[16][16];
+
+// Convert the palette and BlendTable in the display pixel format. Called
+// at startup and every time the pixel format changes.
+void palette_init(void) {
+    for (int a = 0; a < 16; a++) {
+        zxpalette[a] = palette_to_display(zxpalette_rgb[a]);
+        for (int b = 0; b < 16; b++) {
+            uint32_t avg = 0;
+            for (int shift = 0; shift < 24; shift += 8) {
+                uint32_t ca = (zxpalette_rgb[a] >> shift) & 0xff;
+                uint32_t cb = (zxpalette_rgb[b] >> shift) & 0xff;
+                avg |= ((ca+cb+1)/2) << shift;
+            }
+            BlendTable[a][b] = palette_to_display(avg);
+        }
+    }
+}
+
+// Everything update_display() needs to draw a frame. Core0 fills it at
+// the end of the frame, core1 draws it, see the "Render pipeline" section.
+struct render_frame {
+    uint8_t screen[6912];   // Bitmap and attributes, as in the video RAM.
+    uint8_t dirty[24];      // Rows changed since the last frame drawn.
+    uint8_t border[ZX_BORDER_LOG_LINES]; // Border color of each line,
+                                         // see zx_set_border_log().
+    uint8_t update_border;  // Border refresh forced.
+    uint8_t blink;          // Draw the blinking attributes inverted.
+    uint8_t show_border;    // EMU.show_border,
+    uint8_t partial_update; // EMU.partial_update and
+    uint8_t scaling;        // EMU.scaling and
+    uint8_t smooth;         // EMU.smooth at the end of the frame.
+};
+
+// Bitmap bytes to display pixels conversion. With scaling, the 8 pixels
+// of a bitmap byte become more or less display pixels: render_setup()
+// maps each display column to a Spectrum column, and computes for each
+// byte of the row the pixels it becomes, as a mask with one bit per
+// display pixel, set for the ink color, for each possible value of the
+// byte. To keep the tables small the mask is the OR of the masks of the
+// two nibbles of the byte.
 //
-// 50: 50% downscaling
-// 75: 75% downscaling
-// 83: 83% downscaling
-// 100 (or any other invalid value): no rescaling
-// 112: 112% upscaling
-// 125: 125% upscaling
-// 150: 150% upscaling
-// 200: 200% upscaling
+// When all the bytes become the same pixels, as it happens when each
+// byte becomes a whole number of pixels (100%, 125%, 50%, ...), a single
+// table gives the mask of each byte value, and the row converters
+// specialized for that number of pixels are used (see below).
 //
-// BORDERS:
-// If border is false, borders are not drawn at all.
-// Useful for small displays or when scaling is used.
-void update_display(uint32_t scaling, uint32_t border, uint32_t blink) {
-    uint16_t line[st77_width+8]={0}; // 8 pixels more allow us to overflow
-                                     // when doing scaling, instead of checking
-                                     // (which is costly). Hence width+8.
-
-    // Get a pointer to the Spectrum video memory bank.
-    const uint8_t *vmem = EMU.zx.ram[EMU.zx.display_ram_bank];
-
-    // Configure scaling: we duplicate/skip a column/row every N cols/rows.
-    uint32_t dup_mask = 0xffff; // no dup/skip.
-    uint32_t dup = 1; // Duplicate or skip? Scaling > 100 dup, < 100 skip.
-    switch (scaling) {
-        // Downscaling
-        case 50: dup_mask = 1; dup = 0; break;
-        case 75: dup_mask = 3; dup = 0; break;
-        case 84: dup_mask = 7; dup = 0; break;
- 
-        // Upscaling.
-        case 112: dup_mask = 7; break;
-        case 125: dup_mask = 3; break;
-        case 150: dup_mask = 1; break;
-        case 200: dup_mask = 0; break;
-
-       // 100 or any other value: no scaling.
-        case 100:
-        default: scaling = 0; break;
-    }
-
-    // Center Spectrum framebuffer into Pico display and
-    // set offset to remove borders if needed.
-    uint32_t zx_height = ZX_DISPLAY_HEIGHT-64;
-    uint32_t zx_width = ZX_DISPLAY_WIDTH-64;
-    uint32_t v_border, h_border; // Vertical/horizontal borders in pixels.
-
-    // Adjust virtual Spectrum framebuffer size by scaling.
-    if (scaling) {
-        if (dup) {
-            // scaling > 100%
-            zx_height = (zx_height*(dup_mask+2)) / (dup_mask+1);
-            zx_width = (zx_width*(dup_mask+2)) / (dup_mask+1);
+// With smooth downscaling, each display pixel has two bits in the mask,
+// set if any of the Spectrum pixels it covers is ink (bit 1) or paper
+// (bit 0): 1 for paper, 2 for ink, and 3 for a mix of the two, drawn with
+// the average of the two colors from BlendTable. So a pixel shows a thin
+// line even when it covers 3 or 4 Spectrum pixels, and the masks of the
+// two nibbles, that may share a pixel, just need to be ORed.
+#define RENDER_MAX_PIXELS 16 // Max pixels per byte: up to 200% scaling.
+
+// Write the 'n' pixels of 'bits', of 'depth' bits each, at 'l', two at
+// a time with 32 bit stores. The first pixel is the most significant.
+// pair[] has the combinations of two pixels of the cell colors, the
+// first pixel in the low half, indexed by their bits: with depth 1
+// pair[0] is paper and paper, pair[3] ink and ink. If 'aligned' is true
+// the caller knows that 'l' is word aligned. Returns the pointer to the
+// next pixel.
+static inline __attribute__((always_inline))
+uint16_t *byte_to_pixels(uint16_t *l, uint32_t bits, uint32_t n,
+                         const uint32_t *pair, const int aligned,
+                         const int depth)
+{
+    const uint32_t mask = (1<<depth)-1;
+    const uint32_t same = (1<<depth)+1; // Index of two equal pixels.
+    if (!aligned && ((uintptr_t)l & 2)) { // One pixel first.
+        n--;
+        *l++ = pair[((bits>>(n*depth))&mask)*same];
+    }
+    uint32_t *l32 = (uint32_t*)l;
+    while (n >= 2) {
+        n -= 2;
+        *l32++ = pair[(bits>>(n*depth))&(mask*same)];
+    }
+    l = (uint16_t*)l32;
+    if (n) *l++ = pair[(bits&mask)*same];
+    return l;
+}
+
+// Bitmap rows converted by update_display(), and the time spent converting
+// them, for the "[timing]" lines. Only incremented.
+struct {
+    volatile uint32_t rows;
+    volatile uint32_t us;
+} RowTiming;
+
+// Display geometry for the current scaling and border settings, computed
+// by render_setup() only when they change, together with the row converter
+// to use (see the "Row converters" below).
+typedef void (*row_converter)(uint16_t *line, const uint8_t *vmem,
+                              uint32_t yy, uint32_t border_color,
+                              uint32_t blink);
+#define ROW_BORDER 0xff // Display row of the border, see row_src.
+#define BORDER_NONE 0xff // Border color when not shown: black.
+struct {
+    uint32_t valid;             // False if never computed.
+    uint32_t scaling;           // Settings the geometry is computed for.
+    uint32_t show_border;
+    uint32_t smooth;
+    uint32_t left;              // Border pixels on the left.
+    uint32_t first_byte;        // First bitmap byte of the row shown,
+    uint32_t row_bytes;         // bytes converted for each row,
+    uint32_t row_fill;          // then fill the rest with the border?
+    uint32_t right;             // First border column on the right.
+    row_converter convert;      // Function converting a row.
+    uint8_t row_src[st77_height]; // Spectrum row (or ROW_BORDER) shown
+                                  // in each display row,
+    uint8_t row_line[st77_height]; // and the border log line of its border.
+    uint8_t pixels[32];         // Pixels each byte of the row becomes,
+    uint16_t nibble_bits[32][2][16]; // and their masks for each value of
+                                     // the high and low nibble.
+    uint16_t byte_bits[256];    // Masks of each byte value, if the same
+                                // for all the bytes.
+    uint32_t smooth_pairs[8][8][16]; // Smooth downscaling pairs of each
+                                     // ink and paper, see render_setup().
+} Geometry;
+
+// Convert the bitmap row 'yy' of 'vmem' into the display line 'line'.
+// Always inlined in the row converters, each with constant 'pixels' per
+// byte (0 if they change byte by byte), 'border', 'aligned' and 'depth'
+// arguments: the compiler removes the branches on them, and fully
+// unrolls byte_to_pixels().
+static inline __attribute__((always_inline))
+void convert_row(uint16_t *line, const uint8_t *vmem, uint32_t yy,
+                 uint32_t border_color, uint32_t blink,
+                 const uint32_t pixels, const int border, const int aligned,
+                 const int depth)
+{
+    const uint8_t *row =
+        vmem + (((yy & 0xC0)<<5) | ((yy & 0x07)<<8) | ((yy & 0x38)<<2));
+    const uint8_t *attrs = vmem + 0x1800 + ((yy>>3)<<5);
+    uint32_t pair[4];           // Colors of the current cell, see
+    const uint32_t *pairs = pair; // byte_to_pixels(), or the smooth ones,
+    uint32_t last_attr = 0x100; // and its attribute.
+    uint16_t *l = line;
+
+    if (border) {
+        for (uint32_t x = 0; x < Geometry.left; x++)
+            *l++ = border_color;
+    }
+
+    uint32_t byte = Geometry.first_byte;
+    uint32_t end = byte + Geometry.row_bytes;
+    for (uint32_t j = 0; byte < end; byte++, j++) {
+        uint32_t attr = attrs[byte];
+        if (attr != last_attr) {
+            uint32_t fg, bg, aux;
+
+            bg = (attr>>3)&7;
+            fg = attr&7;
+            if ((attr&0x80) && blink) {
+                aux = fg;
+                fg = bg;
+                bg = aux;
+            }
+            if (depth == 1) {
+                bg = zxpalette[bg];
+                fg = zxpalette[fg];
+                pair[0] = bg | (bg<<16);
+                pair[1] = bg | (fg<<16);
+                pair[2] = fg | (bg<<16);
+                pair[3] = fg | (fg<<16);
+            } else {
+                pairs = Geometry.smooth_pairs[fg][bg];
+            }
+            last_attr = attr;
+        }
+        uint32_t v = row[byte];
+        if (pixels) {
+            l = byte_to_pixels(l,Geometry.byte_bits[v],pixels,pairs,aligned,
+                               depth);
         } else {
-            // scaling < 100%
-            zx_height = (zx_height*(dup_mask+1)) / (dup_mask+2);
-            zx_width = (zx_width*(dup_mask+1)) / (dup_mask+2);
+            uint32_t bits = Geometry.nibble_bits[j][0][v>>4] |
+                            Geometry.nibble_bits[j][1][v&15];
+            l = byte_to_pixels(l,bits,Geometry.pixels[j],pairs,0,depth);
         }
     }
 
-    // Centering and borders area computation.
-    uint32_t xx_start = 0; // Offsets into Spectrum video, for centering.
-    uint32_t yy_start = 0;
+    // If the image ends before the display line, fill the rest with the
+    // border color.
+    if (Geometry.row_fill) {
+        while(l < line+st77_width) *l++ = border_color;
+    }
+}
 
-    // To center, we start checking if our display screen size is smaller
-    // than the scaled Spectrum display. Then, after we get the starting
-    // x,y offset pixel in the Spectrum VMEM, to correctly center the image
-    // we need to resize x/y offset proportionally to the scaling we are using.
-    if (st77_width < zx_width) {
-        xx_start += (zx_width-st77_width)>>2;
+/* Row converters: one for each scaling in SettingsZoomValues where each
+ * byte becomes the same number of pixels, with and without border on
+ * the left, and for the downscaling ones with smooth downscaling too,
+ * plus generic ones for the rest of the cases. With an odd number of
+ * pixels per byte the alignment alternates, so it is still checked for
+ * every byte. */
+#define ROW_CONVERTERS(pixels,depth) \
+static void convert_row_##pixels##_##depth(uint16_t *line, \
+    const uint8_t *vmem, uint32_t yy, uint32_t border_color, uint32_t blink) \
+{ \
+    convert_row(line,vmem,yy,border_color,blink,pixels,0,!((pixels)&1), \
+                depth); \
+} \
+static void convert_row_##pixels##_##depth##_border(uint16_t *line, \
+    const uint8_t *vmem, uint32_t yy, uint32_t border_color, uint32_t blink) \
+{ \
+    convert_row(line,vmem,yy,border_color,blink,pixels,1,!((pixels)&1), \
+                depth); \
+}
 
-        // Scale offset to video memory actual size.
-        xx_start = dup ? (xx_start*(dup_mask+1)) / (dup_mask+2) :
-                         (xx_start*(dup_mask+2)) / (dup_mask+1);
-        h_border = 0;
-    } else {
-        h_border = (st77_width-zx_width)>>1;
-    }
+ROW_CONVERTERS(4,1)   // 50%
+ROW_CONVERTERS(4,2)
+ROW_CONVERTERS(6,1)   // 75%
+ROW_CONVERTERS(6,2)
+ROW_CONVERTERS(7,1)   // 87%
+ROW_CONVERTERS(7,2)
+ROW_CONVERTERS(8,1)   // 100%
+ROW_CONVERTERS(9,1)   // 112%
+ROW_CONVERTERS(10,1)  // 125%
+ROW_CONVERTERS(12,1)  // 150%
+ROW_CONVERTERS(16,1)  // 200%
+
+static void convert_row_generic(uint16_t *line, const uint8_t *vmem,
+    uint32_t yy, uint32_t border_color, uint32_t blink)
+{
+    convert_row(line,vmem,yy,border_color,blink,0,1,0,1);
+}
 
-    if (st77_height < zx_height) {
-        yy_start += (zx_height-st77_height)>>1;
+static void convert_row_generic_smooth(uint16_t *line, const uint8_t *vmem,
+    uint32_t yy, uint32_t border_color, uint32_t blink)
+{
+    convert_row(line,vmem,yy,border_color,blink,0,1,0,2);
+}
+
+#define ROW_CONVERTERS_ENTRY(pixels,depth) \
+    {pixels, depth, {convert_row_##pixels##_##depth, \
+                     convert_row_##pixels##_##depth##_border}}
+static const struct {
+    uint32_t pixels;          // Pixels per byte.
+    uint32_t depth;           // Bits per pixel in the masks.
+    row_converter convert[2]; // Without and with border on the left.
+} RowConverters[] = {
+    ROW_CONVERTERS_ENTRY(4,1),
+    ROW_CONVERTERS_ENTRY(4,2),
+    ROW_CONVERTERS_ENTRY(6,1),
+    ROW_CONVERTERS_ENTRY(6,2),
+    ROW_CONVERTERS_ENTRY(7,1),
+    ROW_CONVERTERS_ENTRY(7,2),
+    ROW_CONVERTERS_ENTRY(8,1),
+    ROW_CONVERTERS_ENTRY(9,1),
+    ROW_CONVERTERS_ENTRY(10,1),
+    ROW_CONVERTERS_ENTRY(12,1),
+    ROW_CONVERTERS_ENTRY(16,1),
+};
 
-        // Scale offset to video memory actual size.
-        yy_start = dup ? (yy_start*(dup_mask+1)) / (dup_mask+2) :
-                         (yy_start*(dup_mask+2)) / (dup_mask+1);
-        v_border = 0;
+// Map 'count' display pixels, starting at 'first', to the 'src' Spectrum
+// pixels scaled to 'size' pixels, with the image centered in the 'count'
+// pixels. Returns in 'offset' the pixels before the image, and the number
+// of pixels of the image to skip, if it is larger than 'count' and
+// needs to be cropped, in 'crop'.
+static void render_center(uint32_t size, uint32_t count, uint32_t *offset,
+                          uint32_t *crop)
+{
+    if (size <= count) {
+        *offset = (count-size)/2;
+        *crop = 0;
     } else {
-        v_border = (st77_height-zx_height)>>1;
+        *offset = 0;
+        *crop = (size-count)/2;
     }
+}
 
-    // If partial updates are disabled, force a full update.
-    if (EMU.partial_update == 0) vram_force_dirty();
-
-    // Transfer data to the display.
-    //
-    // Note that we use xx and yy counters other than x and y since
-    // we want to duplicate lines every N cols/rows when scaling is
-    // used, and when this happens we advance x and y by a pixel more,
-    // so we need counters relative to the Spectrum video, not the display.
-    uint32_t yy = yy_start;
-    const uint8_t *row;
-    int update_border = EMU.zx.border_color != EMU.last_update_border_color;
-    uint16_t border_color = zxpalette[EMU.zx.border_color];
-
-    // If the border color changed, we need to force a full screen update.
-    if (update_border && EMU.show_border) vram_force_dirty();
-
-    for (uint32_t y = 0; y < st77_height; y++) {
-        // Handle top / bottom border
-        if (EMU.show_border && (y < v_border || yy >= 192)) {
-            if (!update_border) continue;
-            for (int j = 0; j < st77_width; j++) line[j] = border_color;
-            st77xx_setwin(0, y, st77_width-1, y);
-            st77xx_data(line,sizeof(line)-16);
-            continue;
+// Compute the Geometry for the given settings, and select the row
+// converter. Does nothing if the settings did not change.
+//
+// SCALING:
+// The Spectrum bitmap is scaled by 'scaling' percent, or, if 'scaling'
+// is RENDER_SCALING_FIT, by the factor that makes it fit the display (the
+// bitmap and the border around it, if the border is shown). Percentages
+// within 1% of a multiple of 12.5% are rounded to it: that way each byte
+// becomes a whole number of pixels, the fast case. The scaling factor is
+// limited to 200%. The image is centered in the display, and cropped if
+// larger.
+//
+// BORDERS:
+// If show_border is true, the display area around the image is filled
+// with the border color. Otherwise it is left black.
+//
+// SMOOTH:
+// When downscaling, a display pixel covers more than one Spectrum pixel,
+// and normally shows the first one: thin details may vanish. If 'smooth'
+// is true, the pixels covering both ink and paper show the average color.
+#define RENDER_SCALING_FIT 0
+void render_setup(uint32_t scaling, uint32_t show_border, uint32_t smooth) {
+    if (Geometry.valid && Geometry.scaling == scaling &&
+        Geometry.show_border == show_border &&
+        Geometry.smooth == smooth) return;
+    Geometry.valid = 1;
+    Geometry.scaling = scaling;
+    Geometry.show_border = show_border;
+    Geometry.smooth = smooth;
+
+    // Scaled image size.
+    uint32_t zx_width = ZX_DISPLAY_WIDTH-64;
+    uint32_t zx_height = ZX_DISPLAY_HEIGHT-64;
+    uint32_t width, height;
+    if (scaling == RENDER_SCALING_FIT) {
+        uint32_t fit_width = show_border ? ZX_DISPLAY_WIDTH : zx_width;
+        uint32_t fit_height = show_border ? ZX_DISPLAY_HEIGHT : zx_height;
+        if (st77_width*fit_height <= st77_height*fit_width) {
+            width = zx_width*st77_width/fit_width;
+            height = zx_height*st77_width/fit_width;
         } else {
-            // If borders are disabled and we reached the end of Spectrum
-            // bitmap, we are done updating the display.
-            if (yy >= 192) break;
+            width = zx_width*st77_height/fit_height;
+            height = zx_height*st77_height/fit_height;
         }
+    } else {
+        uint32_t eighths = (scaling*8+50)/100;
+        if (abs((int)(eighths*1250)-(int)(scaling*100)) <= 100) {
+            width = zx_width*eighths/8;
+            height = zx_height*eighths/8;
+        } else {
+            width = (zx_width*scaling+50)/100;
+            height = (zx_height*scaling+50)/100;
+        }
+    }
+    if (width > zx_width*2) {
+        width = zx_width*2;
+        height = zx_height*2;
+    } else if (width < zx_width/4) {
+        width = zx_width/4;
+        height = zx_height/4;
+    }
 
-        // Seek the row in the Spectrum VMEM
-        row = vmem + (((yy & 0xC0)<<5) | ((yy & 0x07)<<8) | ((yy & 0x38)<<2));
-        uint32_t update_row = (EMU.dirty_vram[yy>>3] & (1<<(yy&7)));
-        uint32_t xx = xx_start;
-
-        // We increment x one whole byte at a time, and decode 8 pixels
-        // for each iteration.
-        uint16_t *l = line;
-        for (uint32_t x = 0; x < st77_width && l < line+st77_width; x++) {
-            if (EMU.show_border && x < h_border) {
-                *l++ = border_color;
-                continue;
-            }
+    // Rows: the image centered, the rest of the display is border.
+    // Display row y shows the Spectrum row (y-top+crop)*192/height. The
+    // border log lines (see zx_set_border_log()) are scaled the same way,
+    // the first bitmap row being line 32, and clamped to the log.
+    uint32_t top, crop;
+    render_center(height,st77_height,&top,&crop);
+    for (uint32_t y = 0; y < st77_height; y++) {
+        uint32_t rel = y-top+crop; // Row in the scaled image.
+        if (y < top || rel >= height)
+            Geometry.row_src[y] = ROW_BORDER;
+        else
+            Geometry.row_src[y] = rel*zx_height/height;
+
+        int32_t h = height, zh = zx_height;
+        int32_t srel = (int32_t)(y+crop)-(int32_t)top; // Negative above.
+        int32_t line = 32 + (srel >= 0 ? srel*zh/h : -((-srel*zh+h-1)/h));
+        if (line < 0) line = 0;
+        if (line >= ZX_BORDER_LOG_LINES) line = ZX_BORDER_LOG_LINES-1;
+        Geometry.row_line[y] = line;
+    }
 
-            uint32_t byte = xx>>3;
-            uint8_t attr = vmem[0x1800+(((yy>>3)<<5)|byte)];
-            uint16_t fg, bg, aux;
-
-            bg = zxpalette[(attr>>3)&7];
-            fg = zxpalette[(attr&7)];
-
-            if (attr&0x80) { // Blink attribute.
-                update_row = 1; // With blink we no longer know the state
-                                // of the row. Tracking would likely not worth
-                                // it.
-                if (blink) {
-                    aux = fg;
-                    fg = bg;
-                    bg = aux;
+    // Columns: the same, but starting at a bitmap byte. If the image is
+    // cropped, the first byte shown is the one of the column where the
+    // cropping would start. The border on the left must have an even
+    // width, to store two pixels at a time at aligned addresses.
+    uint32_t left;
+    render_center(width,st77_width,&left,&crop);
+    left &= ~1;
+    uint32_t first_byte = crop*zx_width/width/8;
+
+    // Then the pixels each byte becomes. Byte b starts at the scaled
+    // image column 'start', the first showing the Spectrum column b*8.
+    // We stop at the byte crossing the display end: the line buffers have
+    // room for the pixels past it. With smooth downscaling a pixel
+    // accounts for all the Spectrum pixels it covers in the byte.
+    uint32_t depth = (smooth && width < zx_width) ? 2 : 1;
+    uint32_t x = left; // Display column of the next byte.
+    uint32_t bytes = 0;
+    for (uint32_t b = first_byte; b < 32 && x < st77_width; b++, bytes++) {
+        uint32_t start = (b*8*width+zx_width-1)/zx_width;
+        uint32_t end = ((b+1)*8*width+zx_width-1)/zx_width;
+        uint32_t n = end-start;
+        Geometry.pixels[bytes] = n;
+        for (uint32_t v = 0; v < 16; v++) {
+            uint32_t nibble[2] = {0,0}; // High and low nibble masks.
+            for (uint32_t rel = start; rel < end; rel++) {
+                uint32_t first = rel*zx_width/width - b*8; // 0 = leftmost.
+                nibble[0] <<= depth;
+                nibble[1] <<= depth;
+                if (depth == 1) {
+                    nibble[first/4] |= (v >> (3-first%4)) & 1;
+                    continue;
                 }
+                uint32_t last = (rel+1)*zx_width/width - b*8 - 1;
+                if (last > 7) last = 7;
+                if (last < first) last = first;
+                for (uint32_t p = first; p <= last; p++)
+                    nibble[p/4] |= ((v >> (3-p%4)) & 1) ? 2 : 1;
             }
-            for (int bit = 7; bit >= 0; bit--) {
-                uint16_t pixel_color = (row[byte] & (1<<bit)) ? fg : bg;
-                if (((xx+1)&dup_mask) == 0) {
-                    if (dup) {
-                        l[0] = pixel_color;
-                        l[1] = pixel_color;
-                        l++;
-                    } else  {
-                        l--;
-                    }
-                } else {
-                    *l = pixel_color;
-                }
-                l++;
-                xx++;
-            }
+            Geometry.nibble_bits[bytes][0][v] = nibble[0];
+            Geometry.nibble_bits[bytes][1][v] = nibble[1];
+        }
+        x += n;
+    }
 
-            // Stop if we reach the end of Spectrum row.
-            // Fill the rest with the border color and go to the
-            // next scanline.
-            if (xx == 256) {
-                while(l < line+st77_width) *l++ = border_color;
-                break;
+    // With smooth downscaling, the byte_to_pixels() pairs of every ink
+    // and paper combination, so that the row converters just pick them
+    // at each attribute change.
+    if (depth == 2) {
+        for (uint32_t ink = 0; ink < 8; ink++) {
+            for (uint32_t paper = 0; paper < 8; paper++) {
+                uint32_t c[4]; // Unused, paper, ink, mix.
+                c[0] = c[1] = zxpalette[paper];
+                c[2] = zxpalette[ink];
+                c[3] = BlendTable[ink][paper];
+                uint32_t *pairs = Geometry.smooth_pairs[ink][paper];
+                for (uint32_t a = 0; a < 4; a++)
+                    for (uint32_t b = 0; b < 4; b++)
+                        pairs[(a<<2)|b] = c[a] | (c[b]<<16);
             }
         }
+    }
+    Geometry.left = left;
+    Geometry.first_byte = first_byte;
+    Geometry.row_bytes = bytes;
+    Geometry.row_fill = x < st77_width;
+    Geometry.right = x < st77_width ? x : st77_width;
+
+    // Use a specialized row converter if all the bytes become the same
+    // pixels, and there is one for that number of pixels.
+    Geometry.convert = depth == 2 ? convert_row_generic_smooth :
+                                    convert_row_generic;
+    uint32_t uniform = 1;
+    for (uint32_t j = 1; j < bytes; j++) {
+        if (Geometry.pixels[j] != Geometry.pixels[0] ||
+            memcmp(Geometry.nibble_bits[j],Geometry.nibble_bits[0],
+                   sizeof(Geometry.nibble_bits[0])))
+        {
+            uniform = 0;
+            break;
+        }
+    }
+    uint32_t converters = sizeof(RowConverters)/sizeof(RowConverters[0]);
+    for (uint32_t j = 0; uniform && j < converters; j++) {
+        if (RowConverters[j].pixels != Geometry.pixels[0] ||
+            RowConverters[j].depth != depth) continue;
+        for (uint32_t v = 0; v < 256; v++) {
+            Geometry.byte_bits[v] = Geometry.nibble_bits[0][0][v>>4] |
+                                    Geometry.nibble_bits[0][1][v&15];
+        }
+        Geometry.convert = RowConverters[j].convert[left != 0];
+    }
+}
 
-        // Now that the scanline was computed, update the display
-        // corresponding scanline by writing it on the bus.
-        if (((yy+1)&dup_mask) == 0) {
-            // Duplicate/skip row according to scaling mask.
-            if (dup) {
-                // Duplicate row.
-                if (update_row) {
-                    st77xx_setwin(0, y, st77_width-1, y);
-                    st77xx_data(line,sizeof(line)-16);
-                }
-                y++;
-                if (update_row) {
-                    st77xx_setwin(0, y, st77_width-1, y);
-                    st77xx_data(line,sizeof(line)-16);
-                }
-            } else {
-                // Skip row.
-                y--;
-            }
+// Tearing effect synchronization, if the TE pin of the display is
+// connected (see st77xx.h): update_display() waits for the time to start
+// sending its plan so that the refresh of the panel never crosses the
+// rows being written, see rowplan_chase(). It is core1 that waits, so the
+// emulation goes on meanwhile: at worst more frames are merged. The time
+// to send a byte is measured on the last frames, conversion included.
+struct {
+    uint32_t byte_ns;           // Time to send a byte, 0 if unknown.
+
+    // Statistics for the "[timing]" lines, only incremented.
+    volatile uint32_t frames;   // Frames synchronized,
+    volatile uint32_t late;     // the ones too slow to be tear free,
+    volatile uint32_t wait_us;  // and time spent waiting.
+} TESync;
+
+void te_wait(const rowplan_run_t *runs, int n, const rowplan_cost_t *cost) {
+    uint32_t period = st77_te_period;
+    if (st77_te == -1 || n == 0 || period == 0 || TESync.byte_ns == 0)
+        return;
+    uint32_t since = time_us_32() - st77_te_time; // Refresh started.
+    if (since > period*2) return; // No pulses lately.
+
+    // If the panel refreshes along the columns, every row spans the whole
+    // refresh: the best we can do is starting with it, so that at least
+    // the tearing does not move.
+    rowplan_slot_t slot = {0,0};
+    if (st77_te_scan != 0) {
+        rowplan_scan_t scan = {period, st77_te_lines,
+            st77_te_scan > 0 ? st77_offset_y : st77_te_lines-1-st77_offset_y,
+            st77_te_scan > 0 ? 1 : -1};
+        if (rowplan_chase(runs,n,cost,&scan,TESync.byte_ns,&slot)) {
+            int32_t margin = (slot.max-slot.min)/8; // The times are rough.
+            slot.min += margin;
+            slot.max -= margin;
         } else {
-            // If scaling does not affect this line, just
-            // write it to the display.
-            if (update_row) {
-                st77xx_setwin(0, y, st77_width-1, y);
-                st77xx_data(line,sizeof(line)-16);
-            }
+            TESync.late++;
         }
+    }
+
+    // Start now if we are in the slot of some period, or wait for the
+    // next one.
+    int32_t x = ((int32_t)since - slot.min) % (int32_t)period;
+    if (x < 0) x += period;
+    uint32_t wait = x <= slot.max-slot.min ? 0 : period-x;
+    if (wait) busy_wait_us_32(wait);
+    TESync.wait_us += wait;
+    TESync.frames++;
+}
+
+// Update the time to send a byte with the plan just sent in 'us'.
+void te_measure(const rowplan_run_t *runs, int n, const rowplan_cost_t *cost,
+                uint32_t us)
+{
+    uint32_t bytes = rowplan_cost(runs,n,cost);
+    if (st77_te == -1 || bytes == 0) return;
+    uint32_t ns = us*1000/bytes;
+    TESync.byte_ns = TESync.byte_ns ? (TESync.byte_ns*3+ns)/4 : ns;
+}
 
-        yy++; // Next row.
+// Transfer the Spectrum screen of the frame 'f' into the ST77xx display,
+// one scanline at a time. The scanlines to send (the ones changed, if
+// partial updates are enabled) are grouped in windows by the planner
+// in rowplan.h, each scanline is converted and then sent with
+// st77xx_line_stream() that, on the buses with DMA, transfers a scanline
+// while the next one is converted into the other line buffer. See
+// render_setup() for the scaling and the border, and te_wait() for the
+// synchronization with the display refresh.
+void update_display(const struct render_frame *f) {
+    // The line buffers have 16 pixels more, that allow us to overflow when
+    // doing scaling, instead of checking (which is costly). Every row is
+    // fully written before being transferred, so no need to clear it.
+    uint16_t *line = NULL;
+
+    const uint8_t *vmem = f->screen;
+    uint32_t show_border = f->show_border;
+    render_setup(f->scaling,show_border,f->smooth);
+    const row_converter convert = Geometry.convert;
+
+    // If partial updates are disabled, force a full update. Without
+    // border the area around the image is black, so it only needs to be
+    // drawn in full updates.
+    int full_update = f->partial_update == 0;
+    int update_border = full_update || (show_border && f->update_border);
+
+    // Border color of each row, and the rows where it changed since the
+    // last frame drawn: when the border changes, only the border is sent,
+    // the bitmap rows keep their dirty tracking. BORDER_NONE is the color
+    // of the black border, when it is not shown, so that showing it again
+    // draws it all.
+    static uint8_t shown_border[st77_height]; // Border color on display.
+    static uint8_t border[st77_height];
+    static uint8_t border_changed[st77_height];
+    for (uint32_t y = 0; y < st77_height; y++) {
+        border[y] = show_border ? f->border[Geometry.row_line[y]] :
+                                  BORDER_NONE;
+        border_changed[y] = update_border || border[y] != shown_border[y];
+        shown_border[y] = border[y];
     }
 
-    vram_reset_dirty();
-    EMU.last_update_border_color = EMU.zx.border_color;
+    // With blink we no longer know the state of the rows with blinking
+    // attributes, so we always update them. Tracking would likely not
+    // worth it.
+    uint8_t blinking[24];
+    for (int j = 0; j < 24; j++) {
+        const uint8_t *attr = vmem+0x1800+(j<<5);
+        uint8_t b = 0;
+        for (int k = 0; k < 32; k++) b |= attr[k];
+        blinking[j] = b & 0x80;
+    }
+
+    // Mark the display rows to send, and plan the windows.
+    static uint8_t send[st77_height];
+    static rowplan_run_t runs[ROWPLAN_MAX_RUNS(st77_height)];
+    rowplan_cost_t cost = {st77_window_cost, st77xx_bytes(st77_width)};
+    for (uint32_t y = 0; y < st77_height; y++) {
+        uint32_t yy = Geometry.row_src[y];
+        if (yy == ROW_BORDER) {
+            send[y] = border_changed[y];
+        } else {
+            send[y] = full_update || (f->dirty[yy>>3] & (1<<(yy&7))) ||
+                      blinking[yy>>3];
+        }
+    }
+    int n = rowplan(send,st77_height,&cost,runs);
+
+    // Transfer data to the display. Consecutive rows showing the same
+    // Spectrum row (or the border) with the same border color are
+    // converted just once.
+    te_wait(runs,n,&cost);
+    uint32_t send_start = time_us_32();
+    uint32_t last_src = 0x10000; // Source of 'line', none.
+    for (int j = 0; j < n; j++) {
+        st77xx_line_window(runs[j].first,runs[j].last);
+        for (uint32_t y = runs[j].first; y <= runs[j].last; y++) {
+            uint32_t yy = Geometry.row_src[y];
+            if ((yy | border[y]<<8) != last_src) {
+                uint16_t border_color =
+                    show_border ? zxpalette[border[y]] : 0;
+                line = st77xx_line_get();
+                if (yy == ROW_BORDER) {
+                    for (int k = 0; k < st77_width; k++)
+                        line[k] = border_color;
+                    st77xx_line_pack(line);
+                } else {
+                    uint32_t start = time_us_32();
+                    convert(line,vmem,yy,border_color,f->blink);
+                    st77xx_line_pack(line);
+                    RowTiming.us += time_us_32()-start;
+                    RowTiming.rows++;
+                }
+                last_src = yy | border[y]<<8;
+            }
+            st77xx_line_stream(line);
+        }
+    }
+    st77xx_wait();
+    te_measure(runs,n,&cost,time_us_32()-send_start);
+
+    // The border on the left and on the right of the bitmap rows not
+    // sent, if it changed: one box for each side of the consecutive rows
+    // with the same color.
+    for (uint32_t y = 0; y < st77_height; y++) {
+        if (send[y] || !border_changed[y] ||
+            Geometry.row_src[y] == ROW_BORDER) continue;
+        uint32_t first = y;
+        while (y+1 < st77_height && !send[y+1] && border_changed[y+1] &&
+               Geometry.row_src[y+1] != ROW_BORDER &&
+               border[y+1] == border[first]) y++;
+        uint16_t border_color = show_border ? zxpalette[border[first]] : 0;
+        uint32_t rows = y-first+1;
+        if (Geometry.left)
+            st77xx_fill_box(0,first,Geometry.left,rows,border_color);
+        if (Geometry.right < st77_width)
+            st77xx_fill_box(Geometry.right,first,st77_width-Geometry.right,
+                            rows,border_color);
+    }
 }
 
 // This function maps GPIO state to the Spectrum keyboard registers.
@@ -810,7 +1459,11 @@ void handle_zx_key_press(zx_t *zx, const uint8_t *keymap, uint32_t ticks, int fl
     {
         #define LEFT_RIGHT_LONG_PRESS_FRAMES 30
         static int left_right_frames = 0;
-        if (get_device_button(KEY_LEFT) && get_device_button(KEY_RIGHT)) {
+        if (get_device_button(KEY_LEFT) && get_device_button(KEY_RIGHT) &&
+            !get_device_button(KEY_UP) && !get_device_button(KEY_DOWN) &&
+            !get_device_button(KEY_FIRE))
+        {
+            // Up/down/fire are excluded: they are the hotkey chords.
             left_right_frames++;
             if (left_right_frames == LEFT_RIGHT_LONG_PRESS_FRAMES)
                 EMU.menu_active = 1;
@@ -826,24 +1479,16 @@ void flush_zx_key_press(zx_t *zx) {
     for (int j = 0; j < KBD_MAX_KEYS; j++) zx_key_up(zx,j);
 }
 
-// Set the audio volume by altering the PWM counter wrap value.
-// The zx.h file will always set the channel level to 1 or 0
-// (Z80 audio pin high or low), so the greater the counter value
-// the smaller the volume.
-void set_volume(uint32_t volume) {
-    unsigned int slice_num = pwm_gpio_to_slice_num(SPEAKER_PIN);
-    // Volume is in the range 0-20, however the greater the volume
-    // the smaller our wrap value should be in order to increase the
-    // total duty time.
-    pwm_set_wrap(slice_num, 20-volume);
-    pwm_set_enabled(slice_num, volume != 0);
-}
-
 // Called at startup to seek the games snapshots (Z80 files) and populate
 // the games table. Return true if games were found, otherwise zero
 // is returned, and the caller knows that the user failed to load games.
+//
+// The blob starts with a 16 bytes marker. Its last char is the blob
+// version: with '!' (old loadgames.py) every entry is a .z80 file and
+// the header is <namelen> <name> <size>, with '2' the name is followed
+// by a byte with the snapshot format (GAME_FORMAT_*).
 int populate_games_list(void) {
-    char marker[] = "..2040GAMESBLOB!";
+    char marker[] = "..2040GAMESBLOB";
     // Fix the marker. This way the marker string is not
     // part of the program itself, and when we scan the flash
     // looking for games we are sure we find the games and not
@@ -855,9 +1500,11 @@ int populate_games_list(void) {
     // the start of any page.
     printf("Start scanning...\n");
     uint8_t *p = NULL;
+    int has_format = 0;
     for (uint32_t offset = 0; offset < 1024*2048; offset += 4096) {
         p = (uint8_t*)(0x10000000|offset);
-        if (!memcmp(marker,p,16)) {
+        if (!memcmp(marker,p,15) && (p[15] == '!' || p[15] == '2')) {
+            has_format = p[15] == '2';
             p += 16; // Skip marker.
             printf("Games snapshots found at %p\n", p);
             break;
@@ -874,7 +1521,7 @@ int populate_games_list(void) {
     GamesTableSize = 0;
     while (*p != 0) {
         uint8_t namelen = *p;
-        p += 1+namelen;
+        p += 1+namelen+has_format;
         uint32_t datalen;
         memcpy(&datalen,p,4);
         p += 4+datalen;
@@ -891,11 +1538,12 @@ int populate_games_list(void) {
         ge = &GamesTable[j];
         uint8_t namelen = *p;
         uint8_t copylen = namelen;
-        if (copylen > sizeof(ge->name)) copylen = sizeof(ge->name)-1;
+        if (copylen >= sizeof(ge->name)) copylen = sizeof(ge->name)-1;
         p++; // Seek name.
-        memcpy(ge->name,p,namelen);
-        ge->name[namelen] = 0; // Null term.
+        memcpy(ge->name,p,copylen);
+        ge->name[copylen] = 0; // Null term.
         p += namelen; // Skip name
+        ge->format = has_format ? *p++ : GAME_FORMAT_Z80;
         memcpy(&ge->size,p,4);
         p += 4;
         ge->addr = p;
@@ -904,6 +1552,130 @@ int populate_games_list(void) {
     return 1;
 }
 
+// Show how the RAM is used by the emulator state. The numbers are
+// only printed, but are useful when changing the emulator structures,
+// since what is not used here is what remains for the display and audio
+// code. The symbols are defined by the Pico SDK linker script.
+void print_memory_report(void) {
+    extern char __StackLimit, end;
+    printf("Memory report (bytes):\n");
+    printf("  zx_t total    %6u\n", (unsigned)sizeof(zx_t));
+    printf("    z80_t       %6u\n", (unsigned)sizeof(z80_t));
+    printf("    mem_t       %6u\n", (unsigned)sizeof(mem_t));
+    printf("    kbd_t       %6u\n", (unsigned)sizeof(kbd_t));
+    printf("    RAM banks   %6u\n", (unsigned)sizeof(EMU.zx.ram));
+    printf("    ROM         %6u%s\n", (unsigned)sizeof(EMU.zx.rom),
+#ifdef ZX_COMPACT_STATE
+        " (mapped in place)"
+#else
+        ""
+#endif
+    );
+    printf("  audiobuf      %6u\n", (unsigned)sizeof(zx_audiobuf));
+    printf("  emustate      %6u (keymap %u)\n",
+        (unsigned)(sizeof(EMU)-sizeof(EMU.zx)), (unsigned)sizeof(EMU.keymap));
+    printf("  static total  %6u\n",
+        (unsigned)((uintptr_t)&end - SRAM_BASE));
+    printf("  heap free     %6u\n",
+        (unsigned)(&__StackLimit - &end));
+}
+
+// Extra I/O ports for programs written for zx2040, registered after the
+// Spectrum ones by set_zx_model(). Unused ports cost nothing, since zx.h
+// dispatches the port accesses with a table.
+//
+// Debug port: OUT (0xEB),A prints the character A on the serial, to
+// debug homebrew programs. Port 0xEB is not decoded by the Spectrum
+// peripherals, so real hardware just ignores such writes.
+#define ZX_DEBUG_PORT 0xEB
+static uint64_t io_debug_port(zx_t *sys, uint64_t pins) {
+    putchar(Z80_GET_DATA(pins));
+    return pins;
+}
+
+// Turbo port: OUT (0xEF),N runs N emulated frames per display refresh
+// (0 and 1 mean normal speed), for instance to quickly get past a long
+// intro. IN returns the current value.
+#define ZX_TURBO_PORT 0xEF
+#define ZX_TURBO_MAX 8
+static uint64_t io_turbo_port(zx_t *sys, uint64_t pins) {
+    if (pins & Z80_WR) {
+        uint8_t n = Z80_GET_DATA(pins);
+        EMU.turbo = n > ZX_TURBO_MAX ? ZX_TURBO_MAX : n;
+    } else {
+        Z80_SET_DATA(pins, EMU.turbo);
+    }
+    return pins;
+}
+
+// Initialize the emulator for the specified Spectrum model, if it is not
+// already the current one. The 48K model has everything it needs inside
+// zx_t. The 128K model also needs 5 more RAM banks and its two ROMs,
+// copied from flash: this memory is only allocated while in 128K mode,
+// and to make room the rewind buffers are released. Must be called at
+// base clock. Returns 0 if there is not enough memory.
+int set_zx_model(zx_type_t type) {
+    static uint8_t *roms128, *ram_ext;
+    if (EMU.zx.valid && EMU.zx.type == type) return 1;
+    uint8_t *beam_screen = EMU.zx.beam_screen; // Survives zx_init().
+
+    if (type == ZX_TYPE_128) {
+        rewind_free();
+        roms128 = malloc(0x8000);
+        ram_ext = malloc(5*0x4000);
+        if (!roms128 || !ram_ext) {
+            free(roms128); free(ram_ext);
+            roms128 = ram_ext = NULL;
+            printf("Not enough memory for the 128K model\n");
+            rewind_init();
+            return 0;
+        }
+        memcpy(roms128,dump_amstrad_zx128k_0_bin,0x4000);
+        memcpy(roms128+0x4000,dump_amstrad_zx128k_1_bin,0x4000);
+    } else {
+        free(roms128); free(ram_ext);
+        roms128 = ram_ext = NULL;
+    }
+
+    zx_desc_t zx_desc = {0};
+    zx_desc.type = type;
+    zx_desc.joystick_type = ZX_JOYSTICKTYPE_KEMPSTON;
+    zx_desc.roms.zx48k.ptr = dump_amstrad_zx48k_bin;
+    zx_desc.roms.zx48k.size = sizeof(dump_amstrad_zx48k_bin);
+    zx_desc.roms.zx128_0.ptr = roms128;
+    zx_desc.roms.zx128_0.size = 0x4000;
+    zx_desc.roms.zx128_1.ptr = roms128 ? roms128+0x4000 : NULL;
+    zx_desc.roms.zx128_1.size = 0x4000;
+    zx_desc.ram_ext.ptr = ram_ext;
+    zx_desc.ram_ext.size = 5*0x4000;
+    zx_desc.audiobuf.ptr = zx_audiobuf;
+    zx_desc.audiobuf.size = sizeof(zx_audiobuf);
+    zx_desc.ay_queue = &zx_ay_queue;
+    zx_init(&EMU.zx, &zx_desc);
+    zx_io_register(&EMU.zx,0xff,ZX_DEBUG_PORT,false,true,io_debug_port);
+    zx_io_register(&EMU.zx,0xff,ZX_TURBO_PORT,true,true,io_turbo_port);
+    EMU.zx.scanline_period = ZX_DEFAULT_SCANLINE_PERIOD;
+    if (beam_screen) zx_set_beam_screen(&EMU.zx,beam_screen);
+    zx_set_border_log(&EMU.zx,BorderLog);
+    if (type == ZX_TYPE_48K) rewind_init();
+#ifdef ZX_MEM_PROFILE
+    memprof_init(); // zx_init() cleared the watched pages.
+#endif
+    printf("Spectrum model: %s\n", type == ZX_TYPE_128 ? "128K" : "48K");
+    return 1;
+}
+
+// Change the system clock. The display PIO clock dividers depend on it:
+// when going faster they are set first, so that the display is never
+// clocked beyond its limits, not even for a moment.
+static uint32_t current_clock_khz;
+void set_emulator_clock(uint32_t khz) {
+    if (khz > current_clock_khz) st77xx_set_clock(khz*1000);
+    set_sys_clock_khz(khz, false); sleep_us(50);
+    if (khz < current_clock_khz) st77xx_set_clock(khz*1000);
+    current_clock_khz = khz;
+}
+
 // Initialize the Pico and the Spectrum emulator.
 void init_emulator(void) {
     // Set default configuration.
@@ -917,10 +1689,11 @@ void init_emulator(void) {
     EMU.selected_game = 0;
     EMU.show_border = DEFAULT_DISPLAY_BORDERS;
     EMU.scaling = DEFAULT_DISPLAY_SCALING;
+    EMU.smooth = DEFAULT_DISPLAY_SMOOTH;
     EMU.volume = 20; // 0 to 20 valid values.
     EMU.brightness = ST77_MAX_BRIGHTNESS;
     EMU.partial_update = DEFAULT_DISPLAY_PARTIAL_UPDATE;
-    EMU.audio_sample_wait = 300; // Adjusted dynamically.
+    EMU.save_slot = 0;
     vram_force_dirty(); // Fully update the first frame.
     ui_reset_crop_area();
 
@@ -930,18 +1703,19 @@ void init_emulator(void) {
     // Display initialization. Show a pattern before overclocking.
     // If users are stuck with four colored squares we know what's up.
     st77xx_init();
+    EMU.rgb444 = st77_pixel_bits == 12; // As set by st77_rgb444.
     st77xx_set_brightness(ST77_MAX_BRIGHTNESS); // Start at max.
-    st77xx_fill_box(0,0,40,40,st77xx_rgb565(255,0,0));
-    st77xx_fill_box(st77_width-41,0,40,40,st77xx_rgb565(0,255,0));
-    st77xx_fill_box(0,st77_height-41,40,40,st77xx_rgb565(0,0,255));
-    st77xx_fill_box(st77_width-41,st77_height-41,40,40,st77xx_rgb565(50,50,50));
+    st77xx_fill_box(0,0,40,40,st77xx_rgb(255,0,0));
+    st77xx_fill_box(st77_width-41,0,40,40,st77xx_rgb(0,255,0));
+    st77xx_fill_box(0,st77_height-41,40,40,st77xx_rgb(0,0,255));
+    st77xx_fill_box(st77_width-41,st77_height-41,40,40,st77xx_rgb(50,50,50));
     st77xx_set_brightness(EMU.brightness); // Go to the default.
 
     // Overclocking. We start at base clock (low enough to access the
     // flash). After loading the games list from the flash, we go
     // at full speed.
     vreg_set_voltage(VREG_VOLTAGE_1_30);
-    set_sys_clock_khz(EMU.base_clock, false); sleep_us(50);
+    set_emulator_clock(EMU.base_clock);
 
     // Keys pin initialization.
     gpio_init(KEY_LEFT);
@@ -972,28 +1746,22 @@ void init_emulator(void) {
         (1<<KEY_LEFT) | (1<<KEY_RIGHT) | (1<<KEY_UP) | (1<<KEY_DOWN) |
         (1<<KEY_FIRE));
 
-    // Configure audio pin PWM.
+    // Configure audio pin PWM. The rate and the volume are set by
+    // core1, see the "Audio" section.
     if (SPEAKER_PIN != -1) {
         gpio_set_function(SPEAKER_PIN, GPIO_FUNC_PWM);
         unsigned int slice_num = pwm_gpio_to_slice_num(SPEAKER_PIN);
         unsigned int pwm_channel = pwm_gpio_to_channel(SPEAKER_PIN);
-        set_volume(EMU.volume);
         pwm_set_chan_level(slice_num, pwm_channel, 0);
         pwm_set_enabled(slice_num, true);
     }
 
-    // Convert palette to RGB565.
-    for (int j = 0; j < 16; j++)
-        zxpalette[j] = palette_to_565(zxpalette[j]);
+    // Convert palette to the display pixel format.
+    palette_init();
 
     // ZX emulator Init.
-    zx_desc_t zx_desc = {0};
-    zx_desc.type = ZX_TYPE_48K;
-    zx_desc.joystick_type = ZX_JOYSTICKTYPE_KEMPSTON;
-    zx_desc.roms.zx48k.ptr = dump_amstrad_zx48k_bin;
-    zx_desc.roms.zx48k.size = sizeof(dump_amstrad_zx48k_bin);
-    zx_init(&EMU.zx, &zx_desc);
-    EMU.zx.scanline_period = ZX_DEFAULT_SCANLINE_PERIOD;
+    set_zx_model(ZX_TYPE_48K);
+    print_memory_report();
 
     // Enter special mode depending on key presses during power up.
     if (get_device_button(KEY_LEFT)) EMU.debug = 1; // Debugging mode.
@@ -1218,14 +1986,31 @@ next_line:
     }
 }
 
+// Keymap used while a tape game is loading: type LOAD "" and Enter
+// once the ROM is ready. The ROM only sees a key pressed again after
+// it was released for a few frames, hence the delays.
+#define TAPE_TYPE_TICK 60 // Frames needed by the ROM to boot.
+static const uint8_t TapeLoadKeymap[] = {
+    PRESS_AT_TICK, TAPE_TYPE_TICK, 'j',         // J is LOAD in K mode.
+    RELEASE_AT_TICK, TAPE_TYPE_TICK+3, 'j',
+    PRESS_AT_TICK, TAPE_TYPE_TICK+6, '"',
+    RELEASE_AT_TICK, TAPE_TYPE_TICK+9, '"',
+    PRESS_AT_TICK, TAPE_TYPE_TICK+18, '"',
+    RELEASE_AT_TICK, TAPE_TYPE_TICK+21, '"',
+    PRESS_AT_TICK, TAPE_TYPE_TICK+24, 0x0D,     // Enter.
+    RELEASE_AT_TICK, TAPE_TYPE_TICK+27, 0x0D,
+    KEY_END, 0, 0
+};
+
 /* Load the specified game ID. The ID is just the index in the
  * games table. As a side effect, sets the keymap. */
 void load_game(int game_id) {
-    set_sys_clock_khz(EMU.base_clock, false); sleep_us(50);
+    set_emulator_clock(EMU.base_clock);
     struct game_entry *g = &GamesTable[game_id];
     chips_range_t r = {.ptr=g->addr, .size=g->size};
     flush_zx_key_press(&EMU.zx); // Make sure no keys are down.
     EMU.tick = 0;
+    EMU.turbo = 0;
 
     // We update the screen from the video memory. Moreover we have Z80
     // clock-related changes. Sometimes games don't have enough time from
@@ -1239,72 +2024,1231 @@ void load_game(int game_id) {
     if (EMU.loaded_game != game_id)
         EMU.zx.scanline_period = ZX_DEFAULT_SCANLINE_PERIOD;
 
-    // Load game and matching keymap (if any)
-    zx_quickload(&EMU.zx, r);
-    get_keymap_for_current_game(game_id);
+    // Load game and matching keymap (if any). Report the load time,
+    // to compare the different formats.
+    absolute_time_t start = get_absolute_time();
+    bool loaded = false;
+    zx_tape_eject(&EMU.zx);
+    switch(g->format) {
+    case GAME_FORMAT_Z80:
+        loaded = set_zx_model(zx_quickload_type(r)) &&
+                 zx_quickload(&EMU.zx, r);
+        break;
+    case GAME_FORMAT_SNA:
+        loaded = set_zx_model(ZX_TYPE_48K) && zx_quickload_sna(&EMU.zx, r);
+        break;
+    case GAME_FORMAT_TAPE:
+        // Boot the ROM with the tape inserted, and type LOAD "".
+        // The blocks are loaded by tape_service().
+        set_zx_model(ZX_TYPE_48K);
+        zx_reset(&EMU.zx);
+        loaded = zx_tape_insert(&EMU.zx, r);
+        break;
+    }
+    printf("Loading %s (format %c, %u bytes): %s in %llu us\n",
+        g->name, g->format, (unsigned)g->size, loaded ? "done" : "FAILED",
+        get_absolute_time()-start);
+    if (g->format == GAME_FORMAT_TAPE) {
+        memcpy(EMU.keymap,TapeLoadKeymap,sizeof(TapeLoadKeymap));
+    } else {
+        get_keymap_for_current_game(game_id);
+    }
 
     EMU.loaded_game = game_id;
-    set_sys_clock_khz(EMU.emu_clock, false); sleep_us(50);
+    rewind_reset();
+    set_emulator_clock(EMU.emu_clock);
     vram_force_dirty(); // Fully update the screen: we loaded a different
                         // video content.
 }
 
-// This thread takes audio data from the main thread emulator context
-// and reproduces it on the sound pin.
-void core1_play_audio(void) {
-    absolute_time_t start, end;
-    unsigned int slice_num = pwm_gpio_to_slice_num(SPEAKER_PIN);
-    unsigned int pwm_channel = pwm_gpio_to_channel(SPEAKER_PIN);
+// Called when the emulated CPU reached the ROM LD-BYTES routine with a
+// tape inserted: load the next block instantly. The tape is in flash,
+// so this must run at base clock. After the last block the game is
+// running, so now its keymap can be matched against the RAM, and the
+// keymap frame numbers count from here.
+void tape_service(void) {
+    set_emulator_clock(EMU.base_clock);
+    absolute_time_t start = get_absolute_time();
+    bool ok = zx_tape_trap(&EMU.zx);
+    printf("Tape block %s in %llu us\n", ok ? "loaded" : "FAILED",
+        get_absolute_time()-start);
+
+    if (!zx_tape_has_blocks(&EMU.zx)) {
+        // Make get_keymap_for_current_game() apply SCANLINE-PERIOD,
+        // like on a fresh game load.
+        int game_id = EMU.loaded_game;
+        EMU.loaded_game = -1;
+        flush_zx_key_press(&EMU.zx);
+        get_keymap_for_current_game(game_id);
+        EMU.loaded_game = game_id;
+        EMU.tick = 0;
+        EMU.menu_left_at_tick = 0;
+    }
+    set_emulator_clock(EMU.emu_clock);
+}
+
+/* ============================== Save states =============================== */
+
+// Save states are stored compressed in a flash region that must not
+// overlap the program and the games image (see loadgames.py): by default
+// the last 256k of the first 2MB of flash. The region is used as a log:
+// every save is appended after the previous one, so that all the sectors
+// are erased the same number of times. Each record starts at a sector
+// boundary with the following header, and loading a slot means to pick
+// the most recent valid record for such slot.
+#ifndef SAVESTATE_FLASH_SIZE
+#define SAVESTATE_FLASH_SIZE (256*1024)
+#endif
+#ifndef SAVESTATE_FLASH_OFFSET
+#define SAVESTATE_FLASH_OFFSET (2048*1024-SAVESTATE_FLASH_SIZE)
+#endif
+#define SAVESTATE_SECTORS (SAVESTATE_FLASH_SIZE/FLASH_SECTOR_SIZE)
+#define SAVESTATE_MAGIC 0x5353585A // "ZXSS"
+#define SAVESTATE_CHUNK 4096 // Input bytes compressed per lz_compress() call.
+
+struct savestate_header {
+    uint32_t magic;
+    uint32_t seq;           // Incremented at every save: newest wins.
+    uint32_t version;       // ZX_SNAPSHOT_VERSION of the saved state.
+    uint32_t slot;
+    char game[8];           // Game name, to restore its keymap.
+    uint32_t tick;          // EMU.tick at save time.
+    uint32_t state_len;     // Compressed length of the zx_t state.
+    uint32_t ram_len;       // Compressed length of the RAM banks.
+    uint32_t ext_len[2];    // 128K only: compressed length of the extra
+                            // banks 1, 3, 4 and 6, 7. Two streams, since
+                            // lz_compress() inputs must be under 64k.
+    uint32_t checksum;      // Of the data and the header above this field.
+};
 
-    // The length of the pause may need to be adjusted when
-    // compiling with different compilers. Would be better to
-    // write the pause loop later in assembly.
-    //
-    // Also this pause depends on the sampling rate we do
-    // in zx.h.
-    int oldlevel = 0;
+// Worst case size of a record, in sectors. Each chunk is compressed by
+// a different lz_compress() call, so the bound is per chunk.
+#define SAVESTATE_BOUND(len) \
+    ((len) + ((len)+SAVESTATE_CHUNK-1)/SAVESTATE_CHUNK * \
+             (LZ_MAX_COMPRESSED(SAVESTATE_CHUNK)-SAVESTATE_CHUNK))
+#define SAVESTATE_MAX_SECTORS \
+    ((sizeof(struct savestate_header) + \
+      SAVESTATE_BOUND(ZX_SNAPSHOT_STATE_SIZE) + \
+      SAVESTATE_BOUND(sizeof(EMU.zx.ram)) + \
+      SAVESTATE_BOUND(5*0x4000) + \
+      FLASH_SECTOR_SIZE-1) / FLASH_SECTOR_SIZE)
+
+struct {
+    int32_t slot_sector[SAVESTATE_SLOTS]; // Sector of the newest record
+                                          // of each slot, or -1.
+    uint32_t head;          // Sector where the next record will be written.
+    uint32_t seq;           // Sequence number of the next record.
+} SaveStates;
+
+// Records are read directly from the memory mapped flash. Only at
+// base_clock, like everything accessing the flash.
+static const uint8_t *savestate_sector_ptr(uint32_t sector) {
+    return (const uint8_t*)(XIP_BASE + SAVESTATE_FLASH_OFFSET +
+                            sector*FLASH_SECTOR_SIZE);
+}
+
+static uint32_t savestate_checksum(uint32_t h, const uint8_t *p, uint32_t len) {
+    while (len--) h = (h ^ *p++) * 16777619; // FNV-1a.
+    return h;
+}
+
+// Return the number of sectors used by a valid record starting at the
+// specified sector, or 0 if there is no valid record there.
+static uint32_t savestate_check_record(uint32_t sector) {
+    const struct savestate_header *hdr =
+        (const struct savestate_header*)savestate_sector_ptr(sector);
+    if (hdr->magic != SAVESTATE_MAGIC || hdr->slot >= SAVESTATE_SLOTS)
+        return 0;
+    uint32_t len = sizeof(*hdr) + hdr->state_len + hdr->ram_len +
+                   hdr->ext_len[0] + hdr->ext_len[1];
+    uint32_t sectors = (len+FLASH_SECTOR_SIZE-1)/FLASH_SECTOR_SIZE;
+    if (sectors > SAVESTATE_MAX_SECTORS || sector+sectors > SAVESTATE_SECTORS)
+        return 0;
+    uint32_t h = savestate_checksum(2166136261U,(uint8_t*)(hdr+1),
+                                    len-sizeof(*hdr));
+    h = savestate_checksum(h,(uint8_t*)hdr,
+                           offsetof(struct savestate_header,checksum));
+    return h == hdr->checksum ? sectors : 0;
+}
 
+// Erase the sectors where the next record will be written, if they are
+// not already blank. This way the next save only needs to program the
+// flash, that is much faster than erasing it. Called at startup and
+// when the menu is opened, where a small delay is not noticeable.
+void savestate_prepare(void) {
+    for (uint32_t j = 0; j < SAVESTATE_MAX_SECTORS; j++) {
+        uint32_t sector = SaveStates.head+j;
+        const uint32_t *p = (const uint32_t*)savestate_sector_ptr(sector);
+        uint32_t k;
+        for (k = 0; k < FLASH_SECTOR_SIZE/4; k++) if (p[k] != 0xffffffff) break;
+        if (k == FLASH_SECTOR_SIZE/4) continue; // Already blank.
+
+        uint32_t ints = save_and_disable_interrupts();
+        flash_range_erase(SAVESTATE_FLASH_OFFSET+sector*FLASH_SECTOR_SIZE,
+                          FLASH_SECTOR_SIZE);
+        restore_interrupts(ints);
+
+        // Now that the sector is erased, records in the slots table may be
+        // no longer valid.
+        for (int slot = 0; slot < SAVESTATE_SLOTS; slot++)
+            if (SaveStates.slot_sector[slot] >= 0 &&
+                !savestate_check_record(SaveStates.slot_sector[slot]))
+                SaveStates.slot_sector[slot] = -1;
+    }
+}
+
+// Scan the flash region to find the newest record of each slot, and
+// where to write the next record. Must be called at base_clock.
+void savestate_init(void) {
+    uint32_t max_seq = 0;
+    int found = 0;
+    SaveStates.head = 0;
+    for (int slot = 0; slot < SAVESTATE_SLOTS; slot++)
+        SaveStates.slot_sector[slot] = -1;
+
+    for (uint32_t sector = 0; sector < SAVESTATE_SECTORS; sector++) {
+        uint32_t sectors = savestate_check_record(sector);
+        if (!sectors) continue;
+        const struct savestate_header *hdr =
+            (const struct savestate_header*)savestate_sector_ptr(sector);
+        int32_t *ss = &SaveStates.slot_sector[hdr->slot];
+        if (*ss == -1 || ((struct savestate_header*)
+            savestate_sector_ptr(*ss))->seq < hdr->seq) *ss = sector;
+        if (!found || hdr->seq > max_seq) {
+            max_seq = hdr->seq;
+            SaveStates.head = sector+sectors;
+            found = 1;
+        }
+        sector += sectors-1;
+    }
+    SaveStates.seq = found ? max_seq+1 : 0;
+    if (SaveStates.head+SAVESTATE_MAX_SECTORS > SAVESTATE_SECTORS)
+        SaveStates.head = 0;
+    printf("Save states: next record at sector %u, seq %u\n",
+        (unsigned)SaveStates.head, (unsigned)SaveStates.seq);
+    savestate_prepare();
+}
+
+// Sector buffering of the record being written. The first sector is
+// programmed last, since its header contains the lengths and checksum
+// that are only known at the end.
+struct savestate_writer {
+    uint8_t *first;         // First sector of the record.
+    uint8_t *cur;           // Sector being filled.
+    uint32_t len;           // Bytes appended so far, header included.
+    uint32_t checksum;      // Of the data appended after the header.
+    uint64_t program_time;  // Time spent writing the flash.
+};
+
+static void savestate_program(uint32_t sector, const uint8_t *buf,
+                              struct savestate_writer *w)
+{
+    absolute_time_t start = get_absolute_time();
+    uint32_t offset = SAVESTATE_FLASH_OFFSET+sector*FLASH_SECTOR_SIZE;
+    const uint32_t *p = (const uint32_t*)savestate_sector_ptr(sector);
+    uint32_t ints = save_and_disable_interrupts();
+    // Normally savestate_prepare() already erased the sector, but two
+    // saves in a row, without opening the menu, may find it dirty.
+    for (uint32_t k = 0; k < FLASH_SECTOR_SIZE/4; k++) {
+        if (p[k] != 0xffffffff) {
+            flash_range_erase(offset,FLASH_SECTOR_SIZE);
+            break;
+        }
+    }
+    flash_range_program(offset,buf,FLASH_SECTOR_SIZE);
+    restore_interrupts(ints);
+    w->program_time += get_absolute_time()-start;
+}
+
+static void savestate_append(struct savestate_writer *w, const uint8_t *p,
+                             uint32_t len)
+{
+    w->checksum = savestate_checksum(w->checksum,p,len);
+    while (len) {
+        uint32_t sector = w->len / FLASH_SECTOR_SIZE;
+        uint32_t off = w->len % FLASH_SECTOR_SIZE;
+        uint32_t avail = FLASH_SECTOR_SIZE-off;
+        uint32_t n = len < avail ? len : avail;
+        memcpy((sector ? w->cur : w->first)+off,p,n);
+        w->len += n;
+        p += n;
+        len -= n;
+        if (sector && off+n == FLASH_SECTOR_SIZE)
+            savestate_program(SaveStates.head+sector,w->cur,w);
+    }
+}
+
+// Compress 'len' bytes at 'src' appending the output to the record.
+// Returns the compressed length, or 0 on error.
+static uint32_t savestate_compress(struct savestate_writer *w, lz_t *lz,
+                                   uint8_t *tmp, const uint8_t *src,
+                                   uint32_t len)
+{
+    uint32_t total = 0;
+    lz_init(lz);
+    for (uint32_t j = 0; j < len; j += SAVESTATE_CHUNK) {
+        uint32_t end = j+SAVESTATE_CHUNK < len ? j+SAVESTATE_CHUNK : len;
+        uint32_t clen = lz_compress(lz,src,j,end,tmp,
+                                    LZ_MAX_COMPRESSED(SAVESTATE_CHUNK));
+        if (clen == 0) return 0;
+        savestate_append(w,tmp,clen);
+        total += clen;
+    }
+    return total;
+}
+
+// Save the emulator state into the specified slot. Returns 1 on success.
+int savestate_save(uint32_t slot) {
+    set_emulator_clock(EMU.base_clock);
+    absolute_time_t start = get_absolute_time();
+
+    struct savestate_writer w = {0};
+    uint8_t *state = malloc(ZX_SNAPSHOT_STATE_SIZE);
+    uint8_t *tmp = malloc(LZ_MAX_COMPRESSED(SAVESTATE_CHUNK));
+    lz_t *lz = malloc(sizeof(*lz));
+    w.first = malloc(FLASH_SECTOR_SIZE);
+    w.cur = malloc(FLASH_SECTOR_SIZE);
+    int retval = 0;
+    if (!state || !tmp || !lz || !w.first || !w.cur) {
+        printf("Save state: out of memory\n");
+        goto cleanup;
+    }
+
+    struct savestate_header hdr = {0};
+    hdr.magic = SAVESTATE_MAGIC;
+    hdr.seq = SaveStates.seq;
+    hdr.slot = slot;
+    hdr.tick = EMU.tick;
+    if (EMU.loaded_game >= 0)
+        memcpy(hdr.game,GamesTable[EMU.loaded_game].name,sizeof(hdr.game));
+    hdr.version = zx_save_snapshot_state(&EMU.zx,state);
+
+    // Reserve the header space, then append the compressed data.
+    w.len = sizeof(hdr);
+    w.checksum = 2166136261U;
+    hdr.state_len = savestate_compress(&w,lz,tmp,state,ZX_SNAPSHOT_STATE_SIZE);
+    hdr.ram_len = savestate_compress(&w,lz,tmp,(uint8_t*)EMU.zx.ram,
+                                     sizeof(EMU.zx.ram));
+    if (EMU.zx.type == ZX_TYPE_128) {
+        hdr.ext_len[0] = savestate_compress(&w,lz,tmp,EMU.zx.ram_ext,
+                                            3*0x4000);
+        hdr.ext_len[1] = savestate_compress(&w,lz,tmp,
+                                            EMU.zx.ram_ext+3*0x4000,
+                                            2*0x4000);
+    }
+    if (hdr.state_len == 0 || hdr.ram_len == 0 ||
+        (EMU.zx.type == ZX_TYPE_128 &&
+         (hdr.ext_len[0] == 0 || hdr.ext_len[1] == 0)))
+    {
+        printf("Save state: compression error\n");
+        goto cleanup;
+    }
+
+    // Program the last partial sector, then the first one, with the
+    // now complete header.
+    uint32_t sectors = (w.len+FLASH_SECTOR_SIZE-1)/FLASH_SECTOR_SIZE;
+    if (sectors > 1 && w.len % FLASH_SECTOR_SIZE) {
+        memset(w.cur+w.len%FLASH_SECTOR_SIZE,0xff,
+               FLASH_SECTOR_SIZE-w.len%FLASH_SECTOR_SIZE);
+        savestate_program(SaveStates.head+sectors-1,w.cur,&w);
+    }
+    if (sectors == 1)
+        memset(w.first+w.len,0xff,FLASH_SECTOR_SIZE-w.len);
+    hdr.checksum = savestate_checksum(w.checksum,(uint8_t*)&hdr,
+                        offsetof(struct savestate_header,checksum));
+    memcpy(w.first,&hdr,sizeof(hdr));
+    savestate_program(SaveStates.head,w.first,&w);
+
+    // Update the slots table and the log head.
+    for (int j = 0; j < SAVESTATE_SLOTS; j++)
+        if (SaveStates.slot_sector[j] >= 0 &&
+            !savestate_check_record(SaveStates.slot_sector[j]))
+            SaveStates.slot_sector[j] = -1;
+    SaveStates.slot_sector[slot] = SaveStates.head;
+    SaveStates.head += sectors;
+    if (SaveStates.head+SAVESTATE_MAX_SECTORS > SAVESTATE_SECTORS)
+        SaveStates.head = 0;
+    SaveStates.seq++;
+    retval = 1;
+
+    uint64_t total = get_absolute_time()-start;
+    printf("Saved slot %u: %u bytes (state %u, ram %u), "
+           "total %llu us (compress %llu us, flash %llu us)\n",
+        (unsigned)slot, (unsigned)w.len, (unsigned)hdr.state_len,
+        (unsigned)hdr.ram_len, total, total-w.program_time, w.program_time);
+
+cleanup:
+    free(state); free(tmp); free(lz); free(w.first); free(w.cur);
+    set_emulator_clock(EMU.emu_clock);
+    return retval;
+}
+
+// Load the emulator state from the specified slot. Returns 1 on success.
+int savestate_load(uint32_t slot) {
+    if (SaveStates.slot_sector[slot] < 0) {
+        printf("Slot %u is empty\n", (unsigned)slot);
+        return 0;
+    }
+    set_emulator_clock(EMU.base_clock);
+    absolute_time_t start = get_absolute_time();
+
+    int retval = 0;
+    const struct savestate_header *hdr = (const struct savestate_header*)
+        savestate_sector_ptr(SaveStates.slot_sector[slot]);
+    const uint8_t *data = (const uint8_t*)(hdr+1);
+    uint8_t *state = malloc(ZX_SNAPSHOT_STATE_SIZE);
+    if (!state) {
+        printf("Load state: out of memory\n");
+        goto cleanup;
+    }
+    if (lz_decompress(data,hdr->state_len,state,ZX_SNAPSHOT_STATE_SIZE)
+        != ZX_SNAPSHOT_STATE_SIZE || hdr->version != ZX_SNAPSHOT_VERSION)
+    {
+        printf("Load state: incompatible or corrupted state\n");
+        goto cleanup;
+    }
+    // Switch to the model of the saved state first, so that the
+    // 128K banks are there to receive the extra streams.
+    zx_type_t type = ((zx_t*)state)->type;
+    if ((type == ZX_TYPE_128) != (hdr->ext_len[0] != 0) ||
+        !set_zx_model(type) ||
+        !zx_load_snapshot_state(&EMU.zx,hdr->version,state))
+    {
+        printf("Load state: incompatible or corrupted state\n");
+        goto cleanup;
+    }
+    // From now on the checksum (verified when the slot was found)
+    // guarantees we can't fail.
+    data += hdr->state_len;
+    lz_decompress(data,hdr->ram_len,(uint8_t*)EMU.zx.ram,sizeof(EMU.zx.ram));
+    data += hdr->ram_len;
+    if (type == ZX_TYPE_128) {
+        lz_decompress(data,hdr->ext_len[0],EMU.zx.ram_ext,3*0x4000);
+        data += hdr->ext_len[0];
+        lz_decompress(data,hdr->ext_len[1],EMU.zx.ram_ext+3*0x4000,
+                      2*0x4000);
+    }
+
+    // Restore the keymap of the saved game. The state already has
+    // the right scanline period, so pretend the game is already loaded
+    // to avoid get_keymap_for_current_game() changing it.
+    int game_id = -1;
+    for (int j = 0; j < GamesTableSize; j++) {
+        if (!strncmp(GamesTable[j].name,hdr->game,sizeof(hdr->game))) {
+            game_id = j;
+            break;
+        }
+    }
+    flush_zx_key_press(&EMU.zx);
+    EMU.loaded_game = game_id;
+    get_keymap_for_current_game(game_id);
+    if (game_id >= 0) EMU.selected_game = game_id;
+    EMU.tick = hdr->tick;
+    rewind_reset();
+    vram_force_dirty();
+    retval = 1;
+
+    printf("Loaded slot %u in %llu us\n",
+        (unsigned)slot, get_absolute_time()-start);
+
+cleanup:
+    free(state);
+    set_emulator_clock(EMU.emu_clock);
+    return retval;
+}
+
+// Quick save / quick load button chords: left+right+up saves the state
+// in the slot selected in the menu, left+right+down loads it, and
+// left+right+fire toggles fast forward. Checked before the keymap, since
+// extended maps may use the same buttons. Returns 1 while up+down (without
+// left/right) is held: that is the rewind chord, handled by the main loop.
+int handle_hotkeys(void) {
+    static int last_chord = 0;
+    int chord = 0;
+    if (get_device_button(KEY_LEFT) && get_device_button(KEY_RIGHT)) {
+        if (get_device_button(KEY_UP)) chord = 1;
+        else if (get_device_button(KEY_DOWN)) chord = 2;
+        else if (get_device_button(KEY_FIRE)) chord = 4;
+    } else if (get_device_button(KEY_UP) && get_device_button(KEY_DOWN)) {
+        chord = 3;
+    }
+    if (chord != last_chord) {
+        if (chord == 1) savestate_save(EMU.save_slot);
+        else if (chord == 2) savestate_load(EMU.save_slot);
+        else if (chord == 4) EMU.ffwd = !EMU.ffwd;
+    }
+    last_chord = chord;
+    return chord == 3;
+}
+
+/* ================================= Rewind ================================= */
+
+// While playing, every REWIND_INTERVAL frames the emulator state (in the
+// zx_save_snapshot_state() format, so that mem_t pointers are relocated)
+// and the RAM are compared with a reference image of the previous
+// capture. The difference is stored XOR+RLE encoded in a ring buffer of
+// ZX_REWIND_BUFFER_KB kilobytes, and the reference is updated.
+//
+// Since XOR deltas work in both directions, going back one step just
+// means to XOR the newest delta into the reference image and load it:
+// no full keyframes are needed, just the reference image itself. When
+// the ring is full the oldest deltas are discarded.
+//
+// Rewind is only available in 48K mode: the 128K model needs the
+// memory of the rewind buffers for its extra RAM banks.
+//
+// Deltas are sequences of words: a header with the number of unchanged
+// words to skip (upper 16 bits) and the number of changed words that
+// follow (lower 16 bits), then the XOR of such words. Each delta
+// in the ring is prefixed and suffixed by its length in words, so it
+// can be both discarded from the tail and removed from the head.
+#define REWIND_INTERVAL 5 // Frames between captures.
+#define REWIND_STATS_CAPTURES 50
+#define REWIND_STATE_WORDS ((ZX_SNAPSHOT_STATE_SIZE+3)/4)
+#define REWIND_RAM_WORDS (sizeof(EMU.zx.ram)/4)
+
+struct {
+    uint32_t *buf;          // Ring buffer of deltas.
+    uint32_t size;          // Ring size in words.
+    uint32_t head;          // Where the next word will be written.
+    uint32_t tail;          // Start of the oldest delta.
+    uint32_t used;          // Words used, including the delta in progress.
+    uint32_t count;         // Number of complete deltas in the ring.
+    uint32_t delta_len;     // Words of the delta in progress.
+    int overflow;           // The delta in progress does not fit.
+    uint32_t *ref_state;    // Reference image: state of the last capture.
+    uint32_t *ref_ram;      // Reference image: RAM of the last capture.
+    uint32_t *cur_state;    // Current state, saved for comparison.
+    int valid;              // Reference image is valid.
+    uint32_t frames;        // Frames since the last capture.
+    // Stats, printed every REWIND_STATS_CAPTURES captures.
+    uint32_t captures;
+    uint64_t capture_max, capture_sum;
+} Rewind;
+
+// Allocate the rewind buffers. If there is not enough memory, rewind
+// is just disabled.
+void rewind_init(void) {
+    if (Rewind.buf) return; // Already allocated.
+    Rewind.size = ZX_REWIND_BUFFER_KB*1024/4;
+    Rewind.buf = malloc(Rewind.size*4);
+    Rewind.ref_state = calloc(REWIND_STATE_WORDS,4);
+    Rewind.cur_state = calloc(REWIND_STATE_WORDS,4);
+    Rewind.ref_ram = malloc(REWIND_RAM_WORDS*4);
+    if (!Rewind.buf || !Rewind.ref_state || !Rewind.cur_state ||
+        !Rewind.ref_ram)
+    {
+        free(Rewind.buf); free(Rewind.ref_state);
+        free(Rewind.cur_state); free(Rewind.ref_ram);
+        memset(&Rewind,0,sizeof(Rewind));
+        printf("Rewind disabled: not enough memory\n");
+        return;
+    }
+    printf("Rewind buffer: %u bytes\n", (unsigned)(Rewind.size*4));
+    rewind_reset();
+}
+
+// Release the rewind buffers, disabling rewind until the next
+// rewind_init() call.
+void rewind_free(void) {
+    free(Rewind.buf); free(Rewind.ref_state);
+    free(Rewind.cur_state); free(Rewind.ref_ram);
+    memset(&Rewind,0,sizeof(Rewind));
+}
+
+// Discard the rewind history. Called when the emulator state changes
+// in a discontinuous way, like when a game or a save state is loaded.
+void rewind_reset(void) {
+    Rewind.head = Rewind.tail = Rewind.used = Rewind.count = 0;
+    Rewind.valid = 0;
+    Rewind.frames = 0;
+}
+
+// Discard the oldest delta to make space. Returns 0 if there is no
+// complete delta to discard.
+static int rewind_evict(void) {
+    if (Rewind.count == 0) return 0;
+    uint32_t len = Rewind.buf[Rewind.tail]+2;
+    Rewind.tail = (Rewind.tail+len) % Rewind.size;
+    Rewind.used -= len;
+    Rewind.count--;
+    return 1;
+}
+
+static inline void rewind_put(uint32_t word) {
+    if (Rewind.overflow) return;
+    if (Rewind.used == Rewind.size && !rewind_evict()) {
+        Rewind.overflow = 1;
+        return;
+    }
+    Rewind.buf[Rewind.head] = word;
+    if (++Rewind.head == Rewind.size) Rewind.head = 0;
+    Rewind.used++;
+    Rewind.delta_len++;
+}
+
+// Append to the ring the delta between 'cur' and 'ref', and update 'ref'.
+static void rewind_encode(uint32_t *ref, const uint32_t *cur, uint32_t words) {
+    uint32_t j = 0;
+    while (j < words) {
+        uint32_t skip = j;
+        while (j < words && cur[j] == ref[j] && j-skip < 0xffff) j++;
+        skip = j-skip;
+        uint32_t lit = j;
+        while (j < words && cur[j] != ref[j] && j-lit < 0xffff) j++;
+        uint32_t litlen = j-lit;
+        rewind_put(skip<<16 | litlen);
+        for (; lit < j; lit++) {
+            rewind_put(cur[lit]^ref[lit]);
+            ref[lit] = cur[lit];
+        }
+    }
+}
+
+// Read words from the ring starting at '*idx', applying them to 'ref'.
+static void rewind_decode(uint32_t *ref, uint32_t words, uint32_t *idx) {
+    uint32_t j = 0;
+    while (j < words) {
+        uint32_t h = Rewind.buf[*idx];
+        if (++*idx == Rewind.size) *idx = 0;
+        j += h>>16;
+        for (uint32_t end = j+(h&0xffff); j < end; j++) {
+            ref[j] ^= Rewind.buf[*idx];
+            if (++*idx == Rewind.size) *idx = 0;
+        }
+    }
+}
+
+// Called after every emulated frame: capture a rewind step every
+// REWIND_INTERVAL frames.
+void rewind_capture(void) {
+    if (!Rewind.buf || ++Rewind.frames < REWIND_INTERVAL) return;
+    Rewind.frames = 0;
+
+    absolute_time_t start = get_absolute_time();
+    zx_save_snapshot_state(&EMU.zx,Rewind.cur_state);
+    if (!Rewind.valid) {
+        memcpy(Rewind.ref_state,Rewind.cur_state,REWIND_STATE_WORDS*4);
+        memcpy(Rewind.ref_ram,EMU.zx.ram,REWIND_RAM_WORDS*4);
+        Rewind.valid = 1;
+        return;
+    }
+
+    uint32_t start_idx = Rewind.head;
+    Rewind.overflow = 0;
+    Rewind.delta_len = 0;
+    rewind_put(0); // Length prefix, set later.
+    rewind_encode(Rewind.ref_state,Rewind.cur_state,REWIND_STATE_WORDS);
+    rewind_encode(Rewind.ref_ram,(uint32_t*)EMU.zx.ram,REWIND_RAM_WORDS);
+    uint32_t len = Rewind.delta_len-1;
+    rewind_put(0); // Length suffix.
+
+    if (Rewind.overflow) {
+        // This delta is larger than the whole buffer: the older
+        // deltas can't be applied without it, so discard everything.
+        // The reference image is updated anyway.
+        Rewind.head = Rewind.tail = Rewind.used = Rewind.count = 0;
+    } else {
+        Rewind.buf[start_idx] = len;
+        Rewind.buf[(Rewind.head+Rewind.size-1)%Rewind.size] = len;
+        Rewind.count++;
+    }
+
+    uint64_t elapsed = get_absolute_time()-start;
+    Rewind.capture_sum += elapsed;
+    if (elapsed > Rewind.capture_max) Rewind.capture_max = elapsed;
+    if (++Rewind.captures == REWIND_STATS_CAPTURES) {
+        printf("[rewind] capture avg:%llu max:%llu us, "
+               "%u steps, %u/%u bytes\n",
+            Rewind.capture_sum/REWIND_STATS_CAPTURES, Rewind.capture_max,
+            (unsigned)Rewind.count, (unsigned)Rewind.used*4,
+            (unsigned)Rewind.size*4);
+        Rewind.captures = 0;
+        Rewind.capture_sum = Rewind.capture_max = 0;
+    }
+}
+
+// Go back one rewind step, loading the previous capture. Returns 0
+// if there is nothing to rewind.
+int rewind_step(void) {
+    if (!Rewind.buf || !Rewind.valid || Rewind.count == 0) return 0;
+
+    uint32_t last = (Rewind.head+Rewind.size-1)%Rewind.size;
+    uint32_t len = Rewind.buf[last];
+    uint32_t start_idx = (last+Rewind.size-len-1)%Rewind.size;
+    uint32_t idx = (start_idx+1)%Rewind.size;
+    rewind_decode(Rewind.ref_state,REWIND_STATE_WORDS,&idx);
+    rewind_decode(Rewind.ref_ram,REWIND_RAM_WORDS,&idx);
+    Rewind.head = start_idx;
+    Rewind.used -= len+2;
+    Rewind.count--;
+
+    zx_load_snapshot_state(&EMU.zx,ZX_SNAPSHOT_VERSION,Rewind.ref_state);
+    memcpy(EMU.zx.ram,Rewind.ref_ram,REWIND_RAM_WORDS*4);
+    Rewind.frames = 0;
+    vram_force_dirty();
+    return 1;
+}
+
+/* ================================= Audio ================================== */
+
+// The audio is played by an interrupt on core1, so that core1 is free to
+// drive the display, see the "Render pipeline" section. The speaker PWM
+// slice wraps once per output sample, and at every wrap the interrupt
+// sets the level of the next one. The output rate is 1/AUDIO_DECIMATION
+// of the rate zx.h samples the beeper at, 27.3 kHz on the 48K: each
+// output sample is the average of the 8 beeper samples in a byte of the
+// bitmap, and the AY is synthesized at this rate too, applying the
+// register writes queued by zx.h at the sample they happened.
+//
+// The rate comes from the PWM hardware, and the frames are paced at 50 Hz
+// by the same crystal, so there is no wait to adapt. When the scanline is
+// scaled (see set_frame_timing()) a frame has more or fewer samples, and
+// the rate follows, see zx_paced_freq_hz(). The interrupt just
+// plays AUDIO_LATENCY samples behind the emulator. The samples of a frame
+// are produced in a burst, so the latency covers a whole frame. If the
+// emulator falls behind (underrun) the interrupt holds the level until
+// the latency builds up again, if it gets too far ahead (turbo and fast
+// forward) the interrupt skips forward.
+#define AUDIO_DECIMATION 8      // Beeper samples per output sample.
+#define AUDIO_LATENCY 5632      // Beeper samples: a frame plus ~6 ms.
+#define AUDIO_MAX_AHEAD (AUDIOBUF_LEN*32-1024) // Before being overwritten.
+
+struct audio_state {
+    uint32_t sample;            // Next beeper sample to play.
+    int priming;                // Waiting for the latency to build up.
+    uint32_t range;             // PWM counts per output sample.
+    uint32_t scale;             // Level to PWM counts, 24.8 fixed point.
+    uint32_t clock, freq_hz, volume; // What range and scale were set for.
+    uint32_t level;             // PWM level of the last sample.
+    unsigned int slice, channel;
+
+    // Statistics for the "[timing]" lines, only incremented.
+    volatile uint32_t irqs, irq_us; // Interrupts, and time spent in them.
+    volatile uint32_t underruns, skips;
+};
+static struct audio_state CORE1_HOT("zx_audio_state") Audio;
+
+// Speaker PWM wrap interrupt: play the next sample. Beeper high is
+// AUDIO_BEEPER_LEVEL, the AY output, up to AY38910_MAX_LEVEL, is added.
+void CORE1_HOT("audio_irq") audio_irq(void) {
+    uint32_t start = time_us_32();
+    pwm_clear_irq(Audio.slice);
+
+    uint32_t ahead = *(volatile uint32_t*)&EMU.zx.audio_sample - Audio.sample;
+    if (ahead > AUDIO_MAX_AHEAD) {
+        Audio.sample += (ahead-AUDIO_LATENCY) & ~(AUDIO_DECIMATION-1);
+        Audio.priming = 0;
+        Audio.skips++;
+    } else if (ahead < (Audio.priming ? AUDIO_LATENCY : AUDIO_DECIMATION)) {
+        if (!Audio.priming) Audio.underruns++;
+        Audio.priming = 1;
+        goto done;
+    }
+    Audio.priming = 0;
+
+    uint8_t bits = ((uint8_t*)zx_audiobuf)
+        [(Audio.sample/AUDIO_DECIMATION) & (sizeof(zx_audiobuf)-1)];
+    uint32_t level = __builtin_popcount(bits) *
+                     (AUDIO_BEEPER_LEVEL/AUDIO_DECIMATION);
+    if (core1_ay.active || zx_ay_queue.head != zx_ay_queue.tail) {
+        ay38910_queue_apply(&zx_ay_queue,&core1_ay,
+                            Audio.sample+AUDIO_DECIMATION-1);
+        level += ay38910_sample(&core1_ay);
+    }
+    Audio.sample += AUDIO_DECIMATION;
+
+    // Fast forward plays muted.
+    level = ffwd_active() ? 0 : (level*Audio.scale)>>8;
+    if (level > Audio.range) level = Audio.range;
+    if (level != Audio.level) {
+        pwm_set_chan_level(Audio.slice, Audio.channel, level);
+        Audio.level = level;
+    }
+
+done:
+    Audio.irq_us += time_us_32()-start;
+    Audio.irqs++;
+}
+
+// Program the PWM to wrap once per output sample, and set the volume.
+// The system clock (the "clock" setting, or the base clock while the
+// flash is accessed), the model, the scanline scale and the volume can
+// change at any time: core1 calls this function every time it wakes up.
+void audio_update_rate(void) {
+    uint32_t clock = clock_get_hz(clk_sys);
+    uint32_t freq_hz = zx_paced_freq_hz(&EMU.zx);
+    if (clock == Audio.clock && freq_hz == Audio.freq_hz &&
+        EMU.volume == Audio.volume) return;
+
+    uint32_t irq = save_and_disable_interrupts();
+    Audio.clock = clock;
+    Audio.freq_hz = freq_hz;
+    Audio.volume = EMU.volume;
+    uint32_t div = ZX_AUDIO_TICKS_PER_SAMPLE*AUDIO_DECIMATION;
+    uint32_t rate = Audio.freq_hz/div;
+    Audio.range = ((uint64_t)clock*div + Audio.freq_hz/2)/Audio.freq_hz;
+    // Volume is in the range 0-20: the beeper alone is 1/(21-volume) of
+    // the duty cycle, so at high volumes the AY saturates it.
+    Audio.scale = Audio.volume == 0 ? 0 :
+        (Audio.range<<8)/((21-Audio.volume)*AUDIO_BEEPER_LEVEL);
+    pwm_set_wrap(Audio.slice, Audio.range-1);
+    ay38910_set_rate(&core1_ay, AY38910_CLOCK_ZX, rate);
+    restore_interrupts(irq);
+}
+
+// Start playing, with the interrupt on the calling core.
+void audio_init(void) {
+    Audio.slice = pwm_gpio_to_slice_num(SPEAKER_PIN);
+    Audio.channel = pwm_gpio_to_channel(SPEAKER_PIN);
+    Audio.sample = EMU.zx.audio_sample & ~(AUDIO_DECIMATION-1);
+    Audio.priming = 1;
+    ay38910_reset(&core1_ay);
+    pwm_set_clkdiv(Audio.slice, 1);
+    audio_update_rate();
+    pwm_clear_irq(Audio.slice);
+    pwm_set_irq_enabled(Audio.slice, true);
+    irq_set_exclusive_handler(PWM_IRQ_WRAP, audio_irq);
+    irq_set_enabled(PWM_IRQ_WRAP, true);
+}
+
+/* ============================ Render pipeline ============================= */
+
+// The display is driven by core1 while core0 emulates: converting and
+// transferring a frame takes a good part of the 20 ms of a Spectrum frame
+// on SPI displays, and on parallel ones too with scaling or many changes.
+// At the end of a frame core0 copies what update_display() needs (the
+// screen, the dirty rows, the border) into one of RENDER_FRAMES snapshots,
+// that takes a few microseconds, and goes on emulating the next frame
+// while core1 draws it.
+//
+// Core1 draws one snapshot while core0 fills the other. If core1 is still
+// busy when the next frame ends, core0 replaces the snapshot waiting to be
+// drawn, merging the dirty rows: the display shows the most recent frame,
+// skipping the ones it can't keep up with. The snapshot states are only
+// changed holding a hardware spin lock.
+#define RENDER_FRAMES 2
+
+struct {
+    struct render_frame frame[RENDER_FRAMES];
+    spin_lock_t *lock;
+    volatile int ready;         // Snapshot waiting to be drawn, or -1.
+    volatile int busy;          // Snapshot core1 is drawing, or -1.
+
+    // Statistics for the "[timing]" lines, only incremented.
+    volatile uint32_t rendered; // Frames drawn,
+    volatile uint32_t render_us; // and time spent drawing them.
+} Render;
+
+void render_init(void) {
+    Render.lock = spin_lock_init(spin_lock_claim_unused(true));
+    Render.ready = Render.busy = -1;
+}
+
+// Send the current frame to core1. The display shows the video RAM,
+// or the beam screen, see display_vmem(). Returns 1 if it replaced a
+// frame core1 did not draw in time.
+int render_submit(uint32_t blink) {
+    uint32_t irq = spin_lock_blocking(Render.lock);
+    // A snapshot still waiting to be drawn is taken back and merged,
+    // otherwise fill the one core1 is not drawing.
+    int merge = Render.ready != -1;
+    int idx = merge ? Render.ready : Render.busy == 0;
+    Render.ready = -1;
+    spin_unlock(Render.lock, irq);
+
+    struct render_frame *f = Render.frame+idx;
+    memcpy(f->screen,display_vmem(),sizeof(f->screen));
+    for (int j = 0; j < 24; j++)
+        f->dirty[j] = (merge ? f->dirty[j] : 0) | EMU.dirty_vram[j];
+    f->update_border = (merge && f->update_border) ||
+        EMU.force_border_update;
+    memcpy(f->border,BorderLog,sizeof(f->border));
+    f->blink = blink != 0;
+    f->show_border = EMU.show_border;
+    f->partial_update = EMU.partial_update;
+    f->scaling = EMU.scaling;
+    f->smooth = EMU.smooth;
+    vram_reset_dirty();
+    EMU.force_border_update = 0;
+
+    irq = spin_lock_blocking(Render.lock);
+    Render.ready = idx;
+    spin_unlock(Render.lock, irq);
+    __sev();
+    return merge;
+}
+
+// Wait for core1 to draw the frames sent so far, before core0 accesses
+// the display directly.
+void render_wait_idle(void) {
+    while (Render.ready != -1 || Render.busy != -1) tight_loop_contents();
+}
+
+// Core1 main loop: draw the frames core0 sends, sleeping with WFE when
+// there are none. render_submit() sends an event, and the audio
+// interrupt wakes the core too.
+void core1_main(void) {
+    if (SPEAKER_PIN != -1) audio_init();
+    st77xx_te_irq_init();
     while(1) {
-        // Wait for new buffer chunk to be available.
-        start = get_absolute_time();
-        while(EMU.zx.audiobuf_notify == 0);
-        end = get_absolute_time();
-        if (EMU.debug)
-            printf("[playback] waiting %llu [%u]\n",
-                end-start, EMU.zx.audiobuf_notify);
-        if (end-start == 0) EMU.audio_sample_wait--;
-        else if (end-start > 1000) EMU.audio_sample_wait++;
-
-        // Seek the right part of the buffer. We use double buffering
-        // splitting the buffer in two. This is needed as memcpy()-ing
-        // to our buffer is already a substantian delay, and would not
-        // require less memory.
-        uint32_t *buf = EMU.zx.audiobuf;
-        buf += (EMU.zx.audiobuf_notify-1)*(AUDIOBUF_LEN/2);
-        EMU.zx.audiobuf_notify = 0; // Clear notification flag.
-
-        // Play samples.
-        start = get_absolute_time();
-        for (uint32_t byte = 0; byte < AUDIOBUF_LEN/2; byte++) {
-            for (uint32_t bit = 0; bit < 32; bit++) {
-                int level = (buf[byte] & (1<<bit)) >> bit;
-                if (level != oldlevel) {
-                    pwm_set_chan_level(slice_num, pwm_channel, level);
-                    oldlevel = level;
-                }
+        if (SPEAKER_PIN != -1) audio_update_rate();
+        if (Render.ready == -1) {
+            __wfe();
+            continue;
+        }
+
+        uint32_t irq = spin_lock_blocking(Render.lock);
+        int idx = Render.ready;
+        Render.ready = -1;
+        Render.busy = idx;
+        spin_unlock(Render.lock, irq);
+        if (idx == -1) continue; // Taken back by core0 meanwhile.
+
+        absolute_time_t start = get_absolute_time();
+        update_display(Render.frame+idx);
+        Render.render_us += get_absolute_time()-start;
+        Render.rendered++;
+
+        irq = spin_lock_blocking(Render.lock);
+        Render.busy = -1;
+        spin_unlock(Render.lock, irq);
+    }
+}
+
+/* ============================== Fast forward ============================== */
+
+// Fast forward, to skip intros, loading screens and attract sequences:
+// enabled by the "ffwd" menu item, or toggled by the left+right+fire
+// chord. The frames run back to back with no pacing, the display is
+// refreshed every FFWD_DISPLAY_FRAMES frames (the dirty rows accumulate
+// meanwhile, like in turbo mode), and the audio core plays muted. Each
+// main loop iteration is still one Spectrum frame, so EMU.tick, and the
+// keymap PRESS_AT_TICK macros with it, keep counting frames.
+//
+// At every refresh the speed reached, as a multiple of the real Spectrum,
+// is shown in the top right corner. It is drawn in the video RAM, like
+// the rest of the UI, but only while the frame is sent to the display:
+// then the original bytes are put back, so the game never sees it.
+#define FFWD_OVERLAY_LINES 16
+
+struct {
+    absolute_time_t last_update;    // Last refresh, 0 if not in fast forward.
+    uint32_t frames;                // Frames since the last refresh.
+    uint32_t speed;                 // Last speed measured, x10.
+    int drawn;                      // Overlay in the video RAM right now.
+    uint8_t saved[FFWD_OVERLAY_LINES*32+FFWD_OVERLAY_LINES/8*32];
+} Ffwd;
+
+// Called every frame.
+void ffwd_frame(void) {
+    if (!ffwd_active()) {
+        Ffwd.last_update = 0;
+        Ffwd.frames = Ffwd.speed = 0;
+        return;
+    }
+    if (Ffwd.last_update == 0) Ffwd.last_update = get_absolute_time();
+    Ffwd.frames++;
+}
+
+// Save or restore the video RAM under the overlay: the first
+// FFWD_OVERLAY_LINES bitmap lines, then their attributes.
+void ffwd_overlay_copy(int save) {
+    uint8_t *vmem = zx_display_ram(&EMU.zx);
+    uint8_t *p = Ffwd.saved;
+    for (int y = 0; y < FFWD_OVERLAY_LINES; y++) {
+        uint8_t *line = vmem + (((y & 0x07)<<8) | ((y & 0x38)<<2));
+        if (save) memcpy(p,line,32); else memcpy(line,p,32);
+        p += 32;
+    }
+    if (save) memcpy(p,vmem+0x1800,FFWD_OVERLAY_LINES/8*32);
+    else memcpy(vmem+0x1800,p,FFWD_OVERLAY_LINES/8*32);
+    for (int row = 0; row < FFWD_OVERLAY_LINES/8; row++)
+        EMU.dirty_vram[row] = 0xff;
+}
+
+// Draw the speed overlay, just before a display update.
+void ffwd_overlay_draw(void) {
+    absolute_time_t now = get_absolute_time();
+    if (Ffwd.frames && now > Ffwd.last_update) {
+        Ffwd.speed = (uint64_t)Ffwd.frames*zx_frame_ns(&EMU.zx)/100/
+                     (now-Ffwd.last_update);
+    }
+    Ffwd.last_update = now;
+    Ffwd.frames = 0;
+
+    char buf[8];
+    int len = Ffwd.speed ?
+        snprintf(buf,sizeof(buf),"x%u.%u",(unsigned)Ffwd.speed/10,
+            (unsigned)Ffwd.speed%10) :
+        snprintf(buf,sizeof(buf),">>");
+    int x = 256-16*len;
+    ffwd_overlay_copy(1);
+    ui_set_area_attributes(x,0,255,15);
+    ui_fill_box(x,0,16*len,16,0,0);
+    ui_draw_string(x,0,buf,1,2);
+    Ffwd.drawn = 1;
+}
+
+// Put back the video RAM under the overlay, once sent to the display.
+void ffwd_overlay_remove(void) {
+    if (!Ffwd.drawn) return;
+    ffwd_overlay_copy(0);
+    Ffwd.drawn = 0;
+}
+
+/* ============================== Frame pacing ============================== */
+
+// Every zx_exec_frame() call runs exactly one Spectrum frame, so to run
+// games at the real speed we start a new frame every zx_frame_ns(), that
+// is 50 times per second, using an RP2040 hardware timer alarm: when the
+// emulator is ahead, the core sleeps with WFE until the alarm interrupt
+// fires. The deadlines are computed from the frames since the start of
+// the schedule, not adding the period to the previous deadline, so the
+// rounding errors don't accumulate.
+//
+// If we are behind more than PACING_MAX_LAG_USEC (flash access, or a game
+// too hard to emulate at full speed) we don't try to catch
+// up running frames back to back: the schedule restarts from now. In turbo
+// mode and in fast forward there is no pacing at all.
+#define PACING_MAX_LAG_USEC 100000
+
+struct {
+    int alarm;                  // Hardware alarm, -1 if none was free.
+    volatile bool fired;        // Set by the alarm interrupt.
+    absolute_time_t origin;     // Start of the schedule.
+    uint32_t frames;            // Frames since the start of the schedule.
+    uint32_t frame_ns;          // Frame period of the schedule.
+    absolute_time_t last_start; // Start of the previous frame.
+
+    // Statistics for the "[timing]" lines, reset when printed. The frame
+    // time is the time between the start of two frames, the drift is how
+    // late a frame started compared to its deadline.
+    uint32_t periods;
+    uint64_t period_min, period_max;
+    uint64_t jitter_sum;        // Sum of |frame time - period|.
+    int64_t drift;              // Drift of the last frame.
+    uint64_t drift_max;
+    uint32_t resyncs;           // Schedule restarts.
+} Pacing;
+
+static void pacing_alarm_callback(uint alarm_num) {
+    Pacing.fired = true;
+}
 
-                // Wait some time.
-                for (volatile int k = 0; k < EMU.audio_sample_wait; k++);
+void pacing_init(void) {
+    Pacing.alarm = hardware_alarm_claim_unused(false);
+    if (Pacing.alarm >= 0)
+        hardware_alarm_set_callback(Pacing.alarm, pacing_alarm_callback);
+    Pacing.period_min = UINT64_MAX;
+}
+
+// Restart the schedule: the next frame is due one period from now.
+void pacing_resync(void) {
+    Pacing.origin = get_absolute_time();
+    Pacing.frames = 0;
+}
+
+// SCANLINE-PERIOD in the keymaps, and the "scan-p" setting, were tuned
+// in z80_tick() calls when zx_exec() was used: the default period now
+// means the real scanline, the others stretch it by the same ratio, so
+// they still give the game more or less time between two interrupts.
+// The frames start at 50 Hz in any case, and the audio rate is scaled
+// to consume the samples they produce, see audio_update_rate().
+void set_frame_timing(void) {
+    zx_set_scanline_scale(&EMU.zx, EMU.zx.scanline_period,
+                          ZX_DEFAULT_SCANLINE_PERIOD);
+}
+
+// Wait for the start of the next frame.
+void pacing_wait(void) {
+    uint32_t frame_ns = zx_frame_ns(&EMU.zx);
+    int paced = EMU.turbo <= 1 && !ffwd_active();
+    if (!paced || frame_ns != Pacing.frame_ns) {
+        Pacing.frame_ns = frame_ns;
+        pacing_resync();
+    } else {
+        Pacing.frames++;
+    }
+    absolute_time_t deadline = Pacing.origin +
+        (uint64_t)Pacing.frames*Pacing.frame_ns/1000;
+
+    if (paced && get_absolute_time() < deadline) {
+        if (Pacing.alarm >= 0) {
+            Pacing.fired = false;
+            // The call returns true, without setting the alarm, if the
+            // deadline already passed meanwhile.
+            if (!hardware_alarm_set_target(Pacing.alarm, deadline)) {
+                while (!Pacing.fired) __wfe();
+            }
+        } else {
+            sleep_until(deadline);
+        }
+    }
+
+    absolute_time_t now = get_absolute_time();
+    Pacing.drift = (int64_t)(now - deadline);
+    if (Pacing.drift > PACING_MAX_LAG_USEC) {
+        Pacing.resyncs++;
+        pacing_resync();
+    }
+    if ((uint64_t)Pacing.drift > Pacing.drift_max && Pacing.drift > 0)
+        Pacing.drift_max = Pacing.drift;
+
+    if (Pacing.last_start != 0) {
+        uint64_t period = now - Pacing.last_start;
+        int64_t delta = (int64_t)period - Pacing.frame_ns/1000;
+        if (period < Pacing.period_min) Pacing.period_min = period;
+        if (period > Pacing.period_max) Pacing.period_max = period;
+        Pacing.jitter_sum += delta < 0 ? -delta : delta;
+        Pacing.periods++;
+    }
+    Pacing.last_start = now;
+}
+
+/* =============================== Frameskip ================================ */
+
+// A real Spectrum generates 50 vertical blank interrupts per second, and
+// games are paced by them. The display is drawn by core1, that skips on
+// its own the frames it can't keep up with (see "Render pipeline"), while
+// core0 goes on emulating: sending a frame only costs core0 the snapshot
+// copy, so skipping display updates would not make the emulation faster.
+// Updates are only decimated in turbo mode and in fast forward, where the
+// frames run back to back. The dirty rows of the skipped frames
+// accumulate, so the next update shows all the changes.
+#define FRAMESKIP_WINDOW 50     // Frames of the skipped frames statistic.
+
+struct {
+    uint32_t skipped;           // Total frames not drawn.
+    uint32_t window_skipped;    // Not drawn in the current window of
+    uint32_t window_frames;     // FRAMESKIP_WINDOW frames so far,
+    uint32_t last_window_skipped; // and in the previous window.
+} Frameskip;
+
+// Return 1 if the display should be updated in this frame.
+int frameskip_display_due(void) {
+    if (EMU.menu_active) return 1; // Always responsive in the menu.
+    if (ffwd_active()) return EMU.tick % FFWD_DISPLAY_FRAMES == 0;
+    if (EMU.turbo > 1) return EMU.tick % EMU.turbo == 0;
+    return 1;
+}
+
+// Account a frame: 'skipped' is true if it was not sent to the display,
+// or if sending it replaced a frame core1 did not draw.
+void frameskip_account(int skipped) {
+    if (skipped) {
+        Frameskip.skipped++;
+        Frameskip.window_skipped++;
+    }
+    if (++Frameskip.window_frames == FRAMESKIP_WINDOW) {
+        Frameskip.last_window_skipped = Frameskip.window_skipped;
+        Frameskip.window_skipped = Frameskip.window_frames = 0;
+    }
+}
+
+// Aggregate frame timings, so that changes affecting the emulation
+// speed by a few percent (like memory placement) can be measured.
+#define TIMING_FRAMES 50
+void update_timing_stats(uint64_t exec_time, uint64_t update_time,
+                         uint32_t ticks)
+{
+    if (EMU.timing.frames == 0) {
+        EMU.timing.exec_sum = EMU.timing.update_sum = 0;
+        EMU.timing.ticks_sum = 0;
+        EMU.timing.exec_min = UINT64_MAX;
+        EMU.timing.exec_max = 0;
+    }
+    EMU.timing.exec_sum += exec_time;
+    EMU.timing.update_sum += update_time;
+    EMU.timing.ticks_sum += ticks;
+    if (exec_time < EMU.timing.exec_min) EMU.timing.exec_min = exec_time;
+    if (exec_time > EMU.timing.exec_max) EMU.timing.exec_max = exec_time;
+    if (++EMU.timing.frames == TIMING_FRAMES) {
+        printf("[timing] zx avg:%llu min:%llu max:%llu us, "
+               "display avg:%llu us, skipped %u of the last %u\n",
+            EMU.timing.exec_sum/TIMING_FRAMES,
+            EMU.timing.exec_min, EMU.timing.exec_max,
+            EMU.timing.update_sum/TIMING_FRAMES,
+            (unsigned)Frameskip.last_window_skipped, FRAMESKIP_WINDOW);
+
+        // Cost per T-state: the 48K and 128K models run a different
+        // number of T-states per frame, so exec times can't be compared
+        // directly.
+        if (EMU.timing.ticks_sum) {
+            float ns = (float)EMU.timing.exec_sum*1000/EMU.timing.ticks_sum;
+            if (EMU.zx.type == ZX_TYPE_48K) {
+                EMU.timing.ns_per_tick_48k = ns;
+                printf("[timing] 48K: %.2f ns/T-state\n", ns);
+            } else {
+                printf("[timing] 128K: %.2f ns/T-state (%.3fx 48K)\n", ns,
+                    EMU.timing.ns_per_tick_48k ?
+                        ns/EMU.timing.ns_per_tick_48k : 0);
+            }
+        }
 
-                // Stop if there was a buffer overrun. Very unlikely.
-                // if (EMU.zx.audiobuf_notify != 0) goto stoploop;
+        // Core1: the frames it could draw out of the ones emulated, that
+        // is the real display refresh rate, and the cost of the audio
+        // interrupt, AY synthesis included.
+        absolute_time_t now = get_absolute_time();
+        uint64_t elapsed = now - EMU.timing.last_print;
+        uint32_t rendered = Render.rendered - EMU.timing.rendered;
+        uint32_t render_us = Render.render_us - EMU.timing.render_us;
+        uint32_t rows = RowTiming.rows - EMU.timing.rows;
+        uint32_t rows_us = RowTiming.us - EMU.timing.rows_us;
+        uint32_t irqs = Audio.irqs - EMU.timing.audio_irqs;
+        uint32_t irq_us = Audio.irq_us - EMU.timing.audio_us;
+        uint32_t te_frames = TESync.frames - EMU.timing.te_frames;
+        uint32_t te_late = TESync.late - EMU.timing.te_late;
+        uint32_t te_wait_us = TESync.wait_us - EMU.timing.te_wait_us;
+        if (EMU.timing.last_print) {
+            printf("[timing] render: %u frames drawn, %.1f FPS, "
+                   "avg:%u us (core1), %.2f us per row converted\n",
+                (unsigned)rendered, rendered*1000000.0/elapsed,
+                (unsigned)(rendered ? render_us/rendered : 0),
+                rows ? (float)rows_us/rows : 0);
+            if (irqs) {
+                printf("[timing] audio: %u ns per sample (%u%% core1), "
+                       "%u underruns, %u skips, %u AY writes dropped\n",
+                    (unsigned)((uint64_t)irq_us*1000/irqs),
+                    (unsigned)((uint64_t)irq_us*100/elapsed),
+                    (unsigned)Audio.underruns, (unsigned)Audio.skips,
+                    (unsigned)zx_ay_queue.dropped);
+            }
+            if (st77_te != -1) {
+                printf("[timing] TE: %.1f Hz refresh, avg:%u us waiting "
+                       "per frame, %u of %u frames too slow to be tear "
+                       "free\n",
+                    st77_te_period ? 1000000.0/st77_te_period : 0,
+                    (unsigned)(te_frames ? te_wait_us/te_frames : 0),
+                    (unsigned)te_late, (unsigned)te_frames);
             }
         }
-        stoploop:
-        end = get_absolute_time();
-        if (EMU.debug)
-            printf("[playback] with pause=%u playing took %llu [notify:%u]\n",
-                EMU.audio_sample_wait, end-start, EMU.zx.audiobuf_notify);
+        EMU.timing.last_print = now;
+        EMU.timing.rendered += rendered;
+        EMU.timing.render_us += render_us;
+        EMU.timing.rows += rows;
+        EMU.timing.rows_us += rows_us;
+        EMU.timing.audio_irqs += irqs;
+        EMU.timing.audio_us += irq_us;
+        EMU.timing.te_frames += te_frames;
+        EMU.timing.te_late += te_late;
+        EMU.timing.te_wait_us += te_wait_us;
+
+        // Frame pacing: how regular the 50 Hz frames are, and how late
+        // they start compared to the schedule.
+        if (Pacing.periods) {
+            printf("[timing] pace: frame %u us, min:%llu max:%llu "
+                   "jitter:%llu us, drift:%lld max:%llu us, %u resyncs\n",
+                (unsigned)(Pacing.frame_ns/1000),
+                Pacing.period_min, Pacing.period_max,
+                Pacing.jitter_sum/Pacing.periods,
+                Pacing.drift, Pacing.drift_max,
+                (unsigned)Pacing.resyncs);
+            Pacing.periods = 0;
+            Pacing.period_min = UINT64_MAX;
+            Pacing.period_max = Pacing.jitter_sum = Pacing.drift_max = 0;
+        }
+        EMU.timing.frames = 0;
     }
 }
 
@@ -1312,32 +3256,42 @@ int main() {
     init_emulator();
     st77xx_fill(0);
 
+    // From now on the display is driven by core1, that plays the audio
+    // too. See the "Render pipeline" section.
+    render_init();
+    multicore_launch_core1_with_stack(core1_main,
+        core1_stack, sizeof(core1_stack));
+
     // If we fail to populate the game list, the user failed to flash
     // the games image in the flash. Let's make they aware.
     if (populate_games_list() == 0) {
         int frame = 0;
         while(1) {
             frame++;
-            zx_exec(&EMU.zx, FRAME_USEC);
+            zx_exec_frame(&EMU.zx);
             if (frame > 30) {
                 ui_draw_string(0,0,"PLEASE LOAD",1,2);
                 ui_draw_string(0,20,"GAMES SNAPSHOTS",1,2);
                 ui_draw_string(0,40,"CHECK README :)",1,2);
             }
-            update_display(EMU.scaling,EMU.show_border,0);
+            render_submit(0);
             printf("PLEASE LOAD GAMES SNAPSHOTS\n");
         }
     }
 
+    // Find the save states in flash. Still at base clock, since
+    // we need to access the flash.
+    savestate_init();
+
     // Go to full speed and load the first game in the list.
-    set_sys_clock_khz(EMU.emu_clock, false); sleep_us(50);
+    set_emulator_clock(EMU.emu_clock);
     load_game(EMU.selected_game);
 
-    // Start the audio thread.
-    if (SPEAKER_PIN != -1) multicore_launch_core1(core1_play_audio);
+    pacing_init();
 
     // Our emulation main loop.
     uint32_t blink = 0;
+    int menu_was_active = EMU.menu_active;
     while (true) {
         absolute_time_t start, zx_exec_time, update_time;
 
@@ -1347,27 +3301,49 @@ int main() {
         if (EMU.menu_active) {
             uint32_t ui_event = ui_handle_key_press();
             switch(ui_event) {
-            case UI_EVENT_VOLUME:
-                set_volume(EMU.volume);
-                break;
             case UI_EVENT_BRIGHTNESS:
                 st77xx_set_brightness(EMU.brightness);
                 break;
             case UI_EVENT_SCALING:
                 vram_force_dirty();
+                render_wait_idle();
                 st77xx_fill(0);
                 break;
             case UI_EVENT_BORDER:
+            case UI_EVENT_SMOOTH:
             case UI_EVENT_PARTIAL:
                 vram_force_dirty();
                 break;
+            case UI_EVENT_BEAM:
+                set_beam_mode(EMU.beam);
+                break;
+            case UI_EVENT_RGB444:
+                // Core1 must not draw while the palette and the smooth
+                // pairs (see render_setup()) change format.
+                render_wait_idle();
+                EMU.rgb444 = st77xx_set_pixel_bits(EMU.rgb444 ? 12 : 16) == 12;
+                palette_init();
+                Geometry.valid = 0;
+                break;
             case UI_EVENT_CLOCK:
-                set_sys_clock_khz(EMU.emu_clock, false);
+                set_emulator_clock(EMU.emu_clock);
                 break;
             }
             if (ui_event != UI_EVENT_NONE) vram_force_dirty();
+            EMU.rewinding = 0;
+        } else {
+            EMU.rewinding = handle_hotkeys();
         }
 
+        // When the menu is opened, erase the flash sectors for the next
+        // save state, so that saving during the game is faster.
+        if (EMU.menu_active && !menu_was_active) {
+            set_emulator_clock(EMU.base_clock);
+            savestate_prepare();
+            set_emulator_clock(EMU.emu_clock);
+        }
+        menu_was_active = EMU.menu_active;
+
         // If the game selection menu is active or just dismissed, we
         // just handle automatic keypresses.
         int kflags = HANDLE_KEYPRESS_ALL;
@@ -1375,16 +3351,33 @@ int main() {
             kflags = HANDLE_KEYPRESS_MACRO;
         handle_zx_key_press(&EMU.zx, EMU.keymap, EMU.tick, kflags);
 
-        // Run the Spectrum VM for a few ticks.
+        // Run the Spectrum VM for a few ticks. While the rewind chord
+        // is held, go back one step every frame instead.
         start = get_absolute_time();
-        zx_exec(&EMU.zx, FRAME_USEC);
+        uint32_t ticks = 0;
+        if (EMU.rewinding) {
+            rewind_step();
+        } else {
+            set_frame_timing();
+            ticks = zx_exec_frame(&EMU.zx);
+        }
         zx_exec_time = get_absolute_time()-start;
+        if (EMU.zx.tape_trap) tape_service();
+        if (!EMU.rewinding && !EMU.menu_active) rewind_capture();
+#ifdef ZX_MEM_PROFILE
+        memprof_report();
+#endif
 
         // In debug mode, show the frame number. Useful in order to
-        // find the right timing for automatic key presses.
+        // find the right timing for automatic key presses. Also show
+        // how many frames were not drawn in the last FRAMESKIP_WINDOW
+        // frames, if any.
         if (EMU.debug) {
             char buf[32];
-            int len = snprintf(buf,sizeof(buf),"%d",(int)EMU.tick);
+            int len = Frameskip.last_window_skipped ?
+                snprintf(buf,sizeof(buf),"%d S%u",(int)EMU.tick,
+                    (unsigned)Frameskip.last_window_skipped) :
+                snprintf(buf,sizeof(buf),"%d",(int)EMU.tick);
             ui_set_area_attributes(0,0,16*len,16);
             ui_fill_box(0,0,16*len,16,0,0);
             ui_draw_string(0,0,buf,1,2);
@@ -1395,16 +3388,40 @@ int main() {
             ui_draw_menu();
         }
 
-        // Update the display with the current CRT image.
+        // On the 128K the screen may move to the shadow bank, or be
+        // written at addresses the memory tracking does not see: in such
+        // cases just refresh it all. The same when switching between the
+        // video RAM and the beam screen, but in beam mode the copy itself
+        // tracks the changes.
+        static const uint8_t *last_vmem = NULL;
+        if (display_vmem() != last_vmem ||
+            (zx_display_untracked(&EMU.zx) && !EMU.zx.beam_screen))
+        {
+            last_vmem = display_vmem();
+            vram_force_dirty();
+        }
+
+        // Send the current CRT image to the display, unless turbo or
+        // fast forward say otherwise: the dirty rows accumulate
+        // meanwhile, so the skipped changes are not lost.
         start = get_absolute_time();
-        update_display(EMU.scaling,EMU.show_border,blink&0x8);
+        ffwd_frame();
+        int skipped = 1;
+        if (frameskip_display_due()) {
+            if (ffwd_active()) ffwd_overlay_draw();
+            skipped = render_submit(blink&0x8);
+            ffwd_overlay_remove();
+        }
         update_time = get_absolute_time()-start;
         blink++;
 
         EMU.tick++;
         printf("display: %llu us, zx(%u): %llu us, FPS: %.1f\n",
             update_time,
-            FRAME_USEC, zx_exec_time,
+            (unsigned)ticks, zx_exec_time,
             1000000.0/(float)(zx_exec_time+update_time));
+        update_timing_stats(zx_exec_time, update_time, ticks);
+        frameskip_account(skipped);
+        pacing_wait();
     }
 }
@@ -69,17 +69,24 @@ extern "C" {
 #endif
 
 // bump this whenever the zx_t struct layout changes
-#define ZX_SNAPSHOT_VERSION (0x0001)
+#ifdef ZX_COMPACT_STATE
+#define ZX_SNAPSHOT_VERSION (0x010D)
+#else
+#define ZX_SNAPSHOT_VERSION (0x000D)
+#endif
 
 #define ZX_FRAMEBUFFER_WIDTH (320/2) // 4 bits per pixel.
 #define ZX_FRAMEBUFFER_HEIGHT (256)
 #define ZX_FRAMEBUFFER_SIZE_BYTES (ZX_FRAMEBUFFER_WIDTH * ZX_FRAMEBUFFER_HEIGHT)
 #define ZX_DISPLAY_WIDTH (320)
 #define ZX_DISPLAY_HEIGHT (256)
+// lines of the border log: 32 of top border, the bitmap, 32 of bottom border
+#define ZX_BORDER_LOG_LINES (ZX_DISPLAY_HEIGHT)
 
 // ZX Spectrum models
 typedef enum {
     ZX_TYPE_48K,
+    ZX_TYPE_128,
 } zx_type_t;
 
 // ZX Spectrum joystick types
@@ -105,11 +112,41 @@ typedef struct {
     struct {
         // ZX Spectrum 48K
         chips_range_t zx48k;
+        // ZX Spectrum 128K
+        chips_range_t zx128_0;
+        chips_range_t zx128_1;
     } roms;
+    // 128K only: RAM banks 1, 3, 4, 6, 7 (in this order), 5*16k bytes.
+    // Banks 5, 2, 0 are in zx_t, so the 48K model needs no extra memory.
+    chips_range_t ram_ext;
+    // 1 bit audio samples buffer of AUDIOBUF_LEN 32 bit words. It is
+    // provided by the caller, so that it can be placed in the memory
+    // bank it prefers. The player follows audio_sample, see below.
+    chips_range_t audiobuf;
+    // Optional: AY register writes are sent to this queue, to be
+    // synthesized by the core playing the audio. NULL means no AY.
+    ay38910_queue_t* ay_queue;
 } zx_desc_t;
 
-// ZX emulator state
+// tape image (TAP or TZX), loaded one block at a time by trapping the
+// ROM LD-BYTES routine, see zx_tape_trap()
 typedef struct {
+    const uint8_t* ptr;         // tape image, NULL if no tape is inserted
+    uint32_t size;
+    uint32_t pos;               // offset of the next block
+    bool tzx;                   // TZX image, otherwise TAP
+} zx_tape_t;
+
+struct zx_t;
+
+// I/O port handler, called for the IORQ read or write cycles of the
+// ports it was registered for with zx_io_register(): returns the pins,
+// with the data bus set on reads
+typedef uint64_t (*zx_io_handler_t)(struct zx_t* sys, uint64_t pins);
+#define ZX_IO_MAX_HANDLERS (8)
+
+// ZX emulator state
+typedef struct zx_t {
     z80_t cpu;
     zx_type_t type;
     zx_joystick_type_t joystick_type;
@@ -126,26 +163,58 @@ typedef struct {
     int scanline_period;
     int scanline_counter;
     int scanline_y;
+    // Real T-states timing, used by zx_exec_frame().
+    int scanline_tstates;       // 224 (48K) or 228 (128K)
+    uint32_t frame_tstates;     // 69888 (48K) or 70908 (128K)
+    uint32_t frame_end;         // cpu.tstates at the end of the current frame
+    uint32_t audio_tstates;     // cpu.tstates at the next audio sample
 
     // Audio state: this is RP2040 specific code. We sample the speaker
     // value in a bitmap (audiobuf), since anyway the Spectrum sound is
-    // 1 bit, even if at high resolution.
-#define AUDIOBUF_LEN 256 // Must be power of 2
+    // 1 bit, even if at high resolution. Sample N is bit N%32 of word
+    // (N/32)%AUDIOBUF_LEN: the player on the other core reads the samples
+    // before audio_sample, as long as they are not older than the buffer.
+#define AUDIOBUF_LEN 512 // Must be power of 2
+#define ZX_AUDIO_TICKS_PER_SAMPLE 16 // Must be power of 2
     int beeper_state;           // Last value written to the speaker bit.
-    uint32_t audiobuf[AUDIOBUF_LEN];    // 1 bit samples audio buffer.
-    uint32_t audiobuf_byte;             // Current byte to write.
-    uint32_t audiobuf_bit;              // Current bit to write.
-    volatile uint32_t audiobuf_notify;  // Just a brutal inter-process signal.
+    uint32_t *audiobuf;                 // 1 bit samples audio buffer.
+    uint32_t audio_sample;              // Samples taken since zx_init().
+
+    // AY-3-8910, on the 128K and on 48K Melodik / Fuller Box ports. The
+    // registers are mirrored here for reads and snapshots, the sound is
+    // made by the audio core from the writes queue.
+    uint8_t ay_addr;                    // Selected register.
+    uint8_t ay_regs[16];
+    bool ay_used;                       // Written by the guest since reset.
+    ay38910_queue_t* ay_queue;
 
     int int_counter;
+    zx_tape_t tape;
+    bool tape_trap;             // CPU parked at LD-BYTES, see zx_tape_trap()
     uint32_t display_ram_bank;
     kbd_t kbd;
     mem_t mem;
+    bool valid;
     uint64_t pins;
     uint64_t freq_hz;
-    bool valid;
-    uint8_t ram[3][0x4000];
-    uint8_t rom[1][0x4000];
+    uint8_t ram[3][0x4000];     // Banks 5, 2, 0: 0x4000-0xFFFF in 48K mode.
+                                // Word aligned, since it follows freq_hz.
+    uint8_t* ram_ext;           // 128K: banks 1, 3, 4, 6, 7 from zx_desc_t.
+    uint8_t* beam_screen;       // see zx_set_beam_screen(), or NULL
+    uint8_t* border_log;        // see zx_set_border_log(), or NULL
+#ifdef ZX_COMPACT_STATE
+    // The ROM images are mapped in place from the zx_desc_t ranges, that
+    // must stay valid for the lifetime of the emulator: 16/32k saved.
+    const uint8_t* rom[2];
+#else
+    uint8_t rom[2][0x4000];
+#endif
+    // I/O dispatch, by port low byte, for reads [0] and writes [1]:
+    // index of the handler, 0 means no device. It is configuration
+    // rather than state: snapshot loads leave it as it is.
+    uint8_t io_map[2][256];
+    zx_io_handler_t io_handler[ZX_IO_MAX_HANDLERS];
+    uint8_t io_handlers;        // used io_handler[] entries, 0 is reserved
 } zx_t;
 
 // initialize a new ZX Spectrum instance
@@ -154,10 +223,35 @@ void zx_init(zx_t* sys, const zx_desc_t* desc);
 void zx_discard(zx_t* sys);
 // reset a ZX Spectrum instance
 void zx_reset(zx_t* sys);
+// handle the I/O ports whose low byte matches 'value' under 'mask', reads and/or writes,
+// unless already taken by a device registered before (the built-in ones are registered by
+// zx_init()), returns false if there are already ZX_IO_MAX_HANDLERS devices
+bool zx_io_register(zx_t* sys, uint8_t mask, uint8_t value, bool rd, bool wr, zx_io_handler_t handler);
+// return the RAM bank (0-7) memory, bank 5, 2, 0 are always present
+uint8_t* zx_ram_bank(zx_t* sys, int bank);
+// return the RAM of the displayed screen (bank 5, or 7 on the 128K)
+uint8_t* zx_display_ram(zx_t* sys);
+// true if the screen memory may be written with no vram_set_dirty_*() call
+bool zx_display_untracked(zx_t* sys);
+// copy every bitmap line of the screen into 'screen' (6912 bytes, same layout
+// of the video RAM) when the emulated beam completes it, NULL to stop
+void zx_set_beam_screen(zx_t* sys, uint8_t* screen);
+// store the border color of each visible line into 'log' (ZX_BORDER_LOG_LINES
+// bytes) when the emulated beam completes it, NULL to stop
+void zx_set_border_log(zx_t* sys, uint8_t* log);
 // query information about display requirements, can be called with nullptr
 chips_display_info_t zx_display_info(zx_t* sys);
 // run ZX Spectrum instance for a given number of microseconds, return number of ticks
 uint32_t zx_exec(zx_t* sys, uint32_t micro_seconds);
+// run ZX Spectrum instance for exactly one frame of real T-states (carrying the
+// overshoot of the last instruction to the next frame), return the T-states executed
+uint32_t zx_exec_frame(zx_t* sys);
+// duration of a real frame of the model, in nanoseconds
+uint32_t zx_frame_ns(zx_t* sys);
+// scale the real scanline length by num/den, and so the length of the zx_exec_frame() frames
+void zx_set_scanline_scale(zx_t* sys, int num, int den);
+// T-states run per second when zx_exec_frame() is called once every zx_frame_ns()
+uint32_t zx_paced_freq_hz(zx_t* sys);
 // send a key-down event
 void zx_key_down(zx_t* sys, int key_code);
 // send a key-up event
@@ -170,10 +264,29 @@ zx_joystick_type_t zx_joystick_type(zx_t* sys);
 void zx_joystick(zx_t* sys, uint8_t mask);
 // load a ZX Z80 file into the emulator
 bool zx_quickload(zx_t* sys, chips_range_t data);
+// return the model a ZX Z80 file is for
+zx_type_t zx_quickload_type(chips_range_t data);
+// load a 48K .SNA file into the emulator
+bool zx_quickload_sna(zx_t* sys, chips_range_t data);
+// insert a TAP or TZX tape image, that must stay valid while inserted
+bool zx_tape_insert(zx_t* sys, chips_range_t data);
+// remove the tape
+void zx_tape_eject(zx_t* sys);
+// return true if there are more data blocks in the tape
+bool zx_tape_has_blocks(zx_t* sys);
+// when sys->tape_trap is set, complete the LD-BYTES call with the next block
+bool zx_tape_trap(zx_t* sys);
 // save a snapshot, patches any pointers to zero, returns a snapshot version
 uint32_t zx_save_snapshot(zx_t* sys, zx_t* dst);
 // load a snapshot, returns false if snapshot version doesn't match
 bool zx_load_snapshot(zx_t* sys, uint32_t version, zx_t* src);
+// size of the state saved by zx_save_snapshot_state()
+#define ZX_SNAPSHOT_STATE_SIZE (offsetof(zx_t, ram))
+// like zx_save_snapshot() but without the RAM banks, that the caller saves
+// on its own: 'dst' must be ZX_SNAPSHOT_STATE_SIZE bytes, word aligned
+uint32_t zx_save_snapshot_state(zx_t* sys, void* dst);
+// load a state saved by zx_save_snapshot_state(), RAM banks untouched
+bool zx_load_snapshot_state(zx_t* sys, uint32_t version, const void* src);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -188,11 +301,21 @@ bool zx_load_snapshot(zx_t* sys, uint32_t version, zx_t* src);
 #endif
 
 static void _zx_init_memory_map(zx_t* sys);
+static void _zx_update_memory_map(zx_t* sys);
 static void _zx_init_keyboard_matrix(zx_t* sys);
+static void _zx_ay_reset(zx_t* sys);
+static void _zx_init_io_map(zx_t* sys);
+static void _zx_ay_resync(zx_t* sys);
 
 #define _ZX_DEFAULT(val,def) (((val) != 0) ? (val) : (def))
 
 #define _ZX_48K_FREQUENCY (3500000)
+#define _ZX_128_FREQUENCY (3546894)
+#define _ZX_48K_SCANLINE_TSTATES (224)
+#define _ZX_128_SCANLINE_TSTATES (228)
+#define _ZX_LD_BYTES (0x0556)       // ROM tape loading routine
+#define _ZX_LD_BYTES_RET (0x05E2)   // RET at the end of LD-BYTES
+#define _ZX_IO_ULA (1)              // io_map value of the ULA, see _zx_tick()
 
 void zx_init(zx_t* sys, const zx_desc_t* desc) {
     CHIPS_ASSERT(sys && desc);
@@ -201,28 +324,58 @@ void zx_init(zx_t* sys, const zx_desc_t* desc) {
     sys->valid = true;
     sys->type = desc->type;
     sys->joystick_type = desc->joystick_type;
-    sys->freq_hz = _ZX_48K_FREQUENCY;
 
     // initalize the hardware
     sys->border_color = 0;
-    CHIPS_ASSERT(desc->roms.zx48k.ptr && (desc->roms.zx48k.size == 0x4000));
-    memcpy(sys->rom[0], desc->roms.zx48k.ptr, 0x4000);
-    sys->display_ram_bank = 0;
-    sys->frame_scan_lines = 312;
-    sys->top_border_scanlines = 64;
-    sys->scanline_period = 224; // This value is modified in zx.c
+    sys->display_ram_bank = 5;
+    if (sys->type == ZX_TYPE_128) {
+        CHIPS_ASSERT(desc->roms.zx128_0.ptr && (desc->roms.zx128_0.size == 0x4000));
+        CHIPS_ASSERT(desc->roms.zx128_1.ptr && (desc->roms.zx128_1.size == 0x4000));
+        CHIPS_ASSERT(desc->ram_ext.ptr && (desc->ram_ext.size == 5*0x4000));
+#ifdef ZX_COMPACT_STATE
+        sys->rom[0] = desc->roms.zx128_0.ptr;
+        sys->rom[1] = desc->roms.zx128_1.ptr;
+#else
+        memcpy(sys->rom[0], desc->roms.zx128_0.ptr, 0x4000);
+        memcpy(sys->rom[1], desc->roms.zx128_1.ptr, 0x4000);
+#endif
+        sys->ram_ext = desc->ram_ext.ptr;
+        memset(sys->ram_ext, 0, desc->ram_ext.size);
+        sys->freq_hz = _ZX_128_FREQUENCY;
+        sys->frame_scan_lines = 311;
+        sys->top_border_scanlines = 63;
+        sys->scanline_period = 228; // This value is modified in zx.c
+        sys->scanline_tstates = _ZX_128_SCANLINE_TSTATES;
+    }
+    else {
+        CHIPS_ASSERT(desc->roms.zx48k.ptr && (desc->roms.zx48k.size == 0x4000));
+#ifdef ZX_COMPACT_STATE
+        sys->rom[0] = desc->roms.zx48k.ptr;
+#else
+        memcpy(sys->rom[0], desc->roms.zx48k.ptr, 0x4000);
+#endif
+        sys->freq_hz = _ZX_48K_FREQUENCY;
+        sys->frame_scan_lines = 312;
+        sys->top_border_scanlines = 64;
+        sys->scanline_period = 224; // This value is modified in zx.c
+        sys->scanline_tstates = _ZX_48K_SCANLINE_TSTATES;
+    }
     sys->scanline_counter = sys->scanline_period;
+    sys->frame_tstates = sys->scanline_tstates * sys->frame_scan_lines;
 
     sys->pins = z80_init(&sys->cpu);
 
     _zx_init_memory_map(sys);
     _zx_init_keyboard_matrix(sys);
+    _zx_init_io_map(sys);
 
     // Audio initialization
-    memset(sys->audiobuf,0,sizeof(sys->audiobuf));
-    sys->audiobuf_byte = 0;
-    sys->audiobuf_bit = 0;
-    sys->audiobuf_notify = 0;
+    CHIPS_ASSERT(desc->audiobuf.ptr &&
+        (desc->audiobuf.size == AUDIOBUF_LEN*sizeof(uint32_t)));
+    sys->audiobuf = desc->audiobuf.ptr;
+    memset(sys->audiobuf,0,desc->audiobuf.size);
+    sys->ay_queue = desc->ay_queue;
+    _zx_ay_reset(sys);
 }
 
 void zx_discard(zx_t* sys) {
@@ -240,22 +393,263 @@ void zx_reset(zx_t* sys) {
     sys->scanline_counter = sys->scanline_period;
     sys->scanline_y = 0;
     sys->blink_counter = 0;
-    sys->display_ram_bank = 0;
+    sys->last_mem_config = 0;
+    sys->display_ram_bank = 5;
     _zx_init_memory_map(sys);
+    _zx_ay_reset(sys);
+}
+
+uint8_t* zx_ram_bank(zx_t* sys, int bank) {
+    switch (bank) {
+        case 5: return sys->ram[0];
+        case 2: return sys->ram[1];
+        case 0: return sys->ram[2];
+    }
+    CHIPS_ASSERT(sys->ram_ext && (bank >= 0) && (bank < 8));
+    // banks 1, 3, 4, 6, 7
+    static const uint8_t ext_index[8] = { 0, 0, 0, 1, 2, 0, 3, 4 };
+    return sys->ram_ext + ext_index[bank]*0x4000;
+}
+
+uint8_t* zx_display_ram(zx_t* sys) {
+    return zx_ram_bank(sys, sys->display_ram_bank);
+}
+
+bool zx_display_untracked(zx_t* sys) {
+    // mem.h only tracks writes at 0x4000-0x5AFF: the shadow screen in
+    // bank 7, or bank 5 paged at 0xC000 too, are written elsewhere
+    if (sys->type != ZX_TYPE_128) {
+        return false;
+    }
+    const uint8_t c000_bank = sys->last_mem_config & 7;
+    return (sys->display_ram_bank == 7) || (c000_bank == 5);
+}
+
+static void _zx_ay_reset(zx_t* sys) {
+    sys->ay_addr = 0;
+    memset(sys->ay_regs, 0, sizeof(sys->ay_regs));
+    sys->ay_regs[7] = 0xFF; // all channels disabled
+    sys->ay_used = false;
+    if (sys->ay_queue) {
+        ay38910_queue_push(sys->ay_queue, sys->audio_sample, AY38910_QUEUE_RESET, 0);
+    }
+}
+
+// after a snapshot load: bring the audio core chip in line with ay_regs.
+// The register writes activate the synthesis there, so they are only
+// queued if the guest ever wrote the AY: otherwise the reset is enough.
+static void _zx_ay_resync(zx_t* sys) {
+    if (!sys->ay_queue) {
+        return;
+    }
+    ay38910_queue_push(sys->ay_queue, sys->audio_sample, AY38910_QUEUE_RESET, 0);
+    if (!sys->ay_used) {
+        return;
+    }
+    for (uint8_t reg = 0; reg < 14; reg++) {
+        ay38910_queue_push(sys->ay_queue, sys->audio_sample, reg, sys->ay_regs[reg]);
+    }
+}
+
+/* Spectrum ULA (...............0)
+    Bits 5 and 7 as read by INning from Port 0xfe are always one
+*/
+static inline uint64_t _zx_io_ula(zx_t* sys, uint64_t pins) {
+    if (pins & Z80_RD) {
+        // read from ULA
+        uint8_t data = (1<<7)|(1<<5);
+        // MIC/EAR flags -> bit 6
+        if (sys->last_fe_out & (1<<3|1<<4)) {
+            data |= (1<<6);
+        }
+        // keyboard matrix bits are encoded in the upper 8 bit of the port address
+        uint16_t column_mask = (~(Z80_GET_ADDR(pins)>>8)) & 0x00FF;
+        const uint16_t kbd_lines = kbd_test_lines(&sys->kbd, column_mask);
+        data |= (~kbd_lines) & 0x1F;
+        Z80_SET_DATA(pins, data);
+    }
+    else {
+        // write to ULA
+        // FIXME: bit 3: MIC output (CAS SAVE, 0=On, 1=Off)
+        const uint8_t data = Z80_GET_DATA(pins);
+        sys->border_color = data & 7;
+        sys->last_fe_out = data;
+
+        // Replicate the Z80 audio pin status on the global state
+        // so we can sample it at regular intervals.
+        sys->beeper_state = 0 != (data & (1<<4));
+    }
+    return pins;
+}
+
+// Kempston Joystick (........000.....), reads only
+static uint64_t _zx_io_kempston(zx_t* sys, uint64_t pins) {
+    Z80_SET_DATA(pins, sys->kbd_joymask | sys->joy_joymask);
+    return pins;
+}
+
+static void _zx_ay_write(zx_t* sys, uint8_t data) {
+    sys->ay_regs[sys->ay_addr] = data;
+    sys->ay_used = true;
+    if (sys->ay_queue) {
+        ay38910_queue_push(sys->ay_queue, sys->audio_sample, sys->ay_addr, data);
+    }
+}
+
+// AY on the 128K and Melodik ports: register select / read at
+// 11............0., register write at 10............0.
+static uint64_t _zx_io_ay(zx_t* sys, uint64_t pins) {
+    if ((pins & (Z80_A15|Z80_A14)) == (Z80_A15|Z80_A14)) {
+        if (pins & Z80_WR) {
+            sys->ay_addr = Z80_GET_DATA(pins) & 0x0F;
+        } else {
+            Z80_SET_DATA(pins, sys->ay_regs[sys->ay_addr]);
+        }
+    }
+    else if ((pins & (Z80_WR|Z80_A15)) == (Z80_WR|Z80_A15)) {
+        _zx_ay_write(sys, Z80_GET_DATA(pins));
+    }
+    return pins;
+}
+
+// 128K: same ports of the AY, plus memory paging (0.............0.),
+// where just page pointers are updated, nothing is copied
+static uint64_t _zx_io_128(zx_t* sys, uint64_t pins) {
+    if (pins & Z80_A15) {
+        return _zx_io_ay(sys, pins);
+    }
+    if ((pins & Z80_WR) && !sys->memory_paging_disabled) {
+        sys->last_mem_config = Z80_GET_DATA(pins);
+        _zx_update_memory_map(sys);
+    }
+    return pins;
+}
+
+// Fuller Box AY: register select / read at 0x3F, register write at 0x5F.
+// Registered once for both (...0...11111), the other two ports decoded
+// the same way, 0x1F and 0x7F, are ignored.
+static uint64_t _zx_io_fuller(zx_t* sys, uint64_t pins) {
+    const uint8_t port = pins & 0xFF;
+    if (port == 0x5F) {
+        if (pins & Z80_WR) {
+            _zx_ay_write(sys, Z80_GET_DATA(pins));
+        }
+    } else if (port == 0x3F) {
+        if (pins & Z80_WR) {
+            sys->ay_addr = Z80_GET_DATA(pins) & 0x0F;
+        } else {
+            Z80_SET_DATA(pins, sys->ay_regs[sys->ay_addr]);
+        }
+    }
+    return pins;
+}
+
+bool zx_io_register(zx_t* sys, uint8_t mask, uint8_t value, bool rd, bool wr, zx_io_handler_t handler) {
+    CHIPS_ASSERT(sys && handler);
+    if (sys->io_handlers == ZX_IO_MAX_HANDLERS) {
+        return false;
+    }
+    const uint8_t dev = sys->io_handlers++;
+    sys->io_handler[dev] = handler;
+    for (int port = 0; port < 256; port++) {
+        if ((port & mask) != value) {
+            continue;
+        }
+        if (rd && (sys->io_map[0][port] == 0)) {
+            sys->io_map[0][port] = dev;
+        }
+        if (wr && (sys->io_map[1][port] == 0)) {
+            sys->io_map[1][port] = dev;
+        }
+    }
+    return true;
+}
+
+// register the built-in devices, the first registered wins where the
+// decoded ports overlap
+static void _zx_init_io_map(zx_t* sys) {
+    memset(sys->io_map, 0, sizeof(sys->io_map));
+    memset(sys->io_handler, 0, sizeof(sys->io_handler));
+    sys->io_handlers = _ZX_IO_ULA;
+    zx_io_register(sys, 0x01, 0x00, true, true, _zx_io_ula);
+    zx_io_register(sys, 0xE1, 0x01, true, false, _zx_io_kempston);
+    zx_io_register(sys, 0x03, 0x01, true, true,
+                   (sys->type == ZX_TYPE_128) ? _zx_io_128 : _zx_io_ay);
+    zx_io_register(sys, 0x9F, 0x1F, true, true, _zx_io_fuller);
+}
+
+void zx_set_beam_screen(zx_t* sys, uint8_t* screen) {
+    CHIPS_ASSERT(sys);
+    sys->beam_screen = screen;
+    if (screen) {
+        memcpy(screen, zx_display_ram(sys), 6912);
+    }
+}
+
+void zx_set_border_log(zx_t* sys, uint8_t* log) {
+    CHIPS_ASSERT(sys);
+    sys->border_log = log;
+    if (log) {
+        memset(log, sys->border_color, ZX_BORDER_LOG_LINES);
+    }
+}
+
+// The beam just completed the bitmap line 'y' (0-191): copy it into the
+// beam screen, with the attributes of its character row when starting
+// a new one. What changed since the previous frame is marked dirty.
+static void _zx_beam_capture(zx_t* sys, uint32_t y) {
+    const uint8_t* vmem = zx_display_ram(sys);
+    const uint32_t off = ((y & 0xC0)<<5) | ((y & 0x07)<<8) | ((y & 0x38)<<2);
+    const uint32_t* src = (const uint32_t*)(vmem + off);
+    uint32_t* dst = (uint32_t*)(sys->beam_screen + off);
+    bool changed = false;
+    for (int i = 0; i < 8; i++) {
+        if (dst[i] != src[i]) {
+            dst[i] = src[i];
+            changed = true;
+        }
+    }
+    if (changed) {
+        vram_set_dirty_bitmap(0x4000 + off);
+    }
+    if ((y & 7) == 0) {
+        const uint32_t attr_off = 0x1800 + ((y>>3)<<5);
+        src = (const uint32_t*)(vmem + attr_off);
+        dst = (uint32_t*)(sys->beam_screen + attr_off);
+        changed = false;
+        for (int i = 0; i < 8; i++) {
+            if (dst[i] != src[i]) {
+                dst[i] = src[i];
+                changed = true;
+            }
+        }
+        if (changed) {
+            vram_set_dirty_attr(0x4000 + attr_off);
+        }
+    }
 }
 
-static uint64_t _zx_tick(zx_t* sys, uint64_t pins) {
+// With 'exact' false the ULA advances by one cycle per z80_tick() call,
+// that may execute more than one T-state: this is the zx_exec() timing,
+// with scanline_period tuned by hand. With 'exact' true it advances by
+// the T-states the CPU really executed, see zx_exec_frame().
+static inline uint64_t _zx_tick(zx_t* sys, uint64_t pins, const bool exact) {
+    const uint32_t tstates = sys->cpu.tstates;
     pins = z80_tick(&sys->cpu, &sys->mem, pins);
+    const int elapsed = exact ? (int)(sys->cpu.tstates - tstates) : 1;
 
     // video decoding and vblank interrupt
-    if (--sys->scanline_counter <= 0) {
+    if ((sys->scanline_counter -= elapsed) <= 0) {
         // We don't do any actual video decoding: the emulator
         // reads directly from the Spectrum video RAM. Yet we
         // have to track which scanline our non-existing CRT
         // is decoding, and request the vertical blank interrupt
-        // when we are at the end.
-        sys->scanline_counter += sys->scanline_period;
-        if (sys->scanline_y++ >= sys->frame_scan_lines) {
+        // when we are at the end. The frame is frame_scan_lines
+        // long with real timings, the zx_exec() one has an extra
+        // line, and scanline_period is tuned with it.
+        sys->scanline_counter += exact ? sys->scanline_tstates :
+                                         sys->scanline_period;
+        if (sys->scanline_y++ >= sys->frame_scan_lines - exact) {
             // start new frame, request vblank interrupt
             sys->scanline_y = 0;
             sys->blink_counter++;
@@ -264,11 +658,21 @@ static uint64_t _zx_tick(zx_t* sys, uint64_t pins) {
             // hold the INT pin for 32 ticks
             sys->int_counter = 32;
         }
+        else {
+            const uint32_t y = sys->scanline_y - 1 - sys->top_border_scanlines;
+            if (sys->beam_screen && y < 192) {
+                _zx_beam_capture(sys, y);
+            }
+            // the log starts 32 lines before the bitmap (y wraps around)
+            if (sys->border_log && y+32 < ZX_BORDER_LOG_LINES) {
+                sys->border_log[y+32] = sys->border_color;
+            }
+        }
     }
 
     // clear INT pin after 32 ticks
     if (pins & Z80_INT) {
-        if (--sys->int_counter < 0) {
+        if ((sys->int_counter -= elapsed) < 0) {
             pins &= ~Z80_INT;
         }
     }
@@ -278,51 +682,45 @@ static uint64_t _zx_tick(zx_t* sys, uint64_t pins) {
         // FIXME: 'contended memory'
         const uint16_t addr = Z80_GET_ADDR(pins);
         if (pins & Z80_RD) {
+            if ((pins & Z80_M1) && addr == _ZX_LD_BYTES && sys->tape.ptr &&
+                ((sys->type == ZX_TYPE_48K) || (sys->last_mem_config & (1<<4))))
+            {
+                // park the CPU at LD-BYTES, fetching it again and again,
+                // until the caller loads the block with zx_tape_trap()
+                sys->tape_trap = true;
+                return z80_prefetch(&sys->cpu, _ZX_LD_BYTES) | (pins & Z80_INT);
+            }
             Z80_SET_DATA(pins, mem_rd(&sys->mem, addr));
         }
         else if (pins & Z80_WR) {
             mem_wr(&sys->mem, addr, Z80_GET_DATA(pins));
         }
     }
-    else if (pins & Z80_IORQ) {
-        if ((pins & Z80_A0) == 0) {
-            /* Spectrum ULA (...............0)
-                Bits 5 and 7 as read by INning from Port 0xfe are always one
-            */
-            if (pins & Z80_RD) {
-                // read from ULA
-                uint8_t data = (1<<7)|(1<<5);
-                // MIC/EAR flags -> bit 6
-                if (sys->last_fe_out & (1<<3|1<<4)) {
-                    data |= (1<<6);
-                }
-                // keyboard matrix bits are encoded in the upper 8 bit of the port address
-                uint16_t column_mask = (~(Z80_GET_ADDR(pins)>>8)) & 0x00FF;
-                const uint16_t kbd_lines = kbd_test_lines(&sys->kbd, column_mask);
-                data |= (~kbd_lines) & 0x1F;
-                Z80_SET_DATA(pins, data);
-            }
-            else if (pins & Z80_WR) {
-                // write to ULA
-                // FIXME: bit 3: MIC output (CAS SAVE, 0=On, 1=Off)
-                const uint8_t data = Z80_GET_DATA(pins);
-                sys->border_color = data & 7;
-                sys->last_fe_out = data;
-
-                // Replicate the Z80 audio pin status on the global state
-                // so we can sample it at regular intervals.
-                sys->beeper_state = 0 != (data & (1<<4));
-            }
+    else if ((pins & Z80_IORQ) && (pins & (Z80_RD|Z80_WR))) {
+        // I/O request: the low byte of the port selects the device in
+        // the table built by zx_io_register(), see _zx_init_io_map()
+        const uint8_t dev = sys->io_map[(pins & Z80_WR) != 0][pins & 0xFF];
+        if (dev == _ZX_IO_ULA) {
+            pins = _zx_io_ula(sys, pins);
         }
-        else if ((pins & (Z80_RD|Z80_A7|Z80_A6|Z80_A5)) == Z80_RD) {
-            // Kempston Joystick (........000.....)
-            Z80_SET_DATA(pins, sys->kbd_joymask | sys->joy_joymask);
+        else if (dev != 0) {
+            pins = sys->io_handler[dev](sys, pins);
         }
     }
 
     return pins;
 }
 
+// Sample the speaker bit into the audio bitmap. The audio core plays
+// behind us at its own pace, following audio_sample.
+static inline void _zx_audio_sample(zx_t* sys) {
+    const uint32_t word = (sys->audio_sample>>5) & (AUDIOBUF_LEN-1);
+    const uint32_t bit = sys->audio_sample & 31;
+    sys->audiobuf[word] = (sys->audiobuf[word] & ~(((uint32_t)1)<<bit)) |
+                          ((uint32_t)sys->beeper_state<<bit);
+    sys->audio_sample++;
+}
+
 uint32_t zx_exec(zx_t* sys, uint32_t micro_seconds) {
     CHIPS_ASSERT(sys && sys->valid);
     const uint32_t num_ticks = clk_us_to_ticks(sys->freq_hz, micro_seconds);
@@ -343,37 +741,92 @@ uint32_t zx_exec(zx_t* sys, uint32_t micro_seconds) {
     // to give them a bit of extra time, or less time if they start deleting
     // the old sprites too early.
     for (uint32_t tick = 0; tick < num_ticks || sys->scanline_y != last_bitmap_scanline; tick++) {
-        pins = _zx_tick(sys, pins);
+        pins = _zx_tick(sys, pins, false);
 
         // Audio buffer handling.
-        if (SPEAKER_PIN != -1 && !(tick & 0xf)) {
-            // Fill sample.
-            sys->audiobuf[sys->audiobuf_byte] &=
-                ~(((uint32_t)1)<<sys->audiobuf_bit);
-            sys->audiobuf[sys->audiobuf_byte] |=
-                sys->beeper_state<<sys->audiobuf_bit;
-
-            // Go to next byte/bit
-            sys->audiobuf_bit = (sys->audiobuf_bit+1) & 31; // Incr modulo 32.
-            if (sys->audiobuf_bit == 0)
-                sys->audiobuf_byte = (sys->audiobuf_byte+1) & (AUDIOBUF_LEN-1);
-
-            // Buffer full (back to zero after increment)? Set the timestamp
-            // and ping the other thread that plays the samples.
-            if ((sys->audiobuf_byte == 0 ||
-                 sys->audiobuf_byte == AUDIOBUF_LEN/2) &&
-                 sys->audiobuf_bit == 0)
-            {
-                // audiobuf_notify will be cleared by other thread.
-                sys->audiobuf_notify = sys->audiobuf_byte == 0 ? 2 : 1;
-            }
-        }
+        if (SPEAKER_PIN != -1 && !(tick & (ZX_AUDIO_TICKS_PER_SAMPLE-1)))
+            _zx_audio_sample(sys);
     }
     sys->pins = pins;
     kbd_update(&sys->kbd, micro_seconds);
     return num_ticks;
 }
 
+uint32_t zx_frame_ns(zx_t* sys) {
+    const uint64_t scanline_tstates = (sys->type == ZX_TYPE_128) ?
+        _ZX_128_SCANLINE_TSTATES : _ZX_48K_SCANLINE_TSTATES;
+    return (uint32_t)(scanline_tstates*sys->frame_scan_lines*1000000000/sys->freq_hz);
+}
+
+// With a scaled scanline the frames are still paced at the real rate, so
+// the T-states, and the audio samples clocked by them, run faster or
+// slower by the same ratio.
+uint32_t zx_paced_freq_hz(zx_t* sys) {
+    const uint64_t scanline_tstates = (sys->type == ZX_TYPE_128) ?
+        _ZX_128_SCANLINE_TSTATES : _ZX_48K_SCANLINE_TSTATES;
+    return (uint32_t)(sys->freq_hz*sys->scanline_tstates/scanline_tstates);
+}
+
+// A longer scanline gives the game more time between two interrupts, like
+// a longer scanline_period does with zx_exec().
+void zx_set_scanline_scale(zx_t* sys, int num, int den) {
+    CHIPS_ASSERT(sys && sys->valid && num > 0 && den > 0);
+    const int real = (sys->type == ZX_TYPE_128) ?
+        _ZX_128_SCANLINE_TSTATES : _ZX_48K_SCANLINE_TSTATES;
+    sys->scanline_tstates = real * num / den;
+    sys->frame_tstates = sys->scanline_tstates * sys->frame_scan_lines;
+}
+
+// Like zx_exec(), but the stop condition is the number of T-states really
+// executed, as counted by z80.h: each call runs one Spectrum frame, so
+// calling it 50 times per second runs the emulator at the real speed. The
+// last instruction usually ends a few T-states after the frame: the next
+// frame is shorter by the same amount, so there is no drift. The ULA and
+// the audio sampling are clocked by the same T-states, so the sound pitch
+// and the vblank interrupt are exact too.
+//
+// The first call (or the first after the T-states counter was reset by a
+// snapshot load) runs up to the end of the bitmap area, like zx_exec()
+// does: since the ULA frame is now as long as ours, all the following
+// frames end there as well.
+//
+// When the CPU gets parked at LD-BYTES the call returns early, so that the
+// tape block can be loaded: the next call completes the frame.
+uint32_t zx_exec_frame(zx_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    uint64_t pins = sys->pins;
+    const uint32_t start = sys->cpu.tstates;
+    const uint32_t last_bitmap_scanline = 64+192;
+
+    if ((uint32_t)(start - sys->audio_tstates) > sys->frame_tstates)
+        sys->audio_tstates = start;
+
+    // Out of sync if the end of the frame is in the past, or too far in
+    // the future. Two frames are surely enough to reach the last bitmap
+    // scanline.
+    const bool sync = (uint32_t)(sys->frame_end - start) - 1 >= sys->frame_tstates;
+    if (sync) sys->frame_end = start + sys->frame_tstates*2;
+
+    while ((int32_t)(sys->cpu.tstates - sys->frame_end) < 0 && !sys->tape_trap) {
+        if (sync && sys->scanline_y == last_bitmap_scanline) {
+            sys->frame_end = sys->cpu.tstates;
+            break;
+        }
+        pins = _zx_tick(sys, pins, true);
+
+        // Audio buffer handling: one sample every
+        // ZX_AUDIO_TICKS_PER_SAMPLE T-states.
+        while ((int32_t)(sys->cpu.tstates - sys->audio_tstates) >= 0) {
+            sys->audio_tstates += ZX_AUDIO_TICKS_PER_SAMPLE;
+            if (SPEAKER_PIN != -1) _zx_audio_sample(sys);
+        }
+    }
+    if (!sys->tape_trap) sys->frame_end += sys->frame_tstates;
+    sys->pins = pins;
+    kbd_update(&sys->kbd, zx_frame_ns(sys)/1000);
+    return sys->cpu.tstates - start;
+}
+
 void zx_key_down(zx_t* sys, int key_code) {
     CHIPS_ASSERT(sys && sys->valid);
     switch (sys->joystick_type) {
@@ -501,10 +954,26 @@ void zx_joystick(zx_t* sys, uint8_t mask) {
 
 static void _zx_init_memory_map(zx_t* sys) {
     mem_init(&sys->mem);
+    _zx_update_memory_map(sys);
+}
+
+// map ROM and RAM according to the model and the last write to 0x7FFD:
+// bits 0-2 RAM bank at 0xC000, bit 3 screen in bank 7, bit 4 ROM 1,
+// bit 5 disables paging until reset
+static void _zx_update_memory_map(zx_t* sys) {
+    const uint8_t cfg = sys->last_mem_config;
+    int rom = 0;
+    int c000_bank = 0;
+    if (sys->type == ZX_TYPE_128) {
+        rom = (cfg>>4) & 1;
+        c000_bank = cfg & 7;
+        sys->display_ram_bank = (cfg & (1<<3)) ? 7 : 5;
+        sys->memory_paging_disabled = 0 != (cfg & (1<<5));
+    }
     mem_map_ram(&sys->mem, 0, 0x4000, 0x4000, sys->ram[0]);
     mem_map_ram(&sys->mem, 0, 0x8000, 0x4000, sys->ram[1]);
-    mem_map_ram(&sys->mem, 0, 0xC000, 0x4000, sys->ram[2]);
-    mem_map_rom(&sys->mem, 0, 0x0000, 0x4000, sys->rom[0]);
+    mem_map_ram(&sys->mem, 0, 0xC000, 0x4000, zx_ram_bank(sys, c000_bank));
+    mem_map_rom(&sys->mem, 0, 0x0000, 0x4000, sys->rom[rom]);
 }
 
 static void _zx_init_keyboard_matrix(zx_t* sys) {
@@ -625,6 +1094,26 @@ static bool _zx_overflow(const uint8_t* ptr, intptr_t num_bytes, const uint8_t*
     return (ptr + num_bytes) > end_ptr;
 }
 
+// hardware mode of version 2 (23 bytes extended header) and 3 files
+static bool _zx_z80_is_128(const _zx_z80_ext_header* ext_hdr) {
+    int ext_hdr_len = (ext_hdr->len_h<<8)|ext_hdr->len_l;
+    return ext_hdr->hw_mode >= ((ext_hdr_len == 23) ? 3 : 4);
+}
+
+zx_type_t zx_quickload_type(chips_range_t data) {
+    const uint8_t* ptr = data.ptr;
+    const uint8_t* end_ptr = ptr + data.size;
+    if (_zx_overflow(ptr, sizeof(_zx_z80_header)+sizeof(_zx_z80_ext_header), end_ptr)) {
+        return ZX_TYPE_48K;
+    }
+    const _zx_z80_header* hdr = (const _zx_z80_header*) ptr;
+    if ((hdr->PC_h<<8 | hdr->PC_l) != 0) {
+        return ZX_TYPE_48K;     // version 1
+    }
+    const _zx_z80_ext_header* ext_hdr = (const _zx_z80_ext_header*) (ptr + sizeof(_zx_z80_header));
+    return _zx_z80_is_128(ext_hdr) ? ZX_TYPE_128 : ZX_TYPE_48K;
+}
+
 bool zx_quickload(zx_t* sys, chips_range_t data) {
     CHIPS_ASSERT(data.ptr && (data.size > 0));
     uint8_t* ptr = data.ptr;
@@ -644,11 +1133,23 @@ bool zx_quickload(zx_t* sys, chips_range_t data) {
         ext_hdr = (_zx_z80_ext_header*) ptr;
         int ext_hdr_len = (ext_hdr->len_h<<8)|ext_hdr->len_l;
         ptr += 2 + ext_hdr_len;
-        if (ext_hdr->hw_mode >= 3) {
+        const zx_type_t type = _zx_z80_is_128(ext_hdr) ? ZX_TYPE_128 : ZX_TYPE_48K;
+        if (type != sys->type) {
             return false;
         }
     }
+    else if (sys->type != ZX_TYPE_48K) {
+        return false;
+    }
     const bool v1_compr = 0 != (hdr->flags0 & (1<<5));
+    if (is_version1 && !v1_compr) {
+        // uncompressed version 1: a plain 48k RAM image
+        if (_zx_overflow(ptr, 0xC000, end_ptr)) {
+            return false;
+        }
+        memcpy(sys->ram, ptr, 0xC000);
+        ptr = (uint8_t*) end_ptr;
+    }
     while (ptr < end_ptr) {
         int page_index = 0;
         int src_len = 0;
@@ -669,16 +1170,24 @@ bool zx_quickload(zx_t* sys, chips_range_t data) {
             if ((page_index < 0) || (page_index > 7)) {
                 page_index = -1;
             }
+            else if ((sys->type == ZX_TYPE_48K) && (page_index > 2)) {
+                page_index = -1;
+            }
         }
         uint8_t* dst_ptr;
         if (-1 == page_index) {
             dst_ptr = NULL;
+        } else if (sys->type == ZX_TYPE_128) {
+            dst_ptr = zx_ram_bank(sys, page_index);
         } else {
             dst_ptr = sys->ram[page_index];
         }
         if (0xFFFF == src_len) {
-            // FIXME: uncompressed not supported yet
-            return false;
+            // uncompressed page: bulk copy
+            if (_zx_overflow(ptr, 0x4000, end_ptr)) {
+                return false;
+            }
+            if (dst_ptr) memcpy(dst_ptr, ptr, 0x4000);
         }
         else {
             // compressed
@@ -757,9 +1266,221 @@ bool zx_quickload(zx_t* sys, chips_range_t data) {
         sys->pins = z80_prefetch(&sys->cpu, (hdr->PC_h<<8)|hdr->PC_l);
     }
     sys->border_color = (hdr->flags0>>1) & 7;
+    if (sys->type == ZX_TYPE_128) {
+        sys->last_mem_config = ext_hdr->out_7ffd;
+        _zx_update_memory_map(sys);
+    }
     return true;
 }
 
+// 48K .SNA layout: 27 bytes of registers followed by the RAM image,
+// the PC is on the stack
+typedef struct {
+    uint8_t I;
+    uint8_t L_, H_, E_, D_, C_, B_, F_, A_;
+    uint8_t L, H, E, D, C, B;
+    uint8_t IY_l, IY_h;
+    uint8_t IX_l, IX_h;
+    uint8_t IFF2;
+    uint8_t R;
+    uint8_t F, A;
+    uint8_t SP_l, SP_h;
+    uint8_t IM;
+    uint8_t border;
+} _zx_sna_header;
+
+bool zx_quickload_sna(zx_t* sys, chips_range_t data) {
+    CHIPS_ASSERT(data.ptr && (data.size > 0));
+    if (data.size != sizeof(_zx_sna_header) + 0xC000) {
+        return false;
+    }
+    const _zx_sna_header* hdr = (const _zx_sna_header*) data.ptr;
+    memcpy(sys->ram, (uint8_t*)data.ptr + sizeof(_zx_sna_header), 0xC000);
+
+    z80_reset(&sys->cpu);
+    sys->cpu.a = hdr->A; sys->cpu.f = hdr->F;
+    sys->cpu.b = hdr->B; sys->cpu.c = hdr->C;
+    sys->cpu.d = hdr->D; sys->cpu.e = hdr->E;
+    sys->cpu.h = hdr->H; sys->cpu.l = hdr->L;
+    sys->cpu.ix = (hdr->IX_h<<8)|hdr->IX_l;
+    sys->cpu.iy = (hdr->IY_h<<8)|hdr->IY_l;
+    sys->cpu.af2 = (hdr->A_<<8)|hdr->F_;
+    sys->cpu.bc2 = (hdr->B_<<8)|hdr->C_;
+    sys->cpu.de2 = (hdr->D_<<8)|hdr->E_;
+    sys->cpu.hl2 = (hdr->H_<<8)|hdr->L_;
+    sys->cpu.i = hdr->I;
+    sys->cpu.r = hdr->R;
+    sys->cpu.iff2 = 0 != (hdr->IFF2 & (1<<2));
+    sys->cpu.iff1 = sys->cpu.iff2;
+    sys->cpu.im = hdr->IM & 3;
+    // the snapshot was taken inside an interrupt: emulate the RETN
+    uint16_t sp = (hdr->SP_h<<8)|hdr->SP_l;
+    uint16_t pc = mem_rd(&sys->mem, sp) | (mem_rd(&sys->mem, sp+1)<<8);
+    sys->cpu.sp = sp+2;
+    sys->pins = z80_prefetch(&sys->cpu, pc);
+    sys->border_color = hdr->border & 7;
+    return true;
+}
+
+bool zx_tape_insert(zx_t* sys, chips_range_t data) {
+    CHIPS_ASSERT(sys && sys->valid && data.ptr);
+    zx_tape_t* tape = &sys->tape;
+    const uint8_t* p = (const uint8_t*) data.ptr;
+    if (data.size < 2) {
+        return false;
+    }
+    tape->ptr = p;
+    tape->size = data.size;
+    tape->tzx = (data.size >= 10) && !memcmp(p, "ZXTape!\x1A", 8);
+    tape->pos = tape->tzx ? 10 : 0;
+    sys->tape_trap = false;
+    return true;
+}
+
+void zx_tape_eject(zx_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    memset(&sys->tape, 0, sizeof(sys->tape));
+    sys->tape_trap = false;
+}
+
+static uint32_t _zx_tape_len(const uint8_t* p, int bytes) {
+    uint32_t len = 0;
+    for (int i = bytes-1; i >= 0; i--) {
+        len = (len<<8) | p[i];
+    }
+    return len;
+}
+
+// find the next data block (flag byte, data, checksum) and advance the
+// tape position past it, returns false at the end of the tape
+static bool _zx_tape_next_block(zx_tape_t* tape, chips_range_t* block) {
+    const uint8_t* p = tape->ptr;
+    while (tape->ptr && tape->pos < tape->size) {
+        uint32_t left = tape->size - tape->pos;
+        const uint8_t* b = p + tape->pos;
+        uint32_t hdr_len, data_len;
+        bool is_data = false;
+        if (!tape->tzx) {
+            // TAP: 16 bit length, then the block
+            if (left < 2) break;
+            hdr_len = 2; data_len = _zx_tape_len(b, 2);
+            is_data = true;
+        }
+        else {
+            // TZX: block id, then a block specific header. Near the end
+            // of the image, parse a zero padded copy of the header: the
+            // length check below will catch truncated blocks.
+            uint8_t pad[0x15] = {0};
+            const uint8_t* h = b;
+            if (left < sizeof(pad)) {
+                memcpy(pad, b, left);
+                h = pad;
+            }
+            const uint8_t* q = h + 1;
+            data_len = 0;
+            switch (h[0]) {
+                case 0x10: hdr_len = 5; data_len = _zx_tape_len(q+2, 2); is_data = true; break;
+                case 0x11: hdr_len = 0x13; data_len = _zx_tape_len(q+0x0F, 3); is_data = true; break;
+                case 0x12: hdr_len = 5; break;
+                case 0x13: hdr_len = 2; data_len = q[0]*2; break;
+                case 0x14: hdr_len = 0x0B; data_len = _zx_tape_len(q+7, 3); break;
+                case 0x15: hdr_len = 9; data_len = _zx_tape_len(q+5, 3); break;
+                case 0x18:
+                case 0x19: hdr_len = 5; data_len = _zx_tape_len(q, 4); break;
+                case 0x20: hdr_len = 3; break;
+                case 0x21: hdr_len = 2; data_len = q[0]; break;
+                case 0x22: hdr_len = 1; break;
+                case 0x23: hdr_len = 3; break;
+                case 0x24: hdr_len = 3; break;
+                case 0x25: hdr_len = 1; break;
+                case 0x26: hdr_len = 3; data_len = _zx_tape_len(q, 2)*2; break;
+                case 0x27: hdr_len = 1; break;
+                case 0x28: hdr_len = 3; data_len = _zx_tape_len(q, 2); break;
+                case 0x2A: hdr_len = 5; break;
+                case 0x2B: hdr_len = 6; break;
+                case 0x30: hdr_len = 2; data_len = q[0]; break;
+                case 0x31: hdr_len = 3; data_len = q[1]; break;
+                case 0x32: hdr_len = 3; data_len = _zx_tape_len(q, 2); break;
+                case 0x33: hdr_len = 2; data_len = q[0]*3; break;
+                case 0x35: hdr_len = 0x15; data_len = _zx_tape_len(q+0x10, 4); break;
+                case 0x5A: hdr_len = 10; break;
+                default: tape->pos = tape->size; return false; // unknown block
+            }
+        }
+        if (hdr_len + data_len > left) {
+            break;
+        }
+        tape->pos += hdr_len + data_len;
+        if (is_data && data_len > 0) {
+            block->ptr = (void*) (b + hdr_len);
+            block->size = data_len;
+            return true;
+        }
+    }
+    if (tape->ptr) {
+        tape->pos = tape->size;
+    }
+    return false;
+}
+
+bool zx_tape_has_blocks(zx_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    zx_tape_t tape = sys->tape;
+    chips_range_t block;
+    return _zx_tape_next_block(&tape, &block);
+}
+
+// This does what LD-BYTES would do with the next block of the tape:
+// A is the expected flag byte, the carry flag is set for LOAD and reset
+// for VERIFY, IX is the destination and DE the length. On return the
+// carry flag is set on success. Then the CPU continues from the RET at
+// the end of the routine.
+bool zx_tape_trap(zx_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    z80_t* cpu = &sys->cpu;
+    chips_range_t block;
+    bool ok = false;
+    uint8_t parity = 0;
+    sys->tape_trap = false;
+    if (_zx_tape_next_block(&sys->tape, &block)) {
+        const uint8_t* data = (const uint8_t*) block.ptr;
+        const bool verify = 0 == (cpu->f & Z80_CF);
+        parity = data[0];
+        if (data[0] == cpu->a) {
+            const uint32_t avail = block.size - 1;
+            const uint32_t len = (cpu->de < avail) ? cpu->de : avail;
+            ok = true;
+            for (uint32_t i = 1; i <= len; i++) {
+                parity ^= data[i];
+                if (verify) {
+                    ok &= mem_rd(&sys->mem, cpu->ix) == data[i];
+                }
+                else {
+                    mem_wr(&sys->mem, cpu->ix, data[i]);
+                }
+                cpu->ix++;
+                cpu->l = data[i];
+            }
+            cpu->de -= len;
+            if (len < avail) {
+                parity ^= data[len+1];  // checksum
+            }
+            else {
+                ok = false;             // block too short
+            }
+            ok &= parity == 0;
+        }
+    }
+    cpu->h = parity;
+    cpu->a = parity;
+    // as after the final 'CP 01' of LD-BYTES: carry set on success
+    cpu->f = ok ? (Z80_SF|Z80_HF|Z80_NF|Z80_CF) : 0;
+    // the ROM returns via SA/LD-RET, enabling the interrupts
+    cpu->iff1 = cpu->iff2 = true;
+    sys->pins = z80_prefetch(cpu, _ZX_LD_BYTES_RET);
+    return ok;
+}
+
 chips_display_info_t zx_display_info(zx_t* sys) {
     static const uint32_t palette[16] = {
         0xFF000000,     // std black
@@ -806,6 +1527,14 @@ uint32_t zx_save_snapshot(zx_t* sys, zx_t* dst) {
     CHIPS_ASSERT(sys && dst);
     *dst = *sys;
     mem_snapshot_onsave(&dst->mem, sys);
+    dst->audiobuf = 0;
+    dst->ay_queue = 0;
+    dst->ram_ext = 0;
+    dst->beam_screen = 0;
+    dst->border_log = 0;
+#ifdef ZX_COMPACT_STATE
+    dst->rom[0] = dst->rom[1] = 0;
+#endif
     return ZX_SNAPSHOT_VERSION;
 }
 
@@ -817,7 +1546,60 @@ bool zx_load_snapshot(zx_t* sys, uint32_t version, zx_t* src) {
     static zx_t im;
     im = *src;
     mem_snapshot_onload(&im.mem, sys);
+    im.audiobuf = sys->audiobuf;
+    im.audio_sample = sys->audio_sample;
+    im.ay_queue = sys->ay_queue;
+    im.ram_ext = sys->ram_ext;
+    im.beam_screen = sys->beam_screen;
+    im.border_log = sys->border_log;
+#ifdef ZX_COMPACT_STATE
+    im.rom[0] = sys->rom[0];
+    im.rom[1] = sys->rom[1];
+#endif
+    memcpy(im.io_map, sys->io_map, sizeof(im.io_map));
+    memcpy(im.io_handler, sys->io_handler, sizeof(im.io_handler));
+    im.io_handlers = sys->io_handlers;
     *sys = im;
+    // pointers to the ROMs and to ram_ext are not relative to zx_t
+    _zx_update_memory_map(sys);
+    _zx_ay_resync(sys);
+    return true;
+}
+
+uint32_t zx_save_snapshot_state(zx_t* sys, void* dst) {
+    CHIPS_ASSERT(sys && dst);
+    // Only the fields before the RAM banks are valid in 'im'.
+    zx_t* im = (zx_t*) dst;
+    memcpy(im, sys, ZX_SNAPSHOT_STATE_SIZE);
+    mem_snapshot_onsave(&im->mem, sys);
+    im->audiobuf = 0;
+    im->ay_queue = 0;
+    return ZX_SNAPSHOT_VERSION;
+}
+
+bool zx_load_snapshot_state(zx_t* sys, uint32_t version, const void* src) {
+    CHIPS_ASSERT(sys && src);
+    if (version != ZX_SNAPSHOT_VERSION) {
+        return false;
+    }
+    if (((const zx_t*)src)->type != sys->type) {
+        return false;
+    }
+    uint32_t* audiobuf = sys->audiobuf;
+    uint32_t audio_sample = sys->audio_sample;
+    ay38910_queue_t* ay_queue = sys->ay_queue;
+    memcpy(sys, src, ZX_SNAPSHOT_STATE_SIZE);
+    mem_snapshot_onload(&sys->mem, sys);
+    sys->audiobuf = audiobuf;
+    // The audio core follows our sample counter, that must not go back
+    // in time: queued AY writes would wait for it.
+    sys->audio_sample = audio_sample;
+    sys->ay_queue = ay_queue;
+    // The state may come from a different build, where the ROMs mapped
+    // in place are at a different address, and the 128K banks are not
+    // inside zx_t: map everything again.
+    _zx_update_memory_map(sys);
+    _zx_ay_resync(sys);
     return true;
 }
 